@@ -1,6 +1,9 @@
 #include "AABB.hpp"
 #include "Core/Asserts.hpp"
 
+#include <algorithm>
+#include <cmath>
+
 namespace Core
 {
 
@@ -45,37 +48,143 @@ namespace Core
         Ray newRay{};
         newRay.mOrigin = transform * ray.mOrigin;
         newRay.mDirection = glm::mat3x3(transform) * ray.mDirection;
-        newRay.mInverseDirection = glm::vec3(1.0f, 1.0f, 1.0f) / newRay.mDirection;
         newRay.mLenght = ray.mLenght;
+        newRay.precompute_traversal_data();
+
+        return newRay;
+    }
+
+    Ray transform_ray(const Ray& ray, const Affine_Transform& transform)
+    {
+        // Rays reaching an instance have already been through the top level traversal, which filled in their
+        // traversal data.
+        if(transform.m_type == Affine_Transform::Type::kIdentity)
+            return ray;
+
+        // t is unchanged by the transform as the direction isn't renormalised.
+        Ray newRay;
+        newRay.mLenght = ray.mLenght;
+
+        const glm::vec3 translation(transform.m_rows[0].w, transform.m_rows[1].w, transform.m_rows[2].w);
+        switch(transform.m_type)
+        {
+            case Affine_Transform::Type::kTranslation:
+                newRay.mOrigin = glm::vec4(glm::vec3(ray.mOrigin) + translation, 1.0f);
+                newRay.mDirection = ray.mDirection;
+                break;
+
+            case Affine_Transform::Type::kUniformScale:
+                newRay.mOrigin = glm::vec4((glm::vec3(ray.mOrigin) * transform.m_rows[0].x) + translation, 1.0f);
+                newRay.mDirection = ray.mDirection * transform.m_rows[0].x;
+                break;
+
+            default:
+                newRay.mOrigin = glm::vec4(transform.transform_point(glm::vec3(ray.mOrigin)), 1.0f);
+                newRay.mDirection = transform.transform_vector(ray.mDirection);
+                break;
+        }
+        newRay.precompute_traversal_data();
 
         return newRay;
     }
 
-    void Ray::push_index_of_refraction(const float IoR)
+    Affine_Transform::Affine_Transform(const glm::mat4x4& matrix)
+    {
+        PICO_ASSERT(matrix[0][3] == 0.0f && matrix[1][3] == 0.0f && matrix[2][3] == 0.0f && matrix[3][3] == 1.0f);
+
+        // glm matrices are column major.
+        for(uint32_t row = 0; row < 3; ++row)
+            m_rows[row] = glm::vec4(matrix[0][row], matrix[1][row], matrix[2][row], matrix[3][row]);
+
+        const glm::mat3x3 linear(matrix);
+        const float scale = linear[0][0];
+        if(matrix == glm::mat4x4(1.0f))
+            m_type = Type::kIdentity;
+        else if(linear == glm::mat3x3(1.0f))
+            m_type = Type::kTranslation;
+        else if(scale > 0.0f && linear == glm::mat3x3(scale))
+            m_type = Type::kUniformScale;
+        else
+            m_type = Type::kGeneral;
+    }
+
+    glm::mat4x4 Affine_Transform::to_matrix() const
+    {
+        return glm::transpose(glm::mat4x4(m_rows[0], m_rows[1], m_rows[2], glm::vec4(0.0f, 0.0f, 0.0f, 1.0f)));
+    }
+
+    Affine_Transform Affine_Transform::get_inverse() const
+    {
+        Affine_Transform inverse;
+        inverse.m_type = m_type;
+
+        if(m_type == Type::kGeneral)
+        {
+            const glm::mat3x3 linear = glm::inverse(glm::transpose(glm::mat3x3(glm::vec3(m_rows[0]), glm::vec3(m_rows[1]), glm::vec3(m_rows[2]))));
+            const glm::vec3 translation = -(linear * glm::vec3(m_rows[0].w, m_rows[1].w, m_rows[2].w));
+            for(uint32_t row = 0; row < 3; ++row)
+                inverse.m_rows[row] = glm::vec4(linear[0][row], linear[1][row], linear[2][row], translation[row]);
+
+            return inverse;
+        }
+
+        const float scale = 1.0f / m_rows[0].x;
+        for(uint32_t row = 0; row < 3; ++row)
+        {
+            inverse.m_rows[row] = glm::vec4(0.0f);
+            inverse.m_rows[row][row] = scale;
+            inverse.m_rows[row].w = -m_rows[row].w * scale;
+        }
+
+        return inverse;
+    }
+
+    void Ray::precompute_traversal_data()
     {
-        m_index_or_refraction_stack.push_back(IoR);
+        // Clamp axis aligned directions away from zero, an infinite inverse would turn
+        // origin * inverse direction in to inf - inf in the slab tests.
+        constexpr float kMinimumComponent = 1e-18f;
+        glm::vec3 direction = mDirection;
+        for(uint32_t i = 0; i < 3; ++i)
+        {
+            if(std::abs(direction[i]) < kMinimumComponent)
+                direction[i] = std::copysign(kMinimumComponent, direction[i]);
+        }
+
+        mInverseDirection = glm::vec3(1.0f, 1.0f, 1.0f) / direction;
+        mOriginInverseDirection = glm::vec3(mOrigin) * mInverseDirection;
+        mDirectionSigns = (mInverseDirection.x < 0.0f ? 1u : 0u) |
+                          (mInverseDirection.y < 0.0f ? 2u : 0u) |
+                          (mInverseDirection.z < 0.0f ? 4u : 0u);
     }
 
-    float Ray::pop_index_of_refraction()
+    void Path_State::push_index_of_refraction(const float IoR)
     {
-        PICO_ASSERT(!m_index_or_refraction_stack.empty());
-        const float IoR = m_index_or_refraction_stack.back();
-        m_index_or_refraction_stack.pop_back();
-        PICO_ASSERT(!m_index_or_refraction_stack.empty());
+        if(m_index_of_refraction_depth < kMaxIndexOfRefractionDepth)
+            m_index_of_refraction_stack[m_index_of_refraction_depth] = IoR;
+
+        ++m_index_of_refraction_depth;
+    }
+
+    float Path_State::pop_index_of_refraction()
+    {
+        PICO_ASSERT(m_index_of_refraction_depth > 1);
+        const float IoR = get_current_index_of_refraction();
+        --m_index_of_refraction_depth;
 
         return IoR;
     }
 
-    float Ray::get_current_index_of_refraction() const
+    float Path_State::get_current_index_of_refraction() const
     {
-        PICO_ASSERT(!m_index_or_refraction_stack.empty());
+        PICO_ASSERT(m_index_of_refraction_depth > 0);
 
-        return m_index_or_refraction_stack.back();
+        return m_index_of_refraction_stack[std::min(m_index_of_refraction_depth, kMaxIndexOfRefractionDepth) - 1];
     }
 
-    bool Ray::inside_geometry() const
+    bool Path_State::inside_geometry() const
     {
-        return m_index_or_refraction_stack.size() > 1; 
+        return m_index_of_refraction_depth > 1;
     }
 
     std::array<glm::vec4, 8> AABB::get_cube_as_vertex_array() const
@@ -118,12 +227,12 @@ namespace Core
         };
 
         // mTopFrontLeft is the corner of AABB with minimal coordinates - left top.
-        const float t1 = (mMinimum.x - ray.mOrigin.x) * ray.mInverseDirection.x;
-        const float t2 = (mMaximum.x - ray.mOrigin.x) * ray.mInverseDirection.x;
-        const float t3 = (mMinimum.y - ray.mOrigin.y) * ray.mInverseDirection.y;
-        const float t4 = (mMaximum.y - ray.mOrigin.y) * ray.mInverseDirection.y;
-        const float t5 = (mMinimum.z - ray.mOrigin.z) * ray.mInverseDirection.z;
-        const float t6 = (mMaximum.z - ray.mOrigin.z) * ray.mInverseDirection.z;
+        const float t1 = mMinimum.x * ray.mInverseDirection.x - ray.mOriginInverseDirection.x;
+        const float t2 = mMaximum.x * ray.mInverseDirection.x - ray.mOriginInverseDirection.x;
+        const float t3 = mMinimum.y * ray.mInverseDirection.y - ray.mOriginInverseDirection.y;
+        const float t4 = mMaximum.y * ray.mInverseDirection.y - ray.mOriginInverseDirection.y;
+        const float t5 = mMinimum.z * ray.mInverseDirection.z - ray.mOriginInverseDirection.z;
+        const float t6 = mMaximum.z * ray.mInverseDirection.z - ray.mOriginInverseDirection.z;
 
         // Keeping the old code here commented out as it's much easier to read than the newer optimised version.
         //float tmin = std::max(std::max(std::min(t1, t2), std::min(t3, t4)), std::min(t5, t6));
@@ -191,7 +300,7 @@ namespace Core
         return aabb;
     }
 
-    glm::vec3 AABB::get_offset(const glm::vec4& p)
+    glm::vec3 AABB::get_offset(const glm::vec4& p) const
     {
         glm::vec3 o = p - mMinimum;
         if (mMaximum.x > mMinimum.x) o.x /= mMaximum.x - mMinimum.x;
@@ -270,6 +379,25 @@ namespace Core
     }
 
 
+    AABB AABB::operator*(const Affine_Transform& transform) const
+    {
+        // Each output extent is the sum of the smallest and largest contributions of every input axis.
+        glm::vec3 smallest(transform.m_rows[0].w, transform.m_rows[1].w, transform.m_rows[2].w);
+        glm::vec3 largest = smallest;
+        for(uint32_t row = 0; row < 3; ++row)
+        {
+            for(uint32_t axis = 0; axis < 3; ++axis)
+            {
+                const float a = transform.m_rows[row][axis] * mMinimum[axis];
+                const float b = transform.m_rows[row][axis] * mMaximum[axis];
+                smallest[row] += std::min(a, b);
+                largest[row] += std::max(a, b);
+            }
+        }
+
+        return AABB{glm::vec4(smallest, 1.0f), glm::vec4(largest, 1.0f)};
+    }
+
     AABB AABB::operator*(const glm::vec4& vec) const
     {
         return AABB{ mMinimum * vec, mMaximum * vec };
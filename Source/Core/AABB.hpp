@@ -2,10 +2,12 @@
 #define AABB_HPP
 
 #include <array>
+#include <type_traits>
 #include <vector>
 
 #include "glm/vec3.hpp"
 #include "glm/mat4x4.hpp"
+#include "glm/geometric.hpp"
 
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
@@ -21,16 +23,32 @@ namespace Core
         Partial = 1 << 2,
     };
 
+    // Only what traversal needs, so rays are cheap to copy in to each instance's space.
     struct Ray
     {
         glm::vec4 mOrigin;
         glm::vec3 mDirection;
-        glm::vec3 mInverseDirection;
         float     mLenght;
 
-        glm::vec3 m_payload;
-        glm::vec3 m_throughput;
+        // Per ray data used by the slab tests, filled in by precompute_traversal_data.
+        glm::vec3 mInverseDirection;
+        glm::vec3 mOriginInverseDirection;
+        uint32_t  mDirectionSigns; // Bit n is set if the direction is negative along axis n.
+
+        void precompute_traversal_data();
+    };
+    static_assert(std::is_trivially_copyable_v<Ray>, "rays are copied per instance");
+
+    // State carried along a path between bounces.
+    struct Path_State
+    {
+        static constexpr uint32_t kMaxIndexOfRefractionDepth = 8;
+
+        glm::vec3 m_payload{0.0f, 0.0f, 0.0f};
+        glm::vec3 m_throughput{1.0f, 1.0f, 1.0f};
 
+        // Paths nested deeper than kMaxIndexOfRefractionDepth keep using the innermost index of refraction that
+        // was stored until they have left the extra objects.
         void push_index_of_refraction(const float);
         float pop_index_of_refraction();
         float get_current_index_of_refraction() const;
@@ -38,10 +56,56 @@ namespace Core
 
     private:
 
-        std::vector<float> m_index_or_refraction_stack;
+        // Paths start in air.
+        float    m_index_of_refraction_stack[kMaxIndexOfRefractionDepth] = {1.0f};
+        uint32_t m_index_of_refraction_depth = 1;
+    };
+    static_assert(std::is_trivially_copyable_v<Path_State>, "path state is kept per ray in packets");
+
+    // Affine transform stored as the top three rows of a 4x4 matrix.
+    struct Affine_Transform
+    {
+        // Transforms without rotation or non uniform scale take cheaper paths.
+        enum class Type : uint8_t
+        {
+            kIdentity, // Instances already in world space.
+            kTranslation,
+            kUniformScale,
+            kGeneral
+        };
+
+        Affine_Transform() = default;
+        explicit Affine_Transform(const glm::mat4x4&);
+
+        glm::vec3 transform_point(const glm::vec3& p) const
+        {
+            return glm::vec3(glm::dot(glm::vec3(m_rows[0]), p) + m_rows[0].w,
+                             glm::dot(glm::vec3(m_rows[1]), p) + m_rows[1].w,
+                             glm::dot(glm::vec3(m_rows[2]), p) + m_rows[2].w);
+        }
+
+        glm::vec3 transform_vector(const glm::vec3& v) const
+        {
+            return glm::vec3(glm::dot(glm::vec3(m_rows[0]), v), glm::dot(glm::vec3(m_rows[1]), v), glm::dot(glm::vec3(m_rows[2]), v));
+        }
+
+        // Multiplies by the transpose of the 3x3 part, called on an inverse transform this moves normals the
+        // other way without storing a separate normal matrix.
+        glm::vec3 transform_transposed(const glm::vec3& v) const
+        {
+            return (v.x * glm::vec3(m_rows[0])) + (v.y * glm::vec3(m_rows[1])) + (v.z * glm::vec3(m_rows[2]));
+        }
+
+        glm::mat4x4 to_matrix() const;
+
+        Affine_Transform get_inverse() const;
+
+        glm::vec4 m_rows[3];
+        Type      m_type;
     };
 
     Ray transform_ray(const Ray&, const glm::mat4x4& transform);
+    Ray transform_ray(const Ray&, const Affine_Transform& transform);
 
     // Return a vector constructed from the minimum/maximum of each component.
     glm::vec3 component_wise_min(const glm::vec3& lhs, const glm::vec3& rhs);
@@ -108,6 +172,7 @@ namespace Core
         AABB& operator-=(const glm::vec4&);
 
         AABB operator*(const glm::mat4&) const;
+        AABB operator*(const Affine_Transform&) const;
 
         AABB operator*(const glm::vec4&) const;
         AABB operator+(const glm::vec4&) const;
@@ -134,7 +199,7 @@ namespace Core
             return 2.0f * ((side_lenghts.x * side_lenghts.y) + (side_lenghts.x * side_lenghts.z) + (side_lenghts.y * side_lenghts.z));
         }
 
-        glm::vec3 get_offset(const glm::vec4& p);
+        glm::vec3 get_offset(const glm::vec4& p) const;
 
     private:
 
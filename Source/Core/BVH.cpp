@@ -3,114 +3,1978 @@
 #include <limits>
 #include <algorithm>
 #include <array>
+#include <bit>
+#include <chrono>
+#include <cstring>
+#include <iterator>
 
 #include "Core/Asserts.hpp"
+#include "Core/ThreadPool.hpp"
+#include "Core/Sorting.hpp"
 #include "LowerLevelBVH.hpp"
 
+#if defined(__SSE2__) || defined(_M_X64)
+#define PICO_BVH_USE_SSE
+#include <immintrin.h>
+#endif
+
+namespace
+{
+    struct Traversal_Stack_Entry
+    {
+        Core::Acceleration_Structures::NodeIndex m_node;
+        float m_distance;
+    };
+
+    // Slab test against the bounds stored in FlatBVH nodes, the direction signs select the
+    // near and far planes directly so no min/max is needed per axis.
+    float node_intersection_distance(const glm::vec3 (&bounds)[2], const Core::Ray& ray)
+    {
+        const uint32_t x_sign = ray.mDirectionSigns & 1u;
+        const uint32_t y_sign = (ray.mDirectionSigns >> 1u) & 1u;
+        const uint32_t z_sign = (ray.mDirectionSigns >> 2u) & 1u;
+
+        const float tx_near = bounds[x_sign].x * ray.mInverseDirection.x - ray.mOriginInverseDirection.x;
+        const float tx_far = bounds[1u - x_sign].x * ray.mInverseDirection.x - ray.mOriginInverseDirection.x;
+        const float ty_near = bounds[y_sign].y * ray.mInverseDirection.y - ray.mOriginInverseDirection.y;
+        const float ty_far = bounds[1u - y_sign].y * ray.mInverseDirection.y - ray.mOriginInverseDirection.y;
+        const float tz_near = bounds[z_sign].z * ray.mInverseDirection.z - ray.mOriginInverseDirection.z;
+        const float tz_far = bounds[1u - z_sign].z * ray.mInverseDirection.z - ray.mOriginInverseDirection.z;
+
+        const float tmin = std::max(std::max(tx_near, ty_near), tz_near);
+        const float tmax = std::min(std::min(tx_far, ty_far), tz_far);
+
+        if (tmax < 0 || tmin > tmax)
+        {
+            return INFINITY;
+        }
+
+        return tmin;
+    }
+
+    // Slab test against all children of a WideBVH node, returns a bit mask of the children that
+    // were hit closer than closest_distance and writes their entry distances to distances.
+    template<uint32_t W>
+    uint32_t child_intersection_mask(const float (&bounds)[6][W], const Core::Ray& ray, const float closest_distance, float* distances)
+    {
+        // Rows holding the near and far planes along each axis.
+        const uint32_t x_near = (ray.mDirectionSigns & 1u) ? 3 : 0;
+        const uint32_t y_near = (ray.mDirectionSigns & 2u) ? 4 : 1;
+        const uint32_t z_near = (ray.mDirectionSigns & 4u) ? 5 : 2;
+        const uint32_t x_far = 3 - x_near;
+        const uint32_t y_far = 5 - y_near;
+        const uint32_t z_far = 7 - z_near;
+
+#if defined(__AVX__)
+        if constexpr (W == 8)
+        {
+            const __m256 origin_x = _mm256_set1_ps(ray.mOriginInverseDirection.x);
+            const __m256 origin_y = _mm256_set1_ps(ray.mOriginInverseDirection.y);
+            const __m256 origin_z = _mm256_set1_ps(ray.mOriginInverseDirection.z);
+            const __m256 inverse_x = _mm256_set1_ps(ray.mInverseDirection.x);
+            const __m256 inverse_y = _mm256_set1_ps(ray.mInverseDirection.y);
+            const __m256 inverse_z = _mm256_set1_ps(ray.mInverseDirection.z);
+
+            const __m256 tx_near = _mm256_sub_ps(_mm256_mul_ps(_mm256_load_ps(bounds[x_near]), inverse_x), origin_x);
+            const __m256 ty_near = _mm256_sub_ps(_mm256_mul_ps(_mm256_load_ps(bounds[y_near]), inverse_y), origin_y);
+            const __m256 tz_near = _mm256_sub_ps(_mm256_mul_ps(_mm256_load_ps(bounds[z_near]), inverse_z), origin_z);
+            const __m256 tx_far = _mm256_sub_ps(_mm256_mul_ps(_mm256_load_ps(bounds[x_far]), inverse_x), origin_x);
+            const __m256 ty_far = _mm256_sub_ps(_mm256_mul_ps(_mm256_load_ps(bounds[y_far]), inverse_y), origin_y);
+            const __m256 tz_far = _mm256_sub_ps(_mm256_mul_ps(_mm256_load_ps(bounds[z_far]), inverse_z), origin_z);
+
+            const __m256 tmin = _mm256_max_ps(_mm256_max_ps(tx_near, ty_near), tz_near);
+            const __m256 tmax = _mm256_min_ps(_mm256_min_ps(tx_far, ty_far), tz_far);
+
+            const __m256 hit = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(tmax, _mm256_setzero_ps(), _CMP_GE_OQ), _mm256_cmp_ps(tmin, tmax, _CMP_LE_OQ)),
+                                             _mm256_cmp_ps(tmin, _mm256_set1_ps(closest_distance), _CMP_LT_OQ));
+
+            _mm256_storeu_ps(distances, tmin);
+            return _mm256_movemask_ps(hit);
+        }
+        else
+#endif
+        {
+#ifdef PICO_BVH_USE_SSE
+            const __m128 origin_x = _mm_set1_ps(ray.mOriginInverseDirection.x);
+            const __m128 origin_y = _mm_set1_ps(ray.mOriginInverseDirection.y);
+            const __m128 origin_z = _mm_set1_ps(ray.mOriginInverseDirection.z);
+            const __m128 inverse_x = _mm_set1_ps(ray.mInverseDirection.x);
+            const __m128 inverse_y = _mm_set1_ps(ray.mInverseDirection.y);
+            const __m128 inverse_z = _mm_set1_ps(ray.mInverseDirection.z);
+            const __m128 closest = _mm_set1_ps(closest_distance);
+
+            uint32_t mask = 0;
+            for(uint32_t lane = 0; lane < W; lane += 4)
+            {
+                const __m128 tx_near = _mm_sub_ps(_mm_mul_ps(_mm_load_ps(&bounds[x_near][lane]), inverse_x), origin_x);
+                const __m128 ty_near = _mm_sub_ps(_mm_mul_ps(_mm_load_ps(&bounds[y_near][lane]), inverse_y), origin_y);
+                const __m128 tz_near = _mm_sub_ps(_mm_mul_ps(_mm_load_ps(&bounds[z_near][lane]), inverse_z), origin_z);
+                const __m128 tx_far = _mm_sub_ps(_mm_mul_ps(_mm_load_ps(&bounds[x_far][lane]), inverse_x), origin_x);
+                const __m128 ty_far = _mm_sub_ps(_mm_mul_ps(_mm_load_ps(&bounds[y_far][lane]), inverse_y), origin_y);
+                const __m128 tz_far = _mm_sub_ps(_mm_mul_ps(_mm_load_ps(&bounds[z_far][lane]), inverse_z), origin_z);
+
+                const __m128 tmin = _mm_max_ps(_mm_max_ps(tx_near, ty_near), tz_near);
+                const __m128 tmax = _mm_min_ps(_mm_min_ps(tx_far, ty_far), tz_far);
+
+                const __m128 hit = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(tmax, _mm_setzero_ps()), _mm_cmple_ps(tmin, tmax)), _mm_cmplt_ps(tmin, closest));
+
+                _mm_storeu_ps(distances + lane, tmin);
+                mask |= static_cast<uint32_t>(_mm_movemask_ps(hit)) << lane;
+            }
+
+            return mask;
+#else
+            uint32_t mask = 0;
+            for(uint32_t lane = 0; lane < W; ++lane)
+            {
+                const float tmin = std::max(std::max(bounds[x_near][lane] * ray.mInverseDirection.x - ray.mOriginInverseDirection.x,
+                                                     bounds[y_near][lane] * ray.mInverseDirection.y - ray.mOriginInverseDirection.y),
+                                                     bounds[z_near][lane] * ray.mInverseDirection.z - ray.mOriginInverseDirection.z);
+                const float tmax = std::min(std::min(bounds[x_far][lane] * ray.mInverseDirection.x - ray.mOriginInverseDirection.x,
+                                                     bounds[y_far][lane] * ray.mInverseDirection.y - ray.mOriginInverseDirection.y),
+                                                     bounds[z_far][lane] * ray.mInverseDirection.z - ray.mOriginInverseDirection.z);
+
+                distances[lane] = tmin;
+                // Written so that the NaN bounds of unused slots fail the test.
+                if(tmax >= 0.0f && tmin <= tmax && tmin < closest_distance)
+                    mask |= 1u << lane;
+            }
+
+            return mask;
+#endif
+        }
+    }
+
+    // Wide traversal shared by the WideBVH layouts, get_node returns a WideBVH node (or a decoded copy of one) for a
+    // node index. Visits the leaves hit by the ray front to back as ranges of the primitive array, culling against
+    // intersection_distance, and stops as soon as visit_leaf returns true.
+    template<uint32_t W, typename G, typename F>
+    void traverse_wide_nodes(G&& get_node, Core::Ray& ray, float& intersection_distance, F&& visit_leaf)
+    {
+        ray.precompute_traversal_data();
+
+        // Every level can push all but one of its children.
+        Traversal_Stack_Entry node_stack[Core::Acceleration_Structures::kMaxTraversalDepth * (W - 1) + 1];
+        uint32_t stack_size = 0;
+        node_stack[stack_size++] = {0, -INFINITY};
+
+        while(stack_size > 0)
+        {
+            const Traversal_Stack_Entry entry = node_stack[--stack_size];
+
+            // The closest intersection may have moved in front of this node since it was pushed.
+            if(entry.m_distance >= intersection_distance)
+                continue;
+
+            const auto& node = get_node(entry.m_node);
+
+            float child_distances[W];
+            uint32_t hit_mask = child_intersection_mask<W>(node.m_bounds, ray, intersection_distance, child_distances);
+
+            // Order the hit children front to back.
+            uint32_t ordered_children[W];
+            uint32_t hit_count = 0;
+            while(hit_mask != 0)
+            {
+                const uint32_t child = std::countr_zero(hit_mask);
+                hit_mask &= hit_mask - 1;
+
+                uint32_t i = hit_count++;
+                for(; i > 0 && child_distances[ordered_children[i - 1]] > child_distances[child]; --i)
+                    ordered_children[i] = ordered_children[i - 1];
+                ordered_children[i] = child;
+            }
+
+            // Intersect leaves straight away, nearest first, so the closest distance shrinks before any nodes are pushed.
+            for(uint32_t i = 0; i < hit_count; ++i)
+            {
+                const uint32_t child = ordered_children[i];
+                if(!node.is_leaf(child) || child_distances[child] >= intersection_distance)
+                    continue;
+
+                if(visit_leaf(node.m_children[child], node.m_primitive_counts[child]))
+                    return;
+            }
+
+            // Push the furthest child first so that the nearest is visited next.
+            PICO_ASSERT(stack_size + hit_count <= std::size(node_stack));
+            for(uint32_t i = hit_count; i > 0; --i)
+            {
+                const uint32_t child = ordered_children[i - 1];
+                if(!node.is_leaf(child) && child_distances[child] < intersection_distance)
+                    node_stack[stack_size++] = {node.m_children[child], child_distances[child]};
+            }
+        }
+    }
+
+    // Walks a packet through the tree with a shared stack, each entry keeps the mask of rays that hit it.
+    // visit_leaf is passed the leaf range and the rays that hit it, and returns the rays that are finished.
+    template<uint32_t W, typename G, typename F>
+    void traverse_wide_nodes_packet(G&& get_node, Core::Ray* rays, uint32_t ray_mask, const float* intersection_distances, F&& visit_leaf)
+    {
+        for(uint32_t mask = ray_mask; mask != 0; mask &= mask - 1)
+            rays[std::countr_zero(mask)].precompute_traversal_data();
+
+        struct Packet_Stack_Entry
+        {
+            Core::Acceleration_Structures::NodeIndex m_node;
+            uint32_t  m_ray_mask;
+            float     m_distance; // Nearest entry distance of any of the rays.
+        };
+
+        Packet_Stack_Entry node_stack[Core::Acceleration_Structures::kMaxTraversalDepth * (W - 1) + 1];
+        uint32_t stack_size = 0;
+        node_stack[stack_size++] = {0, ray_mask, -INFINITY};
+
+        while(stack_size > 0)
+        {
+            const Packet_Stack_Entry entry = node_stack[--stack_size];
+
+            const uint32_t active_rays = entry.m_ray_mask & ray_mask;
+            if(active_rays == 0)
+                continue;
+
+            // Skip the node if every ray's closest intersection has moved in front of it since it was pushed.
+            float furthest_distance = -INFINITY;
+            for(uint32_t mask = active_rays; mask != 0; mask &= mask - 1)
+                furthest_distance = std::max(furthest_distance, intersection_distances[std::countr_zero(mask)]);
+            if(entry.m_distance >= furthest_distance)
+                continue;
+
+            const auto& node = get_node(entry.m_node);
+
+            // Each ray tests all of the children at once, the child masks record which rays hit them.
+            uint32_t child_rays[W] = {};
+            float child_distances[W];
+            std::fill(std::begin(child_distances), std::end(child_distances), INFINITY);
+            for(uint32_t mask = active_rays; mask != 0; mask &= mask - 1)
+            {
+                const uint32_t r = std::countr_zero(mask);
+
+                float distances[W];
+                for(uint32_t hit_mask = child_intersection_mask<W>(node.m_bounds, rays[r], intersection_distances[r], distances); hit_mask != 0; hit_mask &= hit_mask - 1)
+                {
+                    const uint32_t child = std::countr_zero(hit_mask);
+                    child_rays[child] |= 1u << r;
+                    child_distances[child] = std::min(child_distances[child], distances[child]);
+                }
+            }
+
+            // Order the hit children front to back.
+            uint32_t ordered_children[W];
+            uint32_t hit_count = 0;
+            for(uint32_t child = 0; child < W; ++child)
+            {
+                if(child_rays[child] == 0)
+                    continue;
+
+                uint32_t i = hit_count++;
+                for(; i > 0 && child_distances[ordered_children[i - 1]] > child_distances[child]; --i)
+                    ordered_children[i] = ordered_children[i - 1];
+                ordered_children[i] = child;
+            }
+
+            // Intersect leaves straight away, nearest first, so the closest distances shrink before any nodes are pushed.
+            for(uint32_t i = 0; i < hit_count; ++i)
+            {
+                const uint32_t child = ordered_children[i];
+                if(!node.is_leaf(child) || (child_rays[child] & ray_mask) == 0)
+                    continue;
+
+                ray_mask &= ~visit_leaf(node.m_children[child], node.m_primitive_counts[child], child_rays[child] & ray_mask);
+                if(ray_mask == 0)
+                    return;
+            }
+
+            // Push the furthest child first so that the nearest is visited next.
+            PICO_ASSERT(stack_size + hit_count <= std::size(node_stack));
+            for(uint32_t i = hit_count; i > 0; --i)
+            {
+                const uint32_t child = ordered_children[i - 1];
+                if(!node.is_leaf(child))
+                    node_stack[stack_size++] = {node.m_children[child], child_rays[child], child_distances[child]};
+            }
+        }
+    }
+
+    // Nodes with fewer primitives than this are built on a single thread.
+    constexpr uint32_t kParallelSubtreeThreshold = 4096;
+    // Nodes with more primitives than this have their bounds and SAH buckets computed in parallel.
+    constexpr uint32_t kParallelBinningThreshold = 1u << 16;
+
+    // PLOC searches this many clusters either side for the cheapest one to merge with.
+    constexpr size_t kPLOCSearchRadius = 8;
+    // 30 bit codes need half the radix sort passes, 63 bit codes keep large meshes from collapsing in to shared codes.
+    constexpr size_t kWideMortonCodeThreshold = 1u << 20;
+
+    Core::AABB empty_bounds()
+    {
+        return Core::AABB(glm::vec4(INFINITY, INFINITY, INFINITY, INFINITY), -glm::vec4(INFINITY, INFINITY, INFINITY, INFINITY));
+    }
+
+    // Relative cost of visiting a node against intersecting a primitive, as used by the SAH partitioning.
+    constexpr float kSAHTraversalCost = 0.125f;
+
+    // Levels with fewer nodes than this are refit on the calling thread.
+    constexpr size_t kParallelRefitThreshold = 64;
+
+    // Bounds of a child of a WideBVH node, or of a decoded CompressedWideBVH node.
+    template<uint32_t W>
+    Core::AABB get_child_bounds(const float (&bounds)[6][W], const uint32_t child)
+    {
+        return Core::AABB(glm::vec4(bounds[0][child], bounds[1][child], bounds[2][child], 1.0f),
+                          glm::vec4(bounds[3][child], bounds[4][child], bounds[5][child], 1.0f));
+    }
+
+    // Union of the used child slots of a wide node.
+    template<uint32_t W, typename Node>
+    Core::AABB get_wide_node_bounds(const Node& node)
+    {
+        Core::AABB bounds = empty_bounds();
+        for(uint32_t i = 0; i < W; ++i)
+        {
+            if(node.m_children[i] != Core::Acceleration_Structures::kInvalidNodeIndex)
+                bounds.union_of(get_child_bounds<W>(node.m_bounds, i));
+        }
+
+        return bounds;
+    }
+
+    // SAH cost of a wide node's children relative to the root's surface area.
+    template<uint32_t W, typename Node>
+    float get_wide_node_sah_cost(const Node& node, const float root_area)
+    {
+        float cost = 0.0f;
+        for(uint32_t i = 0; i < W; ++i)
+        {
+            if(node.m_children[i] == Core::Acceleration_Structures::kInvalidNodeIndex)
+                continue;
+
+            // Children refit around nothing, such as removed instances, can't be reached.
+            const Core::AABB bounds = get_child_bounds<W>(node.m_bounds, i);
+            if(bounds.get_min().x > bounds.get_max().x)
+                continue;
+
+            const float area = bounds.get_surface_area() / root_area;
+            cost += area * (node.is_leaf(i) ? static_cast<float>(node.m_primitive_counts[i]) : kSAHTraversalCost);
+        }
+
+        return cost;
+    }
+
+    // Refits a tree whose children are always stored after their parents one level at a time, deepest first, so
+    // each level only reads nodes that are already up to date. for_each_child calls its visitor with every
+    // interior child of a node and refit_node recomputes a node's child bounds.
+    template<typename C, typename R>
+    void refit_by_level(ThreadPool* pool, const size_t node_count, C&& for_each_child, R&& refit_node)
+    {
+        std::vector<uint32_t> depths(node_count, 0);
+        uint32_t max_depth = 0;
+        for(Core::Acceleration_Structures::NodeIndex n = 0; n < node_count; ++n)
+        {
+            for_each_child(n, [&](const Core::Acceleration_Structures::NodeIndex child)
+            {
+                depths[child] = depths[n] + 1;
+                max_depth = std::max(max_depth, depths[child]);
+            });
+        }
+
+        // Counting sort of the nodes by depth.
+        std::vector<uint32_t> level_starts(max_depth + 2, 0);
+        for(const uint32_t depth : depths)
+            ++level_starts[depth + 1];
+        for(uint32_t level = 1; level < level_starts.size(); ++level)
+            level_starts[level] += level_starts[level - 1];
+
+        std::vector<Core::Acceleration_Structures::NodeIndex> order(node_count);
+        std::vector<uint32_t> next(level_starts.begin(), level_starts.end() - 1);
+        for(Core::Acceleration_Structures::NodeIndex n = 0; n < node_count; ++n)
+            order[next[depths[n]]++] = n;
+
+        for(uint32_t level = max_depth + 1; level > 0; --level)
+        {
+            const uint32_t begin = level_starts[level - 1];
+            const uint32_t count = level_starts[level] - begin;
+            for_each_chunk(count >= kParallelRefitThreshold ? pool : nullptr, count, [&](const size_t, const size_t chunk_begin, const size_t chunk_end)
+            {
+                for(size_t i = chunk_begin; i < chunk_end; ++i)
+                    refit_node(order[begin + i]);
+            });
+        }
+    }
+
+    // Cell size of a CompressedWideBVH grid axis, exponents are kept in the normal float range.
+    constexpr int32_t kMinQuantizationExponent = -126;
+    constexpr int32_t kMaxQuantizationExponent = 127;
+
+    float get_quantization_scale(const int32_t exponent)
+    {
+        return std::bit_cast<float>(static_cast<uint32_t>(exponent + 127) << 23);
+    }
+
+    // Grid position of a quantized plane, the encoder and decoder must agree on this exactly.
+    float dequantize(const float origin, const float scale, const uint8_t q)
+    {
+        return origin + (static_cast<float>(q) * scale);
+    }
+
+    // Sets the node's grid to span the children and rounds each child's bounds outwards on to it.
+    template<uint32_t W, typename Node>
+    void quantize_child_bounds(Node& node, const Core::AABB* child_bounds, const uint32_t child_count)
+    {
+        Core::AABB bounds = empty_bounds();
+        for(uint32_t i = 0; i < child_count; ++i)
+            bounds.union_of(child_bounds[i]);
+
+        constexpr float kGridCells = std::numeric_limits<uint8_t>::max();
+
+        for(uint32_t axis = 0; axis < 3; ++axis)
+        {
+            const float minimum = bounds.get_min()[axis];
+            const float maximum = bounds.get_max()[axis];
+
+            int32_t exponent = kMinQuantizationExponent;
+            if(maximum > minimum)
+                exponent = std::clamp(static_cast<int32_t>(std::ceil(std::log2((maximum - minimum) / kGridCells))), kMinQuantizationExponent, kMaxQuantizationExponent);
+
+            // The far edge of the grid is rounded as well, so it may need a larger cell to reach the maximum.
+            while(exponent < kMaxQuantizationExponent && dequantize(minimum, get_quantization_scale(exponent), std::numeric_limits<uint8_t>::max()) < maximum)
+                ++exponent;
+
+            const float scale = get_quantization_scale(exponent);
+            node.m_origin[axis] = minimum;
+            node.m_exponents[axis] = static_cast<int8_t>(exponent);
+
+            for(uint32_t i = 0; i < W; ++i)
+            {
+                if(i >= child_count)
+                {
+                    node.m_bounds[axis][i] = 0;
+                    node.m_bounds[axis + 3][i] = 0;
+                    continue;
+                }
+
+                const float child_min = child_bounds[i].get_min()[axis];
+                const float child_max = child_bounds[i].get_max()[axis];
+
+                uint8_t q_min = static_cast<uint8_t>(std::clamp(std::floor((child_min - minimum) / scale), 0.0f, kGridCells));
+                uint8_t q_max = static_cast<uint8_t>(std::clamp(std::ceil((child_max - minimum) / scale), 0.0f, kGridCells));
+                while(q_min > 0 && dequantize(minimum, scale, q_min) > child_min)
+                    --q_min;
+                while(q_max < kGridCells && dequantize(minimum, scale, q_max) < child_max)
+                    ++q_max;
+
+                node.m_bounds[axis][i] = q_min;
+                node.m_bounds[axis + 3][i] = q_max;
+            }
+        }
+    }
+
+    bool is_empty(const Core::AABB& bounds)
+    {
+        const glm::vec4& min = bounds.get_min();
+        const glm::vec4& max = bounds.get_max();
+
+        return min.x > max.x || min.y > max.y || min.z > max.z;
+    }
+
+    // get_side_lengths is absolute so empty bounds need to be caught before asking for the area.
+    float surface_area(const Core::AABB& bounds)
+    {
+        return is_empty(bounds) ? 0.0f : bounds.get_surface_area();
+    }
+
+    Core::AABB intersection_of(const Core::AABB& lhs, const Core::AABB& rhs)
+    {
+        return Core::AABB(Core::component_wise_max(lhs.get_min(), rhs.get_min()), Core::component_wise_min(lhs.get_max(), rhs.get_max()));
+    }
+
+    // Nodes whose object split children overlap less than this fraction of their area don't try spatial splits.
+    constexpr float kSpatialSplitOverlapThreshold = 1e-5f;
+
+    // Reorders [start, end) by the Morton code of each primitive's centroid and returns the sorted codes.
+    template<typename ITERATOR>
+    std::vector<uint64_t> sort_by_morton_code(ITERATOR start, ITERATOR end, ThreadPool* pool)
+    {
+        const size_t count = std::distance(start, end);
+
+        std::vector<Core::AABB> chunk_bounds(get_chunk_count(pool), empty_bounds());
+        for_each_chunk(pool, count, [&](const size_t chunk, const size_t begin, const size_t end)
+        {
+            for(auto bounds_it = start + begin; bounds_it != start + end; ++bounds_it)
+                chunk_bounds[chunk].add_point(bounds_it->m_bounds.get_central_point());
+        });
+
+        Core::AABB centroid_bounds = empty_bounds();
+        for(const auto& chunk : chunk_bounds)
+            centroid_bounds.union_of(chunk);
+
+        const uint32_t bits_per_axis = count < kWideMortonCodeThreshold ? 10 : 21;
+        std::vector<uint64_t> codes(count);
+        for_each_chunk(pool, count, [&](const size_t, const size_t begin, const size_t end)
+        {
+            for(size_t i = begin; i < end; ++i)
+                codes[i] = Core::morton_code(centroid_bounds.get_offset(start[i].m_bounds.get_central_point()), bits_per_axis);
+        });
+
+        const std::vector<uint32_t> order = Core::radix_sort(codes, bits_per_axis * 3, pool);
+
+        std::vector<typename std::iterator_traits<ITERATOR>::value_type> sorted(count);
+        for_each_chunk(pool, count, [&](const size_t, const size_t begin, const size_t end)
+        {
+            for(size_t i = begin; i < end; ++i)
+                sorted[i] = start[order[i]];
+        });
+        std::move(sorted.begin(), sorted.end(), start);
+
+        return codes;
+    }
+
+}
+
 namespace Core
 {
 
-    namespace Acceleration_Structures
-    {
+    namespace Acceleration_Structures
+    {
+
+        template<typename T, uint32_t C>
+        bool BVH<T, C>::get_first_intersection(Ray& ray, HitRecord& hit) const
+        {
+            // The intersector shrinks hit.m_distance as closer primitives are found, which culls the remaining nodes.
+            bool found = false;
+            traverse(ray, hit.m_distance, [&](const T& primitive)
+            {
+                found |= m_intersector->intersects(ray, primitive, hit);
+
+                return false;
+            });
+
+            return found;
+        }
+
+        template<typename T, uint32_t C>
+        bool BVH<T, C>::is_occluded(Ray& ray, const float max_distance) const
+        {
+            float culling_distance = max_distance;
+            bool occluded = false;
+            traverse(ray, culling_distance, [&](const T& primitive)
+            {
+                occluded = m_intersector->occludes(ray, primitive, max_distance);
+                return occluded;
+            });
+
+            return occluded;
+        }
+
+        template<typename T, uint32_t C>
+        template<typename F>
+        void BVH<T, C>::traverse(Ray& ray, float& intersection_distance, F&& visit_primitive) const
+        {
+            if(m_root == kInvalidNodeIndex)
+                return;
+
+            ray.precompute_traversal_data();
+
+            Traversal_Stack_Entry node_stack[kMaxTraversalDepth * (C - 1) + 1];
+            uint32_t stack_size = 0;
+            node_stack[stack_size++] = {m_root, get_node(m_root).m_bounding_box.intersection_distance(ray)};
+
+            while(stack_size > 0)
+            {
+                const Traversal_Stack_Entry entry = node_stack[--stack_size];
+
+                // The closest intersection may have moved in front of this node since it was pushed.
+                if(entry.m_distance >= intersection_distance)
+                    continue;
+
+                const Node& node = get_node(entry.m_node);
+                if (node.is_leaf())
+                {
+                    for (auto& value : node.m_values)
+                    {
+                        if(visit_primitive(value.m_value))
+                            return;
+                    }
+                }
+                else
+                {
+                    Traversal_Stack_Entry children[C];
+                    uint32_t child_count = 0;
+                    for (NodeIndex child_index : node.m_children)
+                    {
+                        if (child_index != kInvalidNodeIndex)
+                        {
+                            const float child_distance = get_node(child_index).m_bounding_box.intersection_distance(ray);
+                            if(child_distance < intersection_distance)
+                                children[child_count++] = {child_index, child_distance};
+                        }
+                    }
+
+                    // Push the furthest child first so that the nearest is visited next. There are at most C children so an
+                    // insertion sort is enough, for binary nodes it's a single compare and swap.
+                    for(uint32_t i = 1; i < child_count; ++i)
+                    {
+                        const Traversal_Stack_Entry child = children[i];
+                        uint32_t j = i;
+                        for(; j > 0 && children[j - 1].m_distance < child.m_distance; --j)
+                            children[j] = children[j - 1];
+
+                        children[j] = child;
+                    }
+
+                    PICO_ASSERT(stack_size + child_count <= std::size(node_stack));
+                    for(uint32_t i = 0; i < child_count; ++i)
+                        node_stack[stack_size++] = children[i];
+                }
+            }
+        }
+
+        template<typename T>
+        bool FlatBVH<T>::get_first_intersection(Ray& ray, HitRecord& hit) const
+        {
+            // The intersector shrinks hit.m_distance as closer primitives are found, which culls the remaining nodes.
+            bool found = false;
+            traverse(ray, hit.m_distance, [&](const uint32_t first, const uint32_t count)
+            {
+                found |= m_intersector->intersects_leaf(ray, m_primitives.data(), first, count, hit);
+
+                return false;
+            });
+
+            return found;
+        }
+
+        template<typename T>
+        bool FlatBVH<T>::is_occluded(Ray& ray, const float max_distance) const
+        {
+            float culling_distance = max_distance;
+            bool occluded = false;
+            traverse(ray, culling_distance, [&](const uint32_t first, const uint32_t count)
+            {
+                occluded = m_intersector->occludes_leaf(ray, m_primitives.data(), first, count, max_distance);
+                return occluded;
+            });
+
+            return occluded;
+        }
+
+        template<typename T>
+        template<typename F>
+        void FlatBVH<T>::traverse(Ray& ray, float& intersection_distance, F&& visit_leaf) const
+        {
+            if(m_nodes.empty())
+                return;
+
+            ray.precompute_traversal_data();
+
+            Traversal_Stack_Entry node_stack[kMaxTraversalDepth];
+            uint32_t stack_size = 0;
+            node_stack[stack_size++] = {0, node_intersection_distance(m_nodes[0].m_bounds, ray)};
+
+            while(stack_size > 0)
+            {
+                const Traversal_Stack_Entry entry = node_stack[--stack_size];
+
+                // The closest intersection may have moved in front of this node since it was pushed.
+                if(entry.m_distance >= intersection_distance)
+                    continue;
+
+                const Node& node = m_nodes[entry.m_node];
+
+                if(node.is_leaf())
+                {
+                    if(visit_leaf(node.m_offset, node.m_primitive_count))
+                        return;
+                }
+                else
+                {
+                    // First child directly follows its parent.
+                    Traversal_Stack_Entry first{entry.m_node + 1, node_intersection_distance(m_nodes[entry.m_node + 1].m_bounds, ray)};
+                    Traversal_Stack_Entry second{node.m_offset, node_intersection_distance(m_nodes[node.m_offset].m_bounds, ray)};
+
+                    if(second.m_distance < first.m_distance)
+                        std::swap(first, second);
+
+                    // Push the furthest child first so that the nearest is visited next.
+                    PICO_ASSERT(stack_size + 2 <= std::size(node_stack));
+                    if(second.m_distance < intersection_distance)
+                        node_stack[stack_size++] = second;
+                    if(first.m_distance < intersection_distance)
+                        node_stack[stack_size++] = first;
+                }
+            }
+        }
+
+        template<typename T, uint32_t W>
+        bool WideBVH<T, W>::get_first_intersection(Ray& ray, HitRecord& hit) const
+        {
+            // The intersector shrinks hit.m_distance as closer primitives are found, which culls the remaining nodes.
+            bool found = false;
+            traverse(ray, hit.m_distance, [&](const uint32_t first, const uint32_t count)
+            {
+                found |= m_intersector->intersects_leaf(ray, m_primitives.data(), first, count, hit);
+
+                return false;
+            });
+
+            return found;
+        }
+
+        template<typename T, uint32_t W>
+        bool WideBVH<T, W>::is_occluded(Ray& ray, const float max_distance) const
+        {
+            float culling_distance = max_distance;
+            bool occluded = false;
+            traverse(ray, culling_distance, [&](const uint32_t first, const uint32_t count)
+            {
+                occluded = m_intersector->occludes_leaf(ray, m_primitives.data(), first, count, max_distance);
+                return occluded;
+            });
+
+            return occluded;
+        }
+
+        template<typename T, uint32_t W>
+        template<typename F>
+        void WideBVH<T, W>::traverse(Ray& ray, float& intersection_distance, F&& visit_leaf) const
+        {
+            if(m_nodes.empty())
+                return;
+
+            traverse_wide_nodes<W>([this](const NodeIndex n) -> const Node& { return m_nodes[n]; }, ray, intersection_distance, visit_leaf);
+        }
+
+        template<typename T, uint32_t W>
+        uint32_t WideBVH<T, W>::get_first_intersections(Ray* rays, const uint32_t ray_mask, HitRecord* hits) const
+        {
+            float distances[kRayPacketSize];
+            for(uint32_t mask = ray_mask; mask != 0; mask &= mask - 1)
+                distances[std::countr_zero(mask)] = hits[std::countr_zero(mask)].m_distance;
+
+            uint32_t found = 0;
+            traverse_packet(rays, ray_mask, distances, [&](const uint32_t first, const uint32_t count, const uint32_t leaf_rays)
+            {
+                const uint32_t leaf_found = m_intersector->intersects_leaf_packet(rays, leaf_rays, m_primitives.data(), first, count, hits);
+                for(uint32_t mask = leaf_found; mask != 0; mask &= mask - 1)
+                    distances[std::countr_zero(mask)] = hits[std::countr_zero(mask)].m_distance;
+
+                found |= leaf_found;
+                return 0u;
+            });
+
+            return found;
+        }
+
+        template<typename T, uint32_t W>
+        uint32_t WideBVH<T, W>::are_occluded(Ray* rays, const uint32_t ray_mask, const float* max_distances) const
+        {
+            uint32_t occluded = 0;
+            traverse_packet(rays, ray_mask, max_distances, [&](const uint32_t first, const uint32_t count, const uint32_t leaf_rays)
+            {
+                // Occluded rays are finished and drop out of the rest of the traversal.
+                const uint32_t leaf_occluded = m_intersector->occludes_leaf_packet(rays, leaf_rays, m_primitives.data(), first, count, max_distances);
+                occluded |= leaf_occluded;
+                return leaf_occluded;
+            });
+
+            return occluded;
+        }
+
+        template<typename T, uint32_t W>
+        template<typename F>
+        void WideBVH<T, W>::traverse_packet(Ray* rays, uint32_t ray_mask, const float* intersection_distances, F&& visit_leaf) const
+        {
+            if(m_nodes.empty() || ray_mask == 0)
+                return;
+
+            traverse_wide_nodes_packet<W>([this](const NodeIndex n) -> const Node& { return m_nodes[n]; }, rays, ray_mask, intersection_distances, visit_leaf);
+        }
+
+        template<typename T, uint32_t W>
+        bool WideBVH<T, W>::refit(const Bounds_Function<T>& get_bounds, ThreadPool* thread_pool)
+        {
+            m_nodes.make_owned();
+            Node* nodes = m_nodes.mutable_data();
+
+            auto for_each_child = [nodes](const NodeIndex n, auto&& visit)
+            {
+                for(uint32_t i = 0; i < W; ++i)
+                {
+                    if(!nodes[n].is_leaf(i) && nodes[n].m_children[i] != kInvalidNodeIndex)
+                        visit(nodes[n].m_children[i]);
+                }
+            };
+
+            refit_by_level(thread_pool, m_nodes.size(), for_each_child, [&](const NodeIndex n)
+            {
+                Node& node = nodes[n];
+                for(uint32_t i = 0; i < W; ++i)
+                {
+                    // Unused slots keep their NaN bounds.
+                    if(node.m_children[i] == kInvalidNodeIndex)
+                        continue;
+
+                    AABB bounds = empty_bounds();
+                    if(node.is_leaf(i))
+                    {
+                        for(uint32_t p = node.m_children[i]; p < node.m_children[i] + node.m_primitive_counts[i]; ++p)
+                            bounds.union_of(get_bounds(m_primitives[p]));
+                    }
+                    else
+                    {
+                        bounds = get_wide_node_bounds<W>(nodes[node.m_children[i]]);
+                    }
+
+                    for(uint32_t axis = 0; axis < 3; ++axis)
+                    {
+                        node.m_bounds[axis][i] = bounds.get_min()[axis];
+                        node.m_bounds[axis + 3][i] = bounds.get_max()[axis];
+                    }
+                }
+            });
+
+            return true;
+        }
+
+        template<typename T, uint32_t W>
+        float WideBVH<T, W>::get_sah_cost() const
+        {
+            if(m_nodes.empty())
+                return 0.0f;
+
+            const float root_area = get_wide_node_bounds<W>(m_nodes[0]).get_surface_area();
+            if(!(root_area > 0.0f))
+                return 0.0f;
+
+            float cost = kSAHTraversalCost;
+            for(size_t n = 0; n < m_nodes.size(); ++n)
+                cost += get_wide_node_sah_cost<W>(m_nodes[n], root_area);
+
+            return cost;
+        }
+
+        template<typename T, uint32_t W>
+        bool CompressedWideBVH<T, W>::refit(const Bounds_Function<T>& get_bounds, ThreadPool* thread_pool)
+        {
+            m_nodes.make_owned();
+            Node* nodes = m_nodes.mutable_data();
+
+            auto for_each_child = [nodes](const NodeIndex n, auto&& visit)
+            {
+                for(uint32_t i = 0; i < static_cast<uint32_t>(std::popcount(nodes[n].m_interior_mask)); ++i)
+                    visit(nodes[n].m_first_child + i);
+            };
+
+            refit_by_level(thread_pool, m_nodes.size(), for_each_child, [&](const NodeIndex n)
+            {
+                Node& node = nodes[n];
+
+                // Used slots always come first.
+                AABB child_bounds[W];
+                uint32_t child_count = 0;
+                NodeIndex next_child = node.m_first_child;
+                uint32_t next_primitive = node.m_first_primitive;
+                for(; child_count < W; ++child_count)
+                {
+                    AABB& bounds = child_bounds[child_count];
+                    if(node.m_interior_mask & (1u << child_count))
+                    {
+                        Decoded_Node child;
+                        decode_node(nodes[next_child++], child);
+                        bounds = get_wide_node_bounds<W>(child);
+                    }
+                    else if(node.m_primitive_counts[child_count] > 0)
+                    {
+                        bounds = empty_bounds();
+                        for(uint32_t p = next_primitive; p < next_primitive + node.m_primitive_counts[child_count]; ++p)
+                            bounds.union_of(get_bounds(m_primitives[p]));
+                        next_primitive += node.m_primitive_counts[child_count];
+                    }
+                    else
+                    {
+                        break;
+                    }
+                }
+
+                quantize_child_bounds<W>(node, child_bounds, child_count);
+            });
+
+            return true;
+        }
+
+        template<typename T, uint32_t W>
+        float CompressedWideBVH<T, W>::get_sah_cost() const
+        {
+            if(m_nodes.empty())
+                return 0.0f;
+
+            Decoded_Node decoded;
+            decode_node(m_nodes[0], decoded);
+            const float root_area = get_wide_node_bounds<W>(decoded).get_surface_area();
+            if(!(root_area > 0.0f))
+                return 0.0f;
+
+            float cost = kSAHTraversalCost;
+            for(size_t n = 0; n < m_nodes.size(); ++n)
+            {
+                decode_node(m_nodes[n], decoded);
+                cost += get_wide_node_sah_cost<W>(decoded, root_area);
+            }
+
+            return cost;
+        }
+
+        template<typename T, uint32_t W>
+        void CompressedWideBVH<T, W>::decode_node(const Node& node, Decoded_Node& decoded)
+        {
+            for(uint32_t row = 0; row < 6; ++row)
+            {
+                const uint32_t axis = row % 3;
+                const float scale = get_quantization_scale(node.m_exponents[axis]);
+#ifdef PICO_BVH_USE_SSE
+                const __m128 origin_row = _mm_set1_ps(node.m_origin[axis]);
+                const __m128 scale_row = _mm_set1_ps(scale);
+                for(uint32_t lane = 0; lane < W; lane += 4)
+                {
+                    int32_t packed;
+                    memcpy(&packed, &node.m_bounds[row][lane], sizeof(int32_t));
+
+                    // Widen four bytes to floats, the arithmetic matches dequantize exactly.
+                    const __m128i q = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), _mm_setzero_si128()), _mm_setzero_si128());
+                    _mm_store_ps(&decoded.m_bounds[row][lane], _mm_add_ps(origin_row, _mm_mul_ps(_mm_cvtepi32_ps(q), scale_row)));
+                }
+#else
+                for(uint32_t i = 0; i < W; ++i)
+                    decoded.m_bounds[row][i] = dequantize(node.m_origin[axis], scale, node.m_bounds[row][i]);
+#endif
+            }
+
+            uint32_t next_child = node.m_first_child;
+            uint32_t next_primitive = node.m_first_primitive;
+            for(uint32_t i = 0; i < W; ++i)
+            {
+                decoded.m_primitive_counts[i] = node.m_primitive_counts[i];
+
+                if(node.m_interior_mask & (1u << i))
+                {
+                    decoded.m_children[i] = next_child++;
+                }
+                else if(node.m_primitive_counts[i] > 0)
+                {
+                    decoded.m_children[i] = next_primitive;
+                    next_primitive += node.m_primitive_counts[i];
+                }
+                else
+                {
+                    // Unused slots get NaN bounds, as in the WideBVH layout, so they always fail the slab test.
+                    decoded.m_children[i] = kInvalidNodeIndex;
+                    for(uint32_t row = 0; row < 6; ++row)
+                        decoded.m_bounds[row][i] = std::numeric_limits<float>::quiet_NaN();
+                }
+            }
+        }
+
+        template<typename T, uint32_t W>
+        bool CompressedWideBVH<T, W>::get_first_intersection(Ray& ray, HitRecord& hit) const
+        {
+            bool found = false;
+            traverse(ray, hit.m_distance, [&](const uint32_t first, const uint32_t count)
+            {
+                found |= m_intersector->intersects_leaf(ray, m_primitives.data(), first, count, hit);
+
+                return false;
+            });
+
+            return found;
+        }
+
+        template<typename T, uint32_t W>
+        bool CompressedWideBVH<T, W>::is_occluded(Ray& ray, const float max_distance) const
+        {
+            float culling_distance = max_distance;
+            bool occluded = false;
+            traverse(ray, culling_distance, [&](const uint32_t first, const uint32_t count)
+            {
+                occluded = m_intersector->occludes_leaf(ray, m_primitives.data(), first, count, max_distance);
+                return occluded;
+            });
+
+            return occluded;
+        }
+
+        template<typename T, uint32_t W>
+        uint32_t CompressedWideBVH<T, W>::get_first_intersections(Ray* rays, const uint32_t ray_mask, HitRecord* hits) const
+        {
+            float distances[kRayPacketSize];
+            for(uint32_t mask = ray_mask; mask != 0; mask &= mask - 1)
+                distances[std::countr_zero(mask)] = hits[std::countr_zero(mask)].m_distance;
+
+            uint32_t found = 0;
+            traverse_packet(rays, ray_mask, distances, [&](const uint32_t first, const uint32_t count, const uint32_t leaf_rays)
+            {
+                const uint32_t leaf_found = m_intersector->intersects_leaf_packet(rays, leaf_rays, m_primitives.data(), first, count, hits);
+                for(uint32_t mask = leaf_found; mask != 0; mask &= mask - 1)
+                    distances[std::countr_zero(mask)] = hits[std::countr_zero(mask)].m_distance;
+
+                found |= leaf_found;
+                return 0u;
+            });
+
+            return found;
+        }
+
+        template<typename T, uint32_t W>
+        uint32_t CompressedWideBVH<T, W>::are_occluded(Ray* rays, const uint32_t ray_mask, const float* max_distances) const
+        {
+            uint32_t occluded = 0;
+            traverse_packet(rays, ray_mask, max_distances, [&](const uint32_t first, const uint32_t count, const uint32_t leaf_rays)
+            {
+                const uint32_t leaf_occluded = m_intersector->occludes_leaf_packet(rays, leaf_rays, m_primitives.data(), first, count, max_distances);
+                occluded |= leaf_occluded;
+                return leaf_occluded;
+            });
+
+            return occluded;
+        }
+
+        template<typename T, uint32_t W>
+        template<typename F>
+        void CompressedWideBVH<T, W>::traverse(Ray& ray, float& intersection_distance, F&& visit_leaf) const
+        {
+            if(m_nodes.empty())
+                return;
+
+            traverse_wide_nodes<W>([this](const NodeIndex n)
+            {
+                Decoded_Node decoded;
+                decode_node(m_nodes[n], decoded);
+                return decoded;
+            }, ray, intersection_distance, visit_leaf);
+        }
+
+        template<typename T, uint32_t W>
+        template<typename F>
+        void CompressedWideBVH<T, W>::traverse_packet(Ray* rays, uint32_t ray_mask, const float* intersection_distances, F&& visit_leaf) const
+        {
+            if(m_nodes.empty() || ray_mask == 0)
+                return;
+
+            // Each node is decoded once for the whole packet.
+            traverse_wide_nodes_packet<W>([this](const NodeIndex n)
+            {
+                Decoded_Node decoded;
+                decode_node(m_nodes[n], decoded);
+                return decoded;
+            }, rays, ray_mask, intersection_distances, visit_leaf);
+        }
+
+        template<typename T>
+        Acceleration_Structure<T>* BVHFactory<T>::generate_BVH()
+        {
+            const auto build_start = std::chrono::steady_clock::now();
+
+            if(m_builder == BVHBuilder::kParallelBinned && m_thread_pool == nullptr)
+                m_builder = BVHBuilder::kRecursive;
+
+            // A binary tree with one reference per leaf is the largest any of the builders can produce.
+            const size_t max_reference_count = m_partition_scheme ? m_partition_scheme->get_max_reference_count(m_bounding_boxes.size()) :
+                                                                    m_bounding_boxes.size();
+            m_build_nodes.resize(m_bounding_boxes.empty() ? 0 : (2 * max_reference_count) - 1);
+            m_build_node_count = 0;
+
+            NodeIndex root_node = kInvalidNodeIndex;
+            if(m_builder == BVHBuilder::kPLOC && !m_bounding_boxes.empty())
+            {
+                root_node = cluster_primitives();
+                if(root_node == kInvalidNodeIndex)
+                {
+                    PICO_LOG("PLOC tree is too deep to traverse, falling back to a linear BVH\n");
+                    m_build_node_count = 0;
+                    m_partition_scheme = std::make_unique<Morton_parition_Scheme<T>>();
+                }
+            }
+
+            if(root_node == kInvalidNodeIndex)
+            {
+                m_partition_scheme->prepare(m_bounding_boxes.begin(), m_bounding_boxes.end(), m_thread_pool);
+                if(max_reference_count > m_bounding_boxes.size() && !m_bounding_boxes.empty())
+                {
+                    // References are duplicated as the tree is built so the leaves gather them in to a new array.
+                    m_leaf_references.reserve(max_reference_count);
+                    root_node = split_references(m_bounding_boxes, m_max_depth);
+                    m_bounding_boxes = std::move(m_leaf_references);
+                }
+                else
+                {
+                    root_node = split_primitives(m_bounding_boxes.begin(), m_bounding_boxes.end(), m_max_depth);
+                }
+            }
+            m_build_nodes.resize(m_build_node_count);
+
+            Acceleration_Structure<T>* acceleration_structure = nullptr;
+            switch(m_node_layout)
+            {
+                case BVHNodeLayout::kPointer:
+                    acceleration_structure = generate_pointer_BVH(root_node);
+                    break;
+                case BVHNodeLayout::kWide4:
+                    acceleration_structure = generate_wide_BVH<4>(root_node);
+                    break;
+                case BVHNodeLayout::kWide8:
+                    acceleration_structure = generate_wide_BVH<8>(root_node);
+                    break;
+                case BVHNodeLayout::kCompressedWide4:
+                    acceleration_structure = generate_compressed_wide_BVH<4>(root_node);
+                    break;
+                case BVHNodeLayout::kCompressedWide8:
+                    acceleration_structure = generate_compressed_wide_BVH<8>(root_node);
+                    break;
+                case BVHNodeLayout::kFlat:
+                default:
+                    acceleration_structure = generate_flat_BVH(root_node);
+                    break;
+            }
+
+            const std::chrono::duration<double, std::milli> build_time = std::chrono::steady_clock::now() - build_start;
+            const char* builder_names[] = {"recursive", "parallel", "PLOC"};
+            PICO_LOG("Built %s BVH over %zu primitives in %.2fms\n",
+                     builder_names[static_cast<uint32_t>(m_builder)], m_bounding_boxes.size(), build_time.count());
+
+            return acceleration_structure;
+        }
+
+        template<typename T>
+        BVH<T, 2>* BVHFactory<T>::generate_pointer_BVH(const NodeIndex root)
+        {
+            std::vector<typename BVH<T, 2>::Node> node_storage;
+            node_storage.reserve(m_build_nodes.size());
+
+            const NodeIndex root_node = root == kInvalidNodeIndex ? kInvalidNodeIndex : add_pointer_node(root, node_storage);
+
+            return new BVH<T, 2>(root_node, node_storage, std::move(m_intersector));
+        }
+
+        template<typename T>
+        NodeIndex BVHFactory<T>::add_pointer_node(const NodeIndex build_node, std::vector<typename BVH<T, 2>::Node>& node_storage) const
+        {
+            const BuildNode& node = m_build_nodes[build_node];
+
+            typename BVH<T, 2>::Node newNode{};
+            newNode.m_bounding_box = node.m_bounds;
+
+            if(node.is_leaf())
+            {
+                const auto start = m_bounding_boxes.begin() + node.m_first_primitive;
+                newNode.m_values.insert(newNode.m_values.end(), start, start + node.m_primitive_count);
+
+                newNode.m_children[0] = kInvalidNodeIndex;
+                newNode.m_children[1] = kInvalidNodeIndex;
+            }
+            else
+            {
+                newNode.m_children[0] = add_pointer_node(node.m_children[0], node_storage);
+                newNode.m_children[1] = add_pointer_node(node.m_children[1], node_storage);
+            }
+
+            const NodeIndex i = node_storage.size();
+            node_storage.push_back(std::move(newNode));
+
+            return i;
+        }
+
+        template<typename T>
+        FlatBVH<T>* BVHFactory<T>::generate_flat_BVH(const NodeIndex root)
+        {
+            std::vector<typename FlatBVH<T>::Node> node_storage;
+            node_storage.reserve(m_build_nodes.size());
+
+            std::vector<T> primitives;
+            primitives.reserve(m_bounding_boxes.size());
+
+            if(root != kInvalidNodeIndex)
+                add_flat_node(root, node_storage, primitives);
+
+            return new FlatBVH<T>(std::move(node_storage), std::move(primitives), std::move(m_intersector));
+        }
+
+        template<typename T>
+        NodeIndex BVHFactory<T>::add_flat_node(const NodeIndex build_node, std::vector<typename FlatBVH<T>::Node>& node_storage, std::vector<T>& primitives) const
+        {
+            const BuildNode& node = m_build_nodes[build_node];
+
+            const NodeIndex flat_index = node_storage.size();
+            node_storage.emplace_back();
+            node_storage[flat_index].m_bounds[0] = glm::vec3(node.m_bounds.get_min());
+            node_storage[flat_index].m_bounds[1] = glm::vec3(node.m_bounds.get_max());
+            node_storage[flat_index].m_padding = 0;
+
+            if(node.is_leaf())
+            {
+                PICO_ASSERT(node.m_primitive_count <= FlatBVH<T>::kMaxLeafPrimitives);
+
+                node_storage[flat_index].m_offset = primitives.size();
+                node_storage[flat_index].m_primitive_count = node.m_primitive_count;
+                node_storage[flat_index].m_split_axis = 0;
+
+                for(uint32_t i = node.m_first_primitive; i < node.m_first_primitive + node.m_primitive_count; ++i)
+                {
+                    primitives.push_back(m_bounding_boxes[i].m_value);
+                }
+            }
+            else
+            {
+                const glm::vec3 child_separation = m_build_nodes[node.m_children[1]].m_bounds.get_central_point() -
+                                                   m_build_nodes[node.m_children[0]].m_bounds.get_central_point();
+
+                add_flat_node(node.m_children[0], node_storage, primitives);
+                const NodeIndex second_child = add_flat_node(node.m_children[1], node_storage, primitives);
+
+                node_storage[flat_index].m_offset = second_child;
+                node_storage[flat_index].m_primitive_count = 0;
+                node_storage[flat_index].m_split_axis = maximum_component_index(child_separation);
+            }
+
+            return flat_index;
+        }
+
+        template<typename T>
+        template<uint32_t W>
+        WideBVH<T, W>* BVHFactory<T>::generate_wide_BVH(const NodeIndex root)
+        {
+            std::vector<typename WideBVH<T, W>::Node> node_storage;
+            node_storage.reserve(m_build_nodes.size() / 2);
+
+            std::vector<T> primitives;
+            primitives.reserve(m_bounding_boxes.size());
+
+            if(root != kInvalidNodeIndex)
+            {
+                // The root is always an interior node, even if the whole tree fits in a single leaf.
+                if(m_build_nodes[root].is_leaf())
+                    add_wide_node<W>(&root, 1, node_storage, primitives);
+                else
+                    add_wide_node<W>(m_build_nodes[root].m_children, 2, node_storage, primitives);
+            }
+
+            return new WideBVH<T, W>(std::move(node_storage), std::move(primitives), std::move(m_intersector));
+        }
+
+        template<typename T>
+        template<uint32_t W>
+        NodeIndex BVHFactory<T>::add_wide_node(const NodeIndex* build_children, uint32_t child_count, std::vector<typename WideBVH<T, W>::Node>& node_storage, std::vector<T>& primitives) const
+        {
+            std::array<NodeIndex, W> children;
+            std::copy(build_children, build_children + child_count, children.begin());
+            child_count = collapse_children<W>(children, child_count);
+
+            const NodeIndex wide_index = node_storage.size();
+            node_storage.emplace_back();
+
+            for(uint32_t i = 0; i < W; ++i)
+            {
+                const bool valid = i < child_count;
+                const glm::vec4 minimum = valid ? m_build_nodes[children[i]].m_bounds.get_min() : glm::vec4(std::numeric_limits<float>::quiet_NaN());
+                const glm::vec4 maximum = valid ? m_build_nodes[children[i]].m_bounds.get_max() : glm::vec4(std::numeric_limits<float>::quiet_NaN());
+
+                for(uint32_t axis = 0; axis < 3; ++axis)
+                {
+                    node_storage[wide_index].m_bounds[axis][i] = minimum[axis];
+                    node_storage[wide_index].m_bounds[axis + 3][i] = maximum[axis];
+                }
+
+                node_storage[wide_index].m_children[i] = kInvalidNodeIndex;
+                node_storage[wide_index].m_primitive_counts[i] = 0;
+            }
+
+            for(uint32_t i = 0; i < child_count; ++i)
+            {
+                const BuildNode& child = m_build_nodes[children[i]];
+                if(child.is_leaf())
+                {
+                    node_storage[wide_index].m_children[i] = primitives.size();
+                    node_storage[wide_index].m_primitive_counts[i] = child.m_primitive_count;
+
+                    for(uint32_t p = child.m_first_primitive; p < child.m_first_primitive + child.m_primitive_count; ++p)
+                    {
+                        primitives.push_back(m_bounding_boxes[p].m_value);
+                    }
+                }
+                else
+                {
+                    const NodeIndex child_index = add_wide_node<W>(child.m_children, 2, node_storage, primitives);
+                    node_storage[wide_index].m_children[i] = child_index;
+                }
+            }
+
+            return wide_index;
+        }
+
+        template<typename T>
+        template<uint32_t W>
+        uint32_t BVHFactory<T>::collapse_children(std::array<NodeIndex, W>& children, uint32_t child_count) const
+        {
+            // Pull grandchildren up in to this node, always opening the child with the largest surface area.
+            while(child_count < W)
+            {
+                uint32_t largest_child = W;
+                float largest_area = -1.0f;
+                for(uint32_t i = 0; i < child_count; ++i)
+                {
+                    const BuildNode& child = m_build_nodes[children[i]];
+                    if(!child.is_leaf() && child.m_bounds.get_surface_area() > largest_area)
+                    {
+                        largest_area = child.m_bounds.get_surface_area();
+                        largest_child = i;
+                    }
+                }
+
+                if(largest_child == W)
+                    break;
+
+                const BuildNode& opened = m_build_nodes[children[largest_child]];
+                children[largest_child] = opened.m_children[0];
+                children[child_count++] = opened.m_children[1];
+            }
+
+            return child_count;
+        }
+
+        template<typename T>
+        template<uint32_t W>
+        CompressedWideBVH<T, W>* BVHFactory<T>::generate_compressed_wide_BVH(const NodeIndex root)
+        {
+            std::vector<typename CompressedWideBVH<T, W>::Node> node_storage;
+            node_storage.reserve(m_build_nodes.size() / 2);
+
+            std::vector<T> primitives;
+            primitives.reserve(m_bounding_boxes.size());
+
+            if(root != kInvalidNodeIndex)
+            {
+                node_storage.emplace_back();
+
+                // The root is always an interior node, even if the whole tree fits in a single leaf.
+                if(m_build_nodes[root].is_leaf())
+                    fill_compressed_node<W>(0, &root, 1, node_storage, primitives);
+                else
+                    fill_compressed_node<W>(0, m_build_nodes[root].m_children, 2, node_storage, primitives);
+            }
+
+            return new CompressedWideBVH<T, W>(std::move(node_storage), std::move(primitives), std::move(m_intersector));
+        }
+
+        template<typename T>
+        template<uint32_t W>
+        void BVHFactory<T>::fill_compressed_node(const NodeIndex node, const NodeIndex* build_children, uint32_t child_count,
+                                                 std::vector<typename CompressedWideBVH<T, W>::Node>& node_storage, std::vector<T>& primitives) const
+        {
+            std::array<NodeIndex, W> children;
+            std::copy(build_children, build_children + child_count, children.begin());
+            child_count = collapse_children<W>(children, child_count);
+
+            AABB child_bounds[W];
+            uint8_t interior_mask = 0;
+            for(uint32_t i = 0; i < child_count; ++i)
+            {
+                const BuildNode& child = m_build_nodes[children[i]];
+                child_bounds[i] = child.m_bounds;
+
+                if(!child.is_leaf() || child.m_primitive_count > CompressedWideBVH<T, W>::kMaxLeafPrimitives)
+                    interior_mask |= 1u << i;
+            }
+
+            quantize_child_bounds<W>(node_storage[node], child_bounds, child_count);
+            node_storage[node].m_interior_mask = interior_mask;
+            node_storage[node].m_first_primitive = primitives.size();
+
+            for(uint32_t i = 0; i < W; ++i)
+            {
+                node_storage[node].m_primitive_counts[i] = 0;
+                if(i >= child_count || (interior_mask & (1u << i)))
+                    continue;
+
+                const BuildNode& child = m_build_nodes[children[i]];
+                node_storage[node].m_primitive_counts[i] = child.m_primitive_count;
+                for(uint32_t p = child.m_first_primitive; p < child.m_first_primitive + child.m_primitive_count; ++p)
+                {
+                    primitives.push_back(m_bounding_boxes[p].m_value);
+                }
+            }
+
+            const NodeIndex first_child = node_storage.size();
+            node_storage[node].m_first_child = first_child;
+            node_storage.resize(node_storage.size() + std::popcount(interior_mask));
+
+            NodeIndex next_child = first_child;
+            for(uint32_t i = 0; i < child_count; ++i)
+            {
+                if(!(interior_mask & (1u << i)))
+                    continue;
+
+                const BuildNode& child = m_build_nodes[children[i]];
+                if(child.is_leaf())
+                    fill_compressed_leaf_node<W>(next_child++, child.m_bounds, child.m_first_primitive, child.m_primitive_count, node_storage, primitives);
+                else
+                    fill_compressed_node<W>(next_child++, child.m_children, 2, node_storage, primitives);
+            }
+        }
+
+        template<typename T>
+        template<uint32_t W>
+        void BVHFactory<T>::fill_compressed_leaf_node(const NodeIndex node, const AABB& bounds, const uint32_t first_primitive, const uint32_t primitive_count,
+                                                      std::vector<typename CompressedWideBVH<T, W>::Node>& node_storage, std::vector<T>& primitives) const
+        {
+            constexpr uint32_t kMaxLeafPrimitives = CompressedWideBVH<T, W>::kMaxLeafPrimitives;
+
+            // Every slot keeps the bounds of the whole leaf, the primitives are only shared out to fit the counts.
+            const bool split_further = primitive_count > W * kMaxLeafPrimitives;
+            const uint32_t slot_size = split_further ? (primitive_count + W - 1) / W : kMaxLeafPrimitives;
+            const uint32_t slot_count = (primitive_count + slot_size - 1) / slot_size;
+
+            AABB child_bounds[W];
+            std::fill(child_bounds, child_bounds + slot_count, bounds);
+
+            quantize_child_bounds<W>(node_storage[node], child_bounds, slot_count);
+            node_storage[node].m_interior_mask = split_further ? static_cast<uint8_t>((1u << slot_count) - 1) : 0;
+            node_storage[node].m_first_primitive = primitives.size();
+            std::fill(std::begin(node_storage[node].m_primitive_counts), std::end(node_storage[node].m_primitive_counts), 0);
 
-        template<typename T, uint32_t C>
-        bool BVH<T, C>::get_first_intersection(Ray& ray, Acceleration_Structures::InterpolatedVertex &val) const
+            if(!split_further)
+            {
+                for(uint32_t slot = 0; slot < slot_count; ++slot)
+                    node_storage[node].m_primitive_counts[slot] = std::min(slot_size, primitive_count - (slot * slot_size));
+
+                for(uint32_t p = first_primitive; p < first_primitive + primitive_count; ++p)
+                {
+                    primitives.push_back(m_bounding_boxes[p].m_value);
+                }
+
+                node_storage[node].m_first_child = kInvalidNodeIndex;
+                return;
+            }
+
+            const NodeIndex first_child = node_storage.size();
+            node_storage[node].m_first_child = first_child;
+            node_storage.resize(node_storage.size() + slot_count);
+
+            for(uint32_t slot = 0; slot < slot_count; ++slot)
+            {
+                const uint32_t slot_start = slot * slot_size;
+                fill_compressed_leaf_node<W>(first_child + slot, bounds, first_primitive + slot_start, std::min(slot_size, primitive_count - slot_start), node_storage, primitives);
+            }
+        }
+
+        template<typename T>
+        NodeIndex BVHFactory<T>::split_primitives(BVHPartitionScheme<T>::ITERATOR start, BVHPartitionScheme<T>::ITERATOR end, uint32_t depth)
         {
-            float intersection_distance = INFINITY;
-            ray.mInverseDirection = glm::vec3(1.0f, 1.0f, 1.0f) / ray.mDirection;
+            if(start == end)
+                return kInvalidNodeIndex;
+
+            const uint32_t primitive_count = std::distance(start, end);
+            const bool build_in_parallel = m_builder == BVHBuilder::kParallelBinned && primitive_count >= kParallelSubtreeThreshold;
+            const bool bin_in_parallel = build_in_parallel && primitive_count >= kParallelBinningThreshold;
+
+            AABB bounds = empty_bounds();
+            if(bin_in_parallel)
+            {
+                std::vector<AABB> chunk_bounds(get_chunk_count(m_thread_pool), empty_bounds());
+                for_each_chunk(m_thread_pool, primitive_count, [&](const size_t chunk, const size_t begin, const size_t end)
+                {
+                    for(auto bounds_it = start + begin; bounds_it != start + end; ++bounds_it)
+                        chunk_bounds[chunk].union_of(bounds_it->m_bounds);
+                });
+
+                for(const auto& chunk : chunk_bounds)
+                    bounds.union_of(chunk);
+            }
+            else
+            {
+                for(auto bounds_it = start; bounds_it != end; ++bounds_it)
+                {
+                    bounds.union_of(bounds_it->m_bounds);
+                }
+            }
+
+            BuildNode newNode{};
+            newNode.m_bounds = bounds;
+            newNode.m_children[0] = kInvalidNodeIndex;
+            newNode.m_children[1] = kInvalidNodeIndex;
+
+            const bool make_leaf = depth == 0 || primitive_count <= m_leaf_size;
+            auto pivot = make_leaf ? end :
+                         bin_in_parallel ? m_partition_scheme->parallel_partition(start, end, *m_thread_pool) :
+                                           m_partition_scheme->partition(start, end);
 
-            get_closest_intersections(ray, get_node(m_root), val, intersection_distance);
+            if(make_leaf || pivot == end || pivot == start)
+            {
+                // Flat leaves can only reference a limited number of primitives, so fall back to a median split.
+                if(primitive_count <= FlatBVH<T>::kMaxLeafPrimitives)
+                {
+                    newNode.m_first_primitive = std::distance(m_bounding_boxes.begin(), start);
+                    newNode.m_primitive_count = primitive_count;
+
+                    return add_node(newNode);
+                }
+
+                pivot = start + (primitive_count / 2);
+                depth = std::max(depth, 1u);
+            }
+
+            if(build_in_parallel)
+            {
+                // Hand the first child to the pool and keep building the second one on this thread.
+                auto first_child = m_thread_pool->add_task([this, start, pivot, depth]() { return split_primitives(start, pivot, depth - 1); });
+                newNode.m_children[1] = split_primitives(pivot, end, depth - 1);
 
-            return intersection_distance != INFINITY;
+                m_thread_pool->wait_for_task(first_child);
+                newNode.m_children[0] = first_child.get();
+            }
+            else
+            {
+                newNode.m_children[0] = split_primitives(start, pivot, depth - 1);
+                newNode.m_children[1] = split_primitives(pivot, end, depth - 1);
+            }
+
+            return add_node(newNode);
         }
 
-        template<typename T, uint32_t C>
-        void    BVH<T, C>::get_closest_intersections(const Ray& ray, const typename BVH<T, C>::Node& node, Core::Acceleration_Structures::InterpolatedVertex& intersection, float& intersection_distance) const
+        template<typename T>
+        NodeIndex BVHFactory<T>::split_references(std::vector<BuilderNode>& references, uint32_t depth)
         {
-            if(node.m_bounding_box.intersection_distance(ray) < intersection_distance)
+            const uint32_t reference_count = references.size();
+
+            BuildNode newNode{};
+            newNode.m_bounds = empty_bounds();
+            newNode.m_children[0] = kInvalidNodeIndex;
+            newNode.m_children[1] = kInvalidNodeIndex;
+            for(const auto& reference : references)
+                newNode.m_bounds.union_of(reference.m_bounds);
+
+            std::vector<BuilderNode> left;
+            std::vector<BuilderNode> right;
+            const bool make_leaf = depth == 0 || reference_count <= m_leaf_size;
+            if(make_leaf || !m_partition_scheme->split_references(references.begin(), references.end(), left, right))
             {
-                if (node.is_leaf())
+                auto pivot = make_leaf ? references.end() : m_partition_scheme->partition(references.begin(), references.end());
+                if(make_leaf || pivot == references.end() || pivot == references.begin())
                 {
-                    for (auto& value : node.m_values)
+                    // Flat leaves can only reference a limited number of primitives, so fall back to a median split.
+                    if(reference_count <= FlatBVH<T>::kMaxLeafPrimitives)
+                    {
+                        newNode.m_first_primitive = m_leaf_references.size();
+                        newNode.m_primitive_count = reference_count;
+                        m_leaf_references.insert(m_leaf_references.end(), references.begin(), references.end());
+
+                        return add_node(newNode);
+                    }
+
+                    pivot = references.begin() + (reference_count / 2);
+                    depth = std::max(depth, 1u);
+                }
+
+                left.assign(references.begin(), pivot);
+                right.assign(pivot, references.end());
+            }
+
+            // Only the children's references are needed from here on.
+            references.clear();
+            references.shrink_to_fit();
+
+            newNode.m_children[0] = split_references(left, depth - 1);
+            newNode.m_children[1] = split_references(right, depth - 1);
+
+            return add_node(newNode);
+        }
+
+        template<typename T>
+        NodeIndex BVHFactory<T>::cluster_primitives()
+        {
+            sort_by_morton_code(m_bounding_boxes.begin(), m_bounding_boxes.end(), m_thread_pool);
+
+            // Start with a single primitive leaf per cluster, in Morton order.
+            const size_t primitive_count = m_bounding_boxes.size();
+            std::vector<NodeIndex> clusters(primitive_count);
+            for_each_chunk(m_thread_pool, primitive_count, [&](const size_t, const size_t begin, const size_t end)
+            {
+                for(size_t i = begin; i < end; ++i)
+                {
+                    BuildNode leaf{};
+                    leaf.m_bounds = m_bounding_boxes[i].m_bounds;
+                    leaf.m_children[0] = kInvalidNodeIndex;
+                    leaf.m_children[1] = kInvalidNodeIndex;
+                    leaf.m_first_primitive = i;
+                    leaf.m_primitive_count = 1;
+
+                    clusters[i] = add_node(leaf);
+                }
+            });
+
+            // Ties are broken on the pair of clusters so the cheapest pair is always a mutual match.
+            auto pair_key = [](const uint64_t a, const uint64_t b) { return a < b ? (a << 32) | b : (b << 32) | a; };
+
+            std::vector<uint32_t> nearest(primitive_count);
+            std::vector<NodeIndex> merged(primitive_count);
+            while(clusters.size() > 1)
+            {
+                const size_t cluster_count = clusters.size();
+                for_each_chunk(m_thread_pool, cluster_count, [&](const size_t, const size_t begin, const size_t end)
+                {
+                    for(size_t i = begin; i < end; ++i)
                     {
-                        // If we intersect the bounds then invoke the intersector to check if the contained entity is also intersected
-                        //if(value.m_bounds.intersection_distance(ray) < intersection_distance)
+                        const AABB& bounds = m_build_nodes[clusters[i]].m_bounds;
+                        const size_t first = i > kPLOCSearchRadius ? i - kPLOCSearchRadius : 0;
+                        const size_t last = std::min(i + kPLOCSearchRadius, cluster_count - 1);
+
+                        float best_cost = INFINITY;
+                        size_t best = i;
+                        for(size_t j = first; j <= last; ++j)
                         {
-                            float fine_intersected_distance = INFINITY;
-                            Acceleration_Structures::InterpolatedVertex vertex;
+                            if(j == i)
+                                continue;
 
-                            if (m_intersector->intersects(ray, value.m_value, fine_intersected_distance, vertex) && fine_intersected_distance < intersection_distance)
+                            const float cost = AABB::union_of(bounds, m_build_nodes[clusters[j]].m_bounds).get_surface_area();
+                            if(best == i || cost < best_cost || (cost == best_cost && pair_key(i, j) < pair_key(i, best)))
                             {
-                                intersection = vertex;
-                                intersection_distance = fine_intersected_distance;
+                                best_cost = cost;
+                                best = j;
                             }
                         }
+
+                        nearest[i] = best;
                     }
-                }
-                else
+                });
+
+                // Mutual nearest neighbours are merged in to the lower of the two slots.
+                for_each_chunk(m_thread_pool, cluster_count, [&](const size_t, const size_t begin, const size_t end)
                 {
-                    for (NodeIndex child_index : node.m_children)
+                    for(size_t i = begin; i < end; ++i)
                     {
-                        if (child_index != kInvalidNodeIndex)
+                        const size_t j = nearest[i];
+                        if(nearest[j] != i)
+                        {
+                            merged[i] = clusters[i];
+                        }
+                        else if(i < j)
                         {
-                            const Node& childNode = get_node(child_index);
+                            BuildNode node{};
+                            node.m_bounds = AABB::union_of(m_build_nodes[clusters[i]].m_bounds, m_build_nodes[clusters[j]].m_bounds);
+                            node.m_children[0] = clusters[i];
+                            node.m_children[1] = clusters[j];
 
-                            get_closest_intersections(ray, childNode, intersection, intersection_distance);
+                            merged[i] = add_node(node);
+                        }
+                        else
+                        {
+                            merged[i] = kInvalidNodeIndex;
                         }
                     }
+                });
+
+                clusters.clear();
+                std::copy_if(merged.begin(), merged.begin() + cluster_count, std::back_inserter(clusters), [](const NodeIndex n) { return n != kInvalidNodeIndex; });
+                PICO_ASSERT(clusters.size() < cluster_count);
+            }
+
+            if(get_depth(clusters[0]) >= kMaxTraversalDepth)
+                return kInvalidNodeIndex;
+
+            return clusters[0];
+        }
+
+        template<typename T>
+        uint32_t BVHFactory<T>::get_depth(const NodeIndex node) const
+        {
+            // Iterative so degenerate trees can't overflow the call stack.
+            uint32_t max_depth = 0;
+            std::vector<std::pair<NodeIndex, uint32_t>> stack{{node, 1}};
+            while(!stack.empty())
+            {
+                const auto [index, depth] = stack.back();
+                stack.pop_back();
+
+                max_depth = std::max(max_depth, depth);
+                const BuildNode& build_node = m_build_nodes[index];
+                if(!build_node.is_leaf())
+                {
+                    stack.push_back({build_node.m_children[0], depth + 1});
+                    stack.push_back({build_node.m_children[1], depth + 1});
                 }
             }
+
+            return max_depth;
         }
 
         template<typename T>
-        BVH<T, 2>* BVHFactory<T>::generate_BVH()
+        Centroid_parition_Scheme<T>::ITERATOR Centroid_parition_Scheme<T>::partition(ITERATOR start, ITERATOR end)
         {
-            const NodeIndex root_node = split_primitives(m_bounding_boxes.begin(), m_bounding_boxes.end(), m_max_depth);
+            // compute the bounds to find the longest edge.
+            AABB bounds(glm::vec4(INFINITY, INFINITY, INFINITY, INFINITY), -glm::vec4(INFINITY, INFINITY, INFINITY, INFINITY));
+            for(auto bounds_it = start; bounds_it != end; ++bounds_it)
+            {
+                bounds.add_point(bounds_it->m_bounds.get_central_point());
+            }
+
+            const glm::vec3 side_lengths = bounds.get_side_lengths();
+            const uint32_t max_component = maximum_component_index(side_lengths);
+            const float central_point =  bounds.get_central_point()[max_component];
+
+            return std::partition(start, end, [&](const auto& it){ return it.m_bounds.get_central_point()[max_component] < central_point; });
+        }
 
-            return new BVH<T, 2>(root_node, m_node_storage, std::move(m_intersector));
+        template<typename T>
+        void Morton_parition_Scheme<T>::prepare(ITERATOR start, ITERATOR end, ThreadPool* thread_pool)
+        {
+            m_first = start;
+            m_codes = sort_by_morton_code(start, end, thread_pool);
         }
 
         template<typename T>
-        NodeIndex BVHFactory<T>::split_primitives(BVHPartitionScheme<T>::ITERATOR start, BVHPartitionScheme<T>::ITERATOR end, uint32_t depth)
+        Morton_parition_Scheme<T>::ITERATOR Morton_parition_Scheme<T>::partition(ITERATOR start, ITERATOR end)
         {
-            if(start == end)
-                return kInvalidNodeIndex;
+            const size_t first = std::distance(m_first, start);
+            const size_t last = std::distance(m_first, end) - 1;
+            if(first >= last)
+                return end;
 
-            AABB bounds(glm::vec4(INFINITY, INFINITY, INFINITY, INFINITY), -glm::vec4(INFINITY, INFINITY, INFINITY, INFINITY));
+            // Primitives that share a code are split at the median.
+            const uint64_t first_code = m_codes[first];
+            const uint64_t last_code = m_codes[last];
+            if(first_code == last_code)
+                return start + ((last - first + 1) / 2);
+
+            // The range is sorted and every code shares the bits above the highest differing one,
+            // so the split is where that bit first becomes set.
+            const uint64_t split_bit = uint64_t(1) << (63 - std::countl_zero(first_code ^ last_code));
+            const auto split = std::partition_point(m_codes.begin() + first, m_codes.begin() + last + 1, [split_bit](const uint64_t code) { return (code & split_bit) == 0; });
+
+            return start + std::distance(m_codes.begin() + first, split);
+        }
+
+        template<typename T>
+        void Spatial_Split_parition_Scheme<T>::prepare(ITERATOR start, ITERATOR end, ThreadPool*)
+        {
+            m_remaining_duplicates = static_cast<size_t>(std::distance(start, end) * m_duplication_budget);
+        }
+
+        template<typename T>
+        Spatial_Split_parition_Scheme<T>::ITERATOR Spatial_Split_parition_Scheme<T>::partition(ITERATOR start, ITERATOR end)
+        {
+            return m_object_splits.partition(start, end);
+        }
+
+        template<typename T>
+        size_t Spatial_Split_parition_Scheme<T>::get_max_reference_count(const size_t primitive_count) const
+        {
+            return primitive_count + static_cast<size_t>(primitive_count * m_duplication_budget);
+        }
+
+        template<typename T>
+        bool Spatial_Split_parition_Scheme<T>::clip_reference(const BoundedValue& reference, const uint32_t axis, const float min, const float max, AABB& clipped) const
+        {
+            if(reference.m_bounds.get_min()[axis] >= min && reference.m_bounds.get_max()[axis] <= max)
+            {
+                clipped = reference.m_bounds;
+                return true;
+            }
+
+            // References may already have been clipped along other axes.
+            clipped = intersection_of(m_clip(reference.m_value, axis, min, max), reference.m_bounds);
+
+            return !is_empty(clipped);
+        }
+
+        template<typename T>
+        bool Spatial_Split_parition_Scheme<T>::split_references(ITERATOR start, ITERATOR end, std::vector<BoundedValue>& left, std::vector<BoundedValue>& right)
+        {
+            using Bucket = typename SAH_parition_Scheme<T>::Bucket;
+            constexpr uint32_t kBucketCount = SAH_parition_Scheme<T>::kBucketCount;
+
+            AABB bounds = empty_bounds();
+            AABB centroid_bounds = empty_bounds();
             for(auto bounds_it = start; bounds_it != end; ++bounds_it)
             {
                 bounds.union_of(bounds_it->m_bounds);
+                centroid_bounds.add_point(bounds_it->m_bounds.get_central_point());
             }
 
-            typename BVH<T, 2>::Node newNode{};
-            newNode.m_bounding_box = bounds;
+            // Find the best object split over all axes, costs are left unnormalised as only the two split types are compared.
+            float object_cost = INFINITY;
+            AABB object_overlap = empty_bounds();
+            for(uint32_t axis = 0; axis < 3; ++axis)
+            {
+                if(centroid_bounds.get_max()[axis] <= centroid_bounds.get_min()[axis])
+                    continue;
+
+                Bucket buckets[kBucketCount];
+                SAH_parition_Scheme<T>::bin_primitives(start, end, centroid_bounds, axis, buckets);
+
+                for(uint32_t i = 0; i < kBucketCount - 1; ++i)
+                {
+                    AABB b0 = empty_bounds();
+                    AABB b1 = empty_bounds();
+                    uint32_t count0 = 0, count1 = 0;
+                    for(uint32_t j = 0; j <= i; ++j)
+                    {
+                        b0.union_of(buckets[j].mBounds);
+                        count0 += buckets[j].mCount;
+                    }
+                    for(uint32_t j = i + 1; j < kBucketCount; ++j)
+                    {
+                        b1.union_of(buckets[j].mBounds);
+                        count1 += buckets[j].mCount;
+                    }
+
+                    const float cost = count0 * surface_area(b0) + count1 * surface_area(b1);
+                    if(count0 > 0 && count1 > 0 && cost < object_cost)
+                    {
+                        object_cost = cost;
+                        object_overlap = intersection_of(b0, b1);
+                    }
+                }
+            }
 
-            const auto pivot = m_partition_scheme->partition(start, end);
+            // Spatial splits only pay off when the object split children overlap.
+            const float node_area = surface_area(bounds);
+            if(object_cost != INFINITY && surface_area(object_overlap) <= kSpatialSplitOverlapThreshold * node_area)
+                return false;
 
-            if(depth == 0 || pivot == end || std::distance(start, end) == 2 )
+            float spatial_cost = INFINITY;
+            uint32_t spatial_axis = 0;
+            float split_position = 0.0f;
+            for(uint32_t axis = 0; axis < 3; ++axis)
             {
-                for(auto primitives_it = start; primitives_it != end; ++primitives_it)
+                const float axis_min = bounds.get_min()[axis];
+                const float axis_max = bounds.get_max()[axis];
+                const float bin_width = (axis_max - axis_min) / kSpatialBinCount;
+                if(!(bin_width > 0.0f))
+                    continue;
+
+                auto get_bin = [&](const float p)
+                {
+                    return std::min(static_cast<uint32_t>(std::max((p - axis_min) / bin_width, 0.0f)), kSpatialBinCount - 1);
+                };
+
+                Spatial_Bin bins[kSpatialBinCount];
+                for(auto& bin : bins)
+                    bin = {empty_bounds(), 0, 0};
+
+                // Each reference is clipped to every bin it covers, counting where it enters and leaves.
+                for(auto reference = start; reference != end; ++reference)
+                {
+                    const uint32_t first_bin = get_bin(reference->m_bounds.get_min()[axis]);
+                    const uint32_t last_bin = get_bin(reference->m_bounds.get_max()[axis]);
+
+                    ++bins[first_bin].m_entries;
+                    ++bins[last_bin].m_exits;
+                    for(uint32_t b = first_bin; b <= last_bin; ++b)
+                    {
+                        const float bin_min = axis_min + b * bin_width;
+                        const float bin_max = b == kSpatialBinCount - 1 ? axis_max : bin_min + bin_width;
+
+                        AABB clipped;
+                        if(first_bin == last_bin)
+                            bins[b].m_bounds.union_of(reference->m_bounds);
+                        else if(clip_reference(*reference, axis, bin_min, bin_max, clipped))
+                            bins[b].m_bounds.union_of(clipped);
+                    }
+                }
+
+                // Sweep from the right to accumulate the right hand side of each plane.
+                float right_area[kSpatialBinCount];
+                uint32_t right_count[kSpatialBinCount];
+                AABB right_bounds = empty_bounds();
+                uint32_t exits = 0;
+                for(uint32_t b = kSpatialBinCount - 1; b > 0; --b)
                 {
-                    newNode.m_values.push_back(*primitives_it);
+                    right_bounds.union_of(bins[b].m_bounds);
+                    exits += bins[b].m_exits;
+                    right_area[b] = surface_area(right_bounds);
+                    right_count[b] = exits;
                 }
 
-                newNode.m_children[0] = kInvalidNodeIndex;
-                newNode.m_children[1] = kInvalidNodeIndex;
+                AABB left_bounds = empty_bounds();
+                uint32_t entries = 0;
+                for(uint32_t b = 1; b < kSpatialBinCount; ++b)
+                {
+                    left_bounds.union_of(bins[b - 1].m_bounds);
+                    entries += bins[b - 1].m_entries;
+                    if(entries == 0 || right_count[b] == 0)
+                        continue;
 
-                return add_node(newNode);
+                    const float cost = entries * surface_area(left_bounds) + right_count[b] * right_area[b];
+                    if(cost < spatial_cost)
+                    {
+                        spatial_cost = cost;
+                        spatial_axis = axis;
+                        split_position = axis_min + b * bin_width;
+                    }
+                }
             }
 
-            newNode.m_children[0] = split_primitives(start, pivot, depth - 1);
-            newNode.m_children[1] = split_primitives(pivot, end, depth - 1);
+            if(!(spatial_cost < object_cost))
+                return false;
 
-            return add_node(newNode);
+            size_t straddling_count = 0;
+            for(auto reference = start; reference != end; ++reference)
+            {
+                if(reference->m_bounds.get_min()[spatial_axis] < split_position && reference->m_bounds.get_max()[spatial_axis] > split_position)
+                    ++straddling_count;
+            }
+
+            if(straddling_count > m_remaining_duplicates)
+                return false;
+
+            const float axis_min = bounds.get_min()[spatial_axis];
+            const float axis_max = bounds.get_max()[spatial_axis];
+            size_t duplicates = 0;
+            for(auto reference = start; reference != end; ++reference)
+            {
+                if(reference->m_bounds.get_max()[spatial_axis] <= split_position)
+                {
+                    left.push_back(*reference);
+                }
+                else if(reference->m_bounds.get_min()[spatial_axis] >= split_position)
+                {
+                    right.push_back(*reference);
+                }
+                else
+                {
+                    // Straddling references only end up duplicated when they actually cross the plane.
+                    AABB left_bounds, right_bounds;
+                    const bool in_left = clip_reference(*reference, spatial_axis, axis_min, split_position, left_bounds);
+                    const bool in_right = clip_reference(*reference, spatial_axis, split_position, axis_max, right_bounds);
+
+                    if(in_left)
+                        left.push_back({left_bounds, reference->m_value});
+                    if(in_right)
+                        right.push_back({right_bounds, reference->m_value});
+                    if(in_left && in_right)
+                        ++duplicates;
+                    else if(!in_left && !in_right)
+                        left.push_back(*reference); // Clipping precision, never drop a primitive.
+                }
+            }
+
+            if(left.empty() || right.empty())
+            {
+                left.clear();
+                right.clear();
+                return false;
+            }
+
+            m_remaining_duplicates -= duplicates;
+
+            return true;
         }
 
         template<typename T>
-        Centroid_parition_Scheme<T>::ITERATOR Centroid_parition_Scheme<T>::partition(ITERATOR start, ITERATOR end)
+        SAH_parition_Scheme<T>::ITERATOR SAH_parition_Scheme<T>::partition(ITERATOR start, ITERATOR end)
         {
-            // compute the bounds to find the longest edge.
-            AABB bounds(glm::vec4(INFINITY, INFINITY, INFINITY, INFINITY), -glm::vec4(INFINITY, INFINITY, INFINITY, INFINITY));
+            if(start == end)
+                return end;
+
+            AABB bounds = empty_bounds();
             for(auto bounds_it = start; bounds_it != end; ++bounds_it)
             {
                 bounds.add_point(bounds_it->m_bounds.get_central_point());
@@ -118,64 +1982,99 @@ namespace Core
 
             const glm::vec3 side_lengths = bounds.get_side_lengths();
             const uint32_t max_component = maximum_component_index(side_lengths);
-            const float central_point =  bounds.get_central_point()[max_component];
 
-            return std::partition(start, end, [&](const auto& it){ return it.m_bounds.get_central_point()[max_component] < central_point; });
+            Bucket buckets[kBucketCount];
+            bin_primitives(start, end, bounds, max_component, buckets);
+
+            return split_at_cheapest_bucket(start, end, bounds, max_component, buckets);
         }
 
         template<typename T>
-        SAH_parition_Scheme<T>::ITERATOR SAH_parition_Scheme<T>::partition(ITERATOR start, ITERATOR end)
+        SAH_parition_Scheme<T>::ITERATOR SAH_parition_Scheme<T>::parallel_partition(ITERATOR start, ITERATOR end, ThreadPool& pool)
         {
             if(start == end)
                 return end;
 
-            AABB bounds(glm::vec4(INFINITY, INFINITY, INFINITY, INFINITY), -glm::vec4(INFINITY, INFINITY, INFINITY, INFINITY));
-            for(auto bounds_it = start; bounds_it != end; ++bounds_it)
+            const size_t primitive_count = std::distance(start, end);
+            const size_t chunk_count = get_chunk_count(&pool);
+
+            std::vector<AABB> chunk_bounds(chunk_count, empty_bounds());
+            for_each_chunk(&pool, primitive_count, [&](const size_t chunk, const size_t begin, const size_t end)
             {
-                bounds.add_point(bounds_it->m_bounds.get_central_point());
-            }
+                for(auto bounds_it = start + begin; bounds_it != start + end; ++bounds_it)
+                    chunk_bounds[chunk].add_point(bounds_it->m_bounds.get_central_point());
+            });
+
+            AABB bounds = empty_bounds();
+            for(const auto& chunk : chunk_bounds)
+                bounds.union_of(chunk);
 
             const glm::vec3 side_lengths = bounds.get_side_lengths();
             const uint32_t max_component = maximum_component_index(side_lengths);
 
-            constexpr uint32_t bucket_count = 12;
-            Bucket buckets[bucket_count];
+            std::vector<std::array<Bucket, kBucketCount>> chunk_buckets(chunk_count);
+            for_each_chunk(&pool, primitive_count, [&](const size_t chunk, const size_t begin, const size_t end)
+            {
+                bin_primitives(start + begin, start + end, bounds, max_component, chunk_buckets[chunk].data());
+            });
+
+            Bucket buckets[kBucketCount];
+            for(uint32_t i = 0; i < kBucketCount; ++i)
+            {
+                buckets[i] = {0, empty_bounds()};
+                for(const auto& chunk : chunk_buckets)
+                {
+                    buckets[i].mCount += chunk[i].mCount;
+                    buckets[i].mBounds.union_of(chunk[i].mBounds);
+                }
+            }
+
+            return split_at_cheapest_bucket(start, end, bounds, max_component, buckets);
+        }
+
+        template<typename T>
+        void SAH_parition_Scheme<T>::bin_primitives(ITERATOR start, ITERATOR end, const AABB& centroid_bounds, const uint32_t axis, Bucket* buckets)
+        {
             // Init the buckets.
-            for(uint32_t i = 0; i < bucket_count; ++i)
+            for(uint32_t i = 0; i < kBucketCount; ++i)
             {
-                buckets[i] = {0, AABB{glm::vec4(INFINITY, INFINITY, INFINITY, INFINITY), -glm::vec4(INFINITY, INFINITY, INFINITY, INFINITY)}};
+                buckets[i] = {0, empty_bounds()};
             }
 
             for(auto i = start; i < end; ++i)
             {
-                uint32_t b = bucket_count * bounds.get_offset(i->m_bounds.get_central_point())[max_component];
-                if (b == bucket_count) b = bucket_count - 1;
+                uint32_t b = kBucketCount * centroid_bounds.get_offset(i->m_bounds.get_central_point())[axis];
+                if (b == kBucketCount) b = kBucketCount - 1;
                 buckets[b].mCount++;
                 buckets[b].mBounds.union_of(i->m_bounds);
             }
+        }
 
+        template<typename T>
+        SAH_parition_Scheme<T>::ITERATOR SAH_parition_Scheme<T>::split_at_cheapest_bucket(ITERATOR start, ITERATOR end, const AABB& centroid_bounds, const uint32_t axis, const Bucket* buckets) const
+        {
             const float leaf_cost = std::distance(start, end);
-            float cost[bucket_count - 1];
-            for (uint32_t i = 0; i < bucket_count - 1; ++i)
+            float cost[kBucketCount - 1];
+            for (uint32_t i = 0; i < kBucketCount - 1; ++i)
             {
-                AABB b0{glm::vec4(INFINITY, INFINITY, INFINITY, INFINITY), -glm::vec4(INFINITY, INFINITY, INFINITY, INFINITY)};
-                AABB b1{glm::vec4(INFINITY, INFINITY, INFINITY, INFINITY), -glm::vec4(INFINITY, INFINITY, INFINITY, INFINITY)};
+                AABB b0 = empty_bounds();
+                AABB b1 = empty_bounds();
                 uint32_t count0 = 0, count1 = 0;
                 for (uint32_t j = 0; j <= i; ++j)
                 {
                     b0.union_of(buckets[j].mBounds);
                     count0 += buckets[j].mCount;
                 }
-                for (uint32_t j = i+1; j < bucket_count; ++j)
+                for (uint32_t j = i+1; j < kBucketCount; ++j)
                 {
                     b1.union_of(buckets[j].mBounds);
                     count1 += buckets[j].mCount;
                 }
                 cost[i] = .125f + (count0 * b0.get_surface_area() +
-                                   count1 * b1.get_surface_area()) / (leaf_cost * bounds.get_surface_area());
+                                   count1 * b1.get_surface_area()) / (leaf_cost * centroid_bounds.get_surface_area());
             }
 
-            auto min_element = std::min_element(&cost[0], &cost[bucket_count - 1]);
+            auto min_element = std::min_element(&cost[0], &cost[kBucketCount - 1]);
             const float minCost = *min_element;
             const uint32_t minCostSplitBucket = std::distance(&cost[0], min_element);
 
@@ -183,10 +2082,10 @@ namespace Core
             {
                 return std::partition(start,
                                       end,
-                                      [&](const auto pi)
+                                      [&](const auto& pi)
                                       {
-                                        uint32_t b = bucket_count * bounds.get_offset(pi.m_bounds.get_central_point())[max_component];
-                                        if (b == bucket_count) b = bucket_count - 1;
+                                        uint32_t b = kBucketCount * centroid_bounds.get_offset(pi.m_bounds.get_central_point())[axis];
+                                        if (b == kBucketCount) b = kBucketCount - 1;
                                         return b <= minCostSplitBucket;
                                       });
             }
@@ -209,6 +2108,36 @@ template
 template
     class Core::Acceleration_Structures::BVH<uint32_t, 2>;
 
+template
+    class Core::Acceleration_Structures::FlatBVH<const Core::Acceleration_Structures::UpperLevelBVH::Entry*>;
+
+template
+    class Core::Acceleration_Structures::FlatBVH<uint32_t>;
+
+template
+    class Core::Acceleration_Structures::WideBVH<const Core::Acceleration_Structures::UpperLevelBVH::Entry*, 4>;
+
+template
+    class Core::Acceleration_Structures::WideBVH<const Core::Acceleration_Structures::UpperLevelBVH::Entry*, 8>;
+
+template
+    class Core::Acceleration_Structures::WideBVH<uint32_t, 4>;
+
+template
+    class Core::Acceleration_Structures::WideBVH<uint32_t, 8>;
+
+template
+    class Core::Acceleration_Structures::CompressedWideBVH<const Core::Acceleration_Structures::UpperLevelBVH::Entry*, 4>;
+
+template
+    class Core::Acceleration_Structures::CompressedWideBVH<const Core::Acceleration_Structures::UpperLevelBVH::Entry*, 8>;
+
+template
+    class Core::Acceleration_Structures::CompressedWideBVH<uint32_t, 4>;
+
+template
+    class Core::Acceleration_Structures::CompressedWideBVH<uint32_t, 8>;
+
 template
     class Core::Acceleration_Structures::BVHFactory<uint32_t>;
 
@@ -222,8 +2151,13 @@ template
     class Core::Acceleration_Structures::SAH_parition_Scheme<uint32_t>;
 
 template
-    class Core::Acceleration_Structures::SAH_parition_Scheme<const Core::Acceleration_Structures::UpperLevelBVH::Entry*>;
-
+    class Core::Acceleration_Structures::Morton_parition_Scheme<uint32_t>;
 
+template
+    class Core::Acceleration_Structures::Morton_parition_Scheme<const Core::Acceleration_Structures::UpperLevelBVH::Entry*>;
 
+template
+    class Core::Acceleration_Structures::SAH_parition_Scheme<const Core::Acceleration_Structures::UpperLevelBVH::Entry*>;
 
+template
+    class Core::Acceleration_Structures::Spatial_Split_parition_Scheme<uint32_t>;
@@ -1,10 +1,19 @@
 #ifndef PICO_BVH_HPP
 #define PICO_BVH_HPP
 
+#include <array>
+#include <atomic>
+#include <bit>
+#include <functional>
+#include <limits>
 #include <memory>
 #include <vector>
 
 #include "AABB.hpp"
+#include "MappedFile.hpp"
+#include "glm/vec2.hpp"
+
+class ThreadPool;
 
 namespace Core
 {
@@ -13,7 +22,21 @@ namespace Core
         constexpr uint32_t kInvalidNodeIndex = ~0u;
         using NodeIndex = uint32_t;
 
-        struct InterpolatedVertex;
+        // Sizes the fixed traversal stacks, deeper trees are split in to leaves by the factory.
+        constexpr uint32_t kMaxTraversalDepth = 64;
+
+        // Most rays the packet queries trace together, packets are passed as arrays of this size with a bit mask
+        // selecting the active rays.
+        constexpr uint32_t kRayPacketSize = 8;
+
+        // Everything needed to interpolate the closest hit once traversal has finished.
+        struct HitRecord
+        {
+            float     m_distance;
+            uint32_t  m_instance;
+            uint32_t  m_primitive;
+            glm::vec2 m_barycentrics;
+        };
 
         template<typename T>
         class Intersector
@@ -22,11 +45,126 @@ namespace Core
 
             virtual ~Intersector() {}
 
-            virtual bool intersects(const Ray& ray, T, float& intersect_distance, Core::Acceleration_Structures::InterpolatedVertex& intersection_data) const = 0;
+            // Returns true and updates hit if the entity is intersected closer than hit.m_distance.
+            virtual bool intersects(const Ray& ray, T, HitRecord& hit) const = 0;
+
+            // Any hit query, returns true if the entity is intersected closer than max_distance.
+            virtual bool occludes(const Ray& ray, T, const float max_distance) const = 0;
+
+            // Tests a leaf's primitives [first, first + count) of the primitive array, which is passed whole so
+            // intersectors can keep precomputed data indexed by the same positions.
+            virtual bool intersects_leaf(const Ray& ray, const T* primitives, const uint32_t first, const uint32_t count, HitRecord& hit) const
+            {
+                bool found = false;
+                for(uint32_t i = first; i < first + count; ++i)
+                    found |= intersects(ray, primitives[i], hit);
+
+                return found;
+            }
+
+            virtual bool occludes_leaf(const Ray& ray, const T* primitives, const uint32_t first, const uint32_t count, const float max_distance) const
+            {
+                for(uint32_t i = first; i < first + count; ++i)
+                {
+                    if(occludes(ray, primitives[i], max_distance))
+                        return true;
+                }
+
+                return false;
+            }
+
+            // Packet versions, return the mask of rays that found a closer hit or were occluded.
+            virtual uint32_t intersects_leaf_packet(const Ray* rays, const uint32_t ray_mask, const T* primitives, const uint32_t first, const uint32_t count, HitRecord* hits) const
+            {
+                uint32_t found = 0;
+                for(uint32_t mask = ray_mask; mask != 0; mask &= mask - 1)
+                {
+                    const uint32_t r = std::countr_zero(mask);
+                    if(intersects_leaf(rays[r], primitives, first, count, hits[r]))
+                        found |= 1u << r;
+                }
+
+                return found;
+            }
+
+            virtual uint32_t occludes_leaf_packet(const Ray* rays, const uint32_t ray_mask, const T* primitives, const uint32_t first, const uint32_t count, const float* max_distances) const
+            {
+                uint32_t occluded = 0;
+                for(uint32_t mask = ray_mask; mask != 0; mask &= mask - 1)
+                {
+                    const uint32_t r = std::countr_zero(mask);
+                    if(occludes_leaf(rays[r], primitives, first, count, max_distances[r]))
+                        occluded |= 1u << r;
+                }
+
+                return occluded;
+            }
+        };
+
+        // Returns the current bounds of a primitive, used to refit a BVH after its primitives have moved.
+        template<typename T>
+        using Bounds_Function = std::function<AABB(const T&)>;
+
+        // Common interface for all of the node layouts that BVHFactory can generate.
+        template<typename T>
+        class Acceleration_Structure
+        {
+        public:
+
+            virtual ~Acceleration_Structure() {}
+
+            // Recomputes the bounds of every node bottom up, keeping the tree's topology. Each level of the tree is
+            // refit in parallel on thread_pool when one is provided. Returns false for layouts that can't be refit.
+            virtual bool refit(const Bounds_Function<T>&, ThreadPool*)
+            {
+                return false;
+            }
+
+            // Surface area heuristic cost of the tree, comparing it before and after a refit shows how much the
+            // tree has degraded.
+            virtual float get_sah_cost() const
+            {
+                return 0.0f;
+            }
+
+            // Finds the closest intersection nearer than hit.m_distance, only hit is written so vertex attributes
+            // can be interpolated once for the final hit.
+            virtual bool get_first_intersection(Ray& ray, HitRecord& hit) const = 0;
+
+            // Returns as soon as any intersection closer than max_distance is found.
+            virtual bool is_occluded(Ray& ray, const float max_distance) const = 0;
+
+            // Packet versions for up to kRayPacketSize coherent rays, return the mask of rays that found a closer
+            // hit or were occluded. Layouts without packet traversal trace the rays one at a time.
+            virtual uint32_t get_first_intersections(Ray* rays, const uint32_t ray_mask, HitRecord* hits) const
+            {
+                uint32_t found = 0;
+                for(uint32_t mask = ray_mask; mask != 0; mask &= mask - 1)
+                {
+                    const uint32_t r = std::countr_zero(mask);
+                    if(get_first_intersection(rays[r], hits[r]))
+                        found |= 1u << r;
+                }
+
+                return found;
+            }
+
+            virtual uint32_t are_occluded(Ray* rays, const uint32_t ray_mask, const float* max_distances) const
+            {
+                uint32_t occluded = 0;
+                for(uint32_t mask = ray_mask; mask != 0; mask &= mask - 1)
+                {
+                    const uint32_t r = std::countr_zero(mask);
+                    if(is_occluded(rays[r], max_distances[r]))
+                        occluded |= 1u << r;
+                }
+
+                return occluded;
+            }
         };
 
         template<typename T, uint32_t C>
-        class BVH
+        class BVH : public Acceleration_Structure<T>
         {
         public:
             struct Node;
@@ -41,7 +179,9 @@ namespace Core
             BVH(BVH&&) = default;
             BVH& operator=(BVH&&) = default;
 
-            bool get_first_intersection(Ray& ray, Acceleration_Structures::InterpolatedVertex&) const;
+            virtual bool get_first_intersection(Ray& ray, HitRecord& hit) const override;
+
+            virtual bool is_occluded(Ray& ray, const float max_distance) const override;
 
             struct BoundedValue
             {
@@ -72,7 +212,10 @@ namespace Core
                 return m_nodes[n];
             }
 
-            void    get_closest_intersections(const Ray& ray, const typename BVH<T, C>::Node& node, Core::Acceleration_Structures::InterpolatedVertex& intersection, float& intersection_distance) const;
+            // Visits the primitives of the leaves hit by the ray front to back, culling against max_distance.
+            // Traversal stops as soon as visit_primitive returns true.
+            template<typename F>
+            void traverse(Ray& ray, float& max_distance, F&& visit_primitive) const;
 
             NodeIndex m_root;
 
@@ -81,6 +224,263 @@ namespace Core
             std::unique_ptr<Intersector<T>> m_intersector;
         };
 
+        // Compact node layout. Nodes are stored depth first in a single array with the first child
+        // directly following its parent, and leaf primitives are stored contiguously in a single array.
+        template<typename T>
+        class FlatBVH : public Acceleration_Structure<T>
+        {
+        public:
+
+            struct alignas(32) Node
+            {
+                glm::vec3 m_bounds[2]; // Minimum followed by maximum.
+
+                // Offset in to the primitive array for leaves, index of the second child for interior nodes.
+                uint32_t  m_offset;
+                uint16_t  m_primitive_count;
+                uint8_t   m_split_axis;
+                uint8_t   m_padding;
+
+                bool is_leaf() const
+                {
+                    return m_primitive_count > 0;
+                }
+            };
+            static_assert(sizeof(Node) == 32, "FlatBVH nodes should fit two per cache line");
+
+            static constexpr uint32_t kMaxLeafPrimitives = std::numeric_limits<uint16_t>::max();
+
+            // The node and primitive arrays can view a mapped BVH cache instead of owning their data.
+            FlatBVH(Array_Storage<Node>&& nodes, Array_Storage<T>&& primitives, std::unique_ptr<Intersector<T>>&& intersector) :
+                m_nodes{std::move(nodes)},
+                m_primitives{std::move(primitives)},
+                m_intersector{std::move(intersector)} {}
+
+            virtual bool get_first_intersection(Ray& ray, HitRecord& hit) const override;
+
+            virtual bool is_occluded(Ray& ray, const float max_distance) const override;
+
+            size_t get_node_count() const
+            {
+                return m_nodes.size();
+            }
+
+            const Array_Storage<Node>& get_nodes() const
+            {
+                return m_nodes;
+            }
+
+            const Array_Storage<T>& get_primitives() const
+            {
+                return m_primitives;
+            }
+
+            Array_Storage<T>& get_primitives()
+            {
+                return m_primitives;
+            }
+
+        private:
+
+            // Visits the leaves hit by the ray front to back as ranges of the primitive array, culling against
+            // max_distance. Traversal stops as soon as visit_leaf returns true.
+            template<typename F>
+            void traverse(Ray& ray, float& max_distance, F&& visit_leaf) const;
+
+            Array_Storage<Node> m_nodes;
+            Array_Storage<T>    m_primitives;
+
+            std::unique_ptr<Intersector<T>> m_intersector;
+        };
+
+        // Wide layout, each node stores the bounds of up to W children as SoA so that
+        // all of them can be tested at once with SSE (4 wide) or AVX (8 wide).
+        template<typename T, uint32_t W>
+        class WideBVH : public Acceleration_Structure<T>
+        {
+        public:
+
+            static_assert(W == 4 || W == 8, "Only 4 and 8 wide BVHs are supported");
+
+            struct alignas(32) Node
+            {
+                // Rows are minimum x, y, z followed by maximum x, y, z.
+                // Unused child slots have NaN bounds so they always fail the slab test.
+                float    m_bounds[6][W];
+
+                // Node index for interior children, offset in to the primitive array for leaf children.
+                uint32_t m_children[W];
+                uint32_t m_primitive_counts[W];
+
+                bool is_leaf(const uint32_t child) const
+                {
+                    return m_primitive_counts[child] > 0;
+                }
+            };
+
+            // The node and primitive arrays can view a mapped BVH cache instead of owning their data.
+            WideBVH(Array_Storage<Node>&& nodes, Array_Storage<T>&& primitives, std::unique_ptr<Intersector<T>>&& intersector) :
+                m_nodes{std::move(nodes)},
+                m_primitives{std::move(primitives)},
+                m_intersector{std::move(intersector)} {}
+
+            virtual bool get_first_intersection(Ray& ray, HitRecord& hit) const override;
+
+            virtual bool is_occluded(Ray& ray, const float max_distance) const override;
+
+            virtual uint32_t get_first_intersections(Ray* rays, const uint32_t ray_mask, HitRecord* hits) const override;
+
+            virtual uint32_t are_occluded(Ray* rays, const uint32_t ray_mask, const float* max_distances) const override;
+
+            virtual bool refit(const Bounds_Function<T>& get_bounds, ThreadPool* thread_pool) override;
+
+            virtual float get_sah_cost() const override;
+
+            size_t get_node_count() const
+            {
+                return m_nodes.size();
+            }
+
+            const Array_Storage<Node>& get_nodes() const
+            {
+                return m_nodes;
+            }
+
+            const Array_Storage<T>& get_primitives() const
+            {
+                return m_primitives;
+            }
+
+            Array_Storage<T>& get_primitives()
+            {
+                return m_primitives;
+            }
+
+        private:
+
+            // Visits the leaves hit by the ray front to back as ranges of the primitive array, culling against
+            // max_distance. Traversal stops as soon as visit_leaf returns true.
+            template<typename F>
+            void traverse(Ray& ray, float& max_distance, F&& visit_leaf) const;
+
+            // Walks the packet through the tree with a shared stack, each entry keeps the mask of rays that hit it.
+            // visit_leaf is passed the leaf range and the rays that hit it, and returns the rays that are finished.
+            template<typename F>
+            void traverse_packet(Ray* rays, uint32_t ray_mask, const float* max_distances, F&& visit_leaf) const;
+
+            Array_Storage<Node> m_nodes;
+            Array_Storage<T>    m_primitives;
+
+            std::unique_ptr<Intersector<T>> m_intersector;
+        };
+
+        // Compressed wide layout for very large meshes. Child bounds are stored as 8 bit offsets in a grid that spans
+        // the node with a power of two cell size per axis, rounded outwards so they stay conservative. Interior children
+        // are stored next to each other, as are the primitives of the leaf children, so a node only keeps the first
+        // of each. Nodes are decoded to the WideBVH node layout as they are visited.
+        template<typename T, uint32_t W>
+        class CompressedWideBVH : public Acceleration_Structure<T>
+        {
+        public:
+
+            static_assert(W == 4 || W == 8, "Only 4 and 8 wide BVHs are supported");
+
+            struct alignas(16) Node
+            {
+                float    m_origin[3];
+                int8_t   m_exponents[3];
+                uint8_t  m_interior_mask; // Bit n is set if child n is an interior node.
+
+                uint32_t m_first_child;
+                uint32_t m_first_primitive;
+
+                // Zero for interior children and unused slots.
+                uint8_t  m_primitive_counts[W];
+
+                // Rows are minimum x, y, z followed by maximum x, y, z.
+                uint8_t  m_bounds[6][W];
+            };
+
+            static constexpr uint32_t kMaxLeafPrimitives = std::numeric_limits<uint8_t>::max();
+
+            using Decoded_Node = typename WideBVH<T, W>::Node;
+
+            // The node and primitive arrays can view a mapped BVH cache instead of owning their data.
+            CompressedWideBVH(Array_Storage<Node>&& nodes, Array_Storage<T>&& primitives, std::unique_ptr<Intersector<T>>&& intersector) :
+                m_nodes{std::move(nodes)},
+                m_primitives{std::move(primitives)},
+                m_intersector{std::move(intersector)} {}
+
+            virtual bool get_first_intersection(Ray& ray, HitRecord& hit) const override;
+
+            virtual bool is_occluded(Ray& ray, const float max_distance) const override;
+
+            virtual uint32_t get_first_intersections(Ray* rays, const uint32_t ray_mask, HitRecord* hits) const override;
+
+            virtual uint32_t are_occluded(Ray* rays, const uint32_t ray_mask, const float* max_distances) const override;
+
+            virtual bool refit(const Bounds_Function<T>& get_bounds, ThreadPool* thread_pool) override;
+
+            virtual float get_sah_cost() const override;
+
+            static void decode_node(const Node& node, Decoded_Node& decoded);
+
+            size_t get_node_count() const
+            {
+                return m_nodes.size();
+            }
+
+            const Array_Storage<Node>& get_nodes() const
+            {
+                return m_nodes;
+            }
+
+            const Array_Storage<T>& get_primitives() const
+            {
+                return m_primitives;
+            }
+
+            Array_Storage<T>& get_primitives()
+            {
+                return m_primitives;
+            }
+
+        private:
+
+            // Same as the WideBVH traversals, decoding each node as it's visited.
+            template<typename F>
+            void traverse(Ray& ray, float& max_distance, F&& visit_leaf) const;
+
+            template<typename F>
+            void traverse_packet(Ray* rays, uint32_t ray_mask, const float* max_distances, F&& visit_leaf) const;
+
+            Array_Storage<Node> m_nodes;
+            Array_Storage<T>    m_primitives;
+
+            std::unique_ptr<Intersector<T>> m_intersector;
+        };
+
+        enum class BVHNodeLayout
+        {
+            kPointer,
+            kFlat,
+            kWide4,
+            kWide8,
+            kCompressedWide4,
+            kCompressedWide8
+        };
+
+        // Use the widest layout the target can test in a single instruction.
+#ifdef __AVX__
+        constexpr BVHNodeLayout kDefaultWideNodeLayout = BVHNodeLayout::kWide8;
+        constexpr BVHNodeLayout kDefaultCompressedNodeLayout = BVHNodeLayout::kCompressedWide8;
+        constexpr uint32_t      kDefaultWideNodeWidth = 8;
+#else
+        constexpr BVHNodeLayout kDefaultWideNodeLayout = BVHNodeLayout::kWide4;
+        constexpr BVHNodeLayout kDefaultCompressedNodeLayout = BVHNodeLayout::kCompressedWide4;
+        constexpr uint32_t      kDefaultWideNodeWidth = 4;
+#endif
+
         template<typename T>
         class BVHPartitionScheme
         {
@@ -88,7 +488,29 @@ namespace Core
 
             using ITERATOR = std::vector<typename BVH<T, 2>::BoundedValue>::iterator;
 
+            // Called once with every primitive before the build starts, thread_pool may be null.
+            virtual void prepare(ITERATOR, ITERATOR, ThreadPool*) {}
+
             virtual ITERATOR partition(ITERATOR start, ITERATOR end) = 0;
+
+            // Used for the large nodes near the root, schemes that can't split the work up just partition serially.
+            virtual ITERATOR parallel_partition(ITERATOR start, ITERATOR end, ThreadPool&)
+            {
+                return partition(start, end);
+            }
+
+            // Schemes that can duplicate references report the most references a build could end up with.
+            virtual size_t get_max_reference_count(const size_t primitive_count) const
+            {
+                return primitive_count;
+            }
+
+            // Returns false to fall back to partition, otherwise left and right are filled with the
+            // (possibly clipped and duplicated) references for each child.
+            virtual bool split_references(ITERATOR, ITERATOR, std::vector<typename BVH<T, 2>::BoundedValue>&, std::vector<typename BVH<T, 2>::BoundedValue>&)
+            {
+                return false;
+            }
         };
 
         template<typename T>
@@ -112,7 +534,92 @@ namespace Core
                 AABB mBounds;
             };
 
+            static constexpr uint32_t kBucketCount = 12;
+
+            virtual ITERATOR partition(ITERATOR start, ITERATOR end) override final;
+
+            // Bins chunks of the range on the thread pool and merges the buckets before partitioning.
+            virtual ITERATOR parallel_partition(ITERATOR start, ITERATOR end, ThreadPool&) override final;
+
+            static void bin_primitives(ITERATOR start, ITERATOR end, const AABB& centroid_bounds, const uint32_t axis, Bucket* buckets);
+
+        private:
+
+            ITERATOR split_at_cheapest_bucket(ITERATOR start, ITERATOR end, const AABB& centroid_bounds, const uint32_t axis, const Bucket* buckets) const;
+        };
+
+        // Linear BVH partitioning, prepare sorts the primitives by the Morton code of their centroids and each
+        // node is then split where the highest differing bit of its codes changes. Much faster to build than SAH
+        // at the cost of some tree quality.
+        template<typename T>
+        class Morton_parition_Scheme : public BVHPartitionScheme<T>
+        {
+        public:
+            using ITERATOR = BVHPartitionScheme<T>::ITERATOR;
+
+            virtual void prepare(ITERATOR start, ITERATOR end, ThreadPool* thread_pool) override final;
+
+            virtual ITERATOR partition(ITERATOR start, ITERATOR end) override final;
+
+        private:
+
+            ITERATOR              m_first;
+            std::vector<uint64_t> m_codes; // Sorted, in the same order as the primitives.
+        };
+
+        // Split BVH, as well as SAH object splits it considers splitting along planes that clip the references
+        // straddling them. Helps meshes with long thin primitives whose bounds overlap heavily. Duplicated
+        // references are limited to duplication_budget times the primitive count.
+        template<typename T>
+        class Spatial_Split_parition_Scheme : public BVHPartitionScheme<T>
+        {
+        public:
+            using ITERATOR = BVHPartitionScheme<T>::ITERATOR;
+            using BoundedValue = typename BVH<T, 2>::BoundedValue;
+
+            // Returns the bounds of the part of a primitive between min and max along axis.
+            using Clip_Function = std::function<AABB(const T&, const uint32_t axis, const float min, const float max)>;
+
+            Spatial_Split_parition_Scheme(Clip_Function&& clip, const float duplication_budget) :
+                m_clip{std::move(clip)},
+                m_duplication_budget{duplication_budget},
+                m_remaining_duplicates{0},
+                m_object_splits{} {}
+
+            virtual void prepare(ITERATOR start, ITERATOR end, ThreadPool*) override final;
+
             virtual ITERATOR partition(ITERATOR start, ITERATOR end) override final;
+
+            virtual size_t get_max_reference_count(const size_t primitive_count) const override final;
+
+            virtual bool split_references(ITERATOR start, ITERATOR end, std::vector<BoundedValue>& left, std::vector<BoundedValue>& right) override final;
+
+        private:
+
+            static constexpr uint32_t kSpatialBinCount = 32;
+
+            struct Spatial_Bin
+            {
+                AABB     m_bounds;
+                uint32_t m_entries;
+                uint32_t m_exits;
+            };
+
+            // Clips reference to the slab, returns false if nothing is left.
+            bool clip_reference(const BoundedValue& reference, const uint32_t axis, const float min, const float max, AABB& clipped) const;
+
+            Clip_Function m_clip;
+            float         m_duplication_budget;
+            size_t        m_remaining_duplicates;
+
+            SAH_parition_Scheme<T> m_object_splits;
+        };
+
+        enum class BVHBuilder
+        {
+            kRecursive,      // Single threaded top down build.
+            kParallelBinned, // Builds subtrees and bins large nodes on a ThreadPool.
+            kPLOC            // Bottom up agglomerative clustering of Morton sorted primitives, ignores the partition scheme.
         };
 
         template<typename T>
@@ -126,10 +633,14 @@ namespace Core
                 m_root_bounding_box{rootBox},
                 m_bounding_boxes{data},
                 m_intersector{},
-                m_max_depth{32u} {}
+                m_max_depth{32u},
+                m_leaf_size{2u},
+                m_node_layout{BVHNodeLayout::kFlat},
+                m_builder{BVHBuilder::kRecursive},
+                m_thread_pool{nullptr} {}
 
 
-            BVH<T, 2>* generate_BVH();
+            Acceleration_Structure<T>* generate_BVH();
 
             BVHFactory<T>& set_intersector(std::unique_ptr<Intersector<T>>&& intersector)
             {
@@ -149,30 +660,107 @@ namespace Core
                 return *this;
             }
 
+            // Nodes with at most this many primitives become leaves, match it to the width of SIMD leaf intersectors.
+            // The PLOC builder always produces single primitive leaves.
+            BVHFactory<T>& set_leaf_size(const uint32_t leaf_size)
+            {
+                m_leaf_size = leaf_size;
+                return *this;
+            }
+
+            BVHFactory<T>& set_node_layout(const BVHNodeLayout layout)
+            {
+                m_node_layout = layout;
+                return *this;
+            }
+
+            // The parallel builder falls back to the recursive one without a thread pool, PLOC runs single threaded without one.
+            BVHFactory<T>& set_builder(const BVHBuilder builder, ThreadPool* thread_pool = nullptr)
+            {
+                m_builder = builder;
+                m_thread_pool = thread_pool;
+                return *this;
+            }
+
 
         private:
 
+            // Binary tree generated by the partition schemes, leaves reference a range of m_bounding_boxes.
+            struct BuildNode
+            {
+                AABB      m_bounds;
+                NodeIndex m_children[2];
+                uint32_t  m_first_primitive;
+                uint32_t  m_primitive_count;
+
+                bool is_leaf() const
+                {
+                    return m_primitive_count > 0;
+                }
+            };
+
             NodeIndex split_primitives(BVHPartitionScheme<T>::ITERATOR start, BVHPartitionScheme<T>::ITERATOR end,uint32_t depth);
 
-            NodeIndex add_node(const typename BVH<T, 2>::Node& n)
+            // Used by schemes that duplicate references, leaves are gathered in to m_leaf_references.
+            NodeIndex split_references(std::vector<BuilderNode>& references, uint32_t depth);
+
+            // Returns kInvalidNodeIndex if the tree is too deep to traverse.
+            NodeIndex cluster_primitives();
+            uint32_t  get_depth(const NodeIndex node) const;
+
+            // m_build_nodes is preallocated so subtrees can be built concurrently.
+            NodeIndex add_node(const BuildNode& n)
             {
-                const NodeIndex i = m_node_storage.size();
-                m_node_storage.push_back(n);
+                const NodeIndex i = m_build_node_count.fetch_add(1, std::memory_order_relaxed);
+                m_build_nodes[i] = n;
 
                 return i;
             }
 
+            BVH<T, 2>*  generate_pointer_BVH(const NodeIndex root);
+            NodeIndex   add_pointer_node(const NodeIndex build_node, std::vector<typename BVH<T, 2>::Node>& node_storage) const;
+
+            FlatBVH<T>* generate_flat_BVH(const NodeIndex root);
+            NodeIndex   add_flat_node(const NodeIndex build_node, std::vector<typename FlatBVH<T>::Node>& node_storage, std::vector<T>& primitives) const;
+
+            // Collapses the binary build tree in to W wide nodes.
+            template<uint32_t W>
+            WideBVH<T, W>* generate_wide_BVH(const NodeIndex root);
+            template<uint32_t W>
+            NodeIndex      add_wide_node(const NodeIndex* build_children, uint32_t child_count, std::vector<typename WideBVH<T, W>::Node>& node_storage, std::vector<T>& primitives) const;
+
+            // Pulls grandchildren up until there are W children or only leaves left, returns the new child count.
+            template<uint32_t W>
+            uint32_t       collapse_children(std::array<NodeIndex, W>& children, uint32_t child_count) const;
+
+            template<uint32_t W>
+            CompressedWideBVH<T, W>* generate_compressed_wide_BVH(const NodeIndex root);
+            // Fills the already allocated node, its interior children are allocated together at the end of node_storage.
+            template<uint32_t W>
+            void           fill_compressed_node(const NodeIndex node, const NodeIndex* build_children, uint32_t child_count,
+                                                std::vector<typename CompressedWideBVH<T, W>::Node>& node_storage, std::vector<T>& primitives) const;
+            // Splits leaves with more primitives than a compressed node can reference in to a subtree.
+            template<uint32_t W>
+            void           fill_compressed_leaf_node(const NodeIndex node, const AABB& bounds, const uint32_t first_primitive, const uint32_t primitive_count,
+                                                     std::vector<typename CompressedWideBVH<T, W>::Node>& node_storage, std::vector<T>& primitives) const;
+
 
-            std::vector<typename BVH<T, 2>::Node> m_node_storage;
+            std::vector<BuildNode> m_build_nodes;
+            std::atomic<uint32_t>  m_build_node_count;
 
             AABB m_root_bounding_box; // AABB that all others are contained within.
             std::vector<BuilderNode> m_bounding_boxes;
+            std::vector<BuilderNode> m_leaf_references;
 
             std::unique_ptr<Intersector<T>> m_intersector;
             std::unique_ptr<BVHPartitionScheme<T>> m_partition_scheme;
 
             // Build settings
             uint32_t m_max_depth;
+            uint32_t m_leaf_size;
+            BVHNodeLayout m_node_layout;
+            BVHBuilder m_builder;
+            ThreadPool* m_thread_pool;
         };
 
 
@@ -19,10 +19,7 @@ namespace Scene
         Core::Ray ray;
         ray.mDirection = dir;
         ray.mOrigin = glm::vec4(getPosition(), 1.0f);
-        ray.mLenght = getFarPlane();
-        ray.push_index_of_refraction(1.0f);
-        ray.m_payload = glm::vec3(0.0f, 0.0f, 0.0f);
-        ray.m_throughput = glm::vec3(1.0f, 1.0f, 1.0f);
+        ray.mLenght = INFINITY; // The far plane isn't used to clip primary rays.
 
         return ray;
     }
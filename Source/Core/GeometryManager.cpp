@@ -0,0 +1,98 @@
+#include "GeometryManager.hpp"
+#include "Core/Asserts.hpp"
+#include "Core/MappedFile.hpp"
+
+#include <algorithm>
+
+namespace Core
+{
+
+    GeometryManager::GeometryManager(const size_t budget) :
+        m_budget{budget},
+        m_meshes{},
+        m_update_index{0},
+        m_mesh_faults{0},
+        m_evictions{0},
+        m_resident_size{0},
+        m_initial_page_faults{get_page_fault_count()}
+    {
+    }
+
+    void GeometryManager::add_mesh(Acceleration_Structures::LowerLevelMeshBVH* mesh)
+    {
+        PICO_ASSERT(mesh->is_out_of_core());
+
+        std::unique_lock l(m_update_mutex);
+        m_meshes.push_back({mesh, m_update_index, mesh->get_residence_size()});
+        if(mesh->is_resident())
+            m_resident_size += m_meshes.back().m_size;
+    }
+
+    void GeometryManager::update()
+    {
+        std::unique_lock l(m_update_mutex, std::try_to_lock);
+        if(!l.owns_lock())
+            return;
+
+        ++m_update_index;
+
+        const size_t mesh_count = m_meshes.size();
+        std::erase_if(m_meshes, [this](const Entry& entry)
+        {
+            if(entry.m_mesh->is_out_of_core())
+                return false;
+
+            if(entry.m_mesh->is_resident())
+                m_resident_size -= entry.m_size;
+
+            return true;
+        });
+        if(m_meshes.size() != mesh_count)
+            PICO_LOG("Stopped managing %zu meshes that are no longer out of core\n", mesh_count - m_meshes.size());
+
+        for(Entry& entry : m_meshes)
+        {
+            if(!entry.m_mesh->take_used())
+                continue;
+
+            entry.m_last_used = m_update_index;
+            if(!entry.m_mesh->is_resident())
+            {
+                entry.m_mesh->make_resident(nullptr);
+                m_resident_size += entry.m_size;
+                ++m_mesh_faults;
+            }
+        }
+
+        if(m_resident_size <= m_budget)
+            return;
+
+        // Least recently used first, meshes used since the last update are left alone even if that keeps the
+        // budget exceeded as they are likely to be needed again straight away.
+        std::vector<Entry*> candidates;
+        for(Entry& entry : m_meshes)
+        {
+            if(entry.m_mesh->is_resident() && entry.m_last_used < m_update_index)
+                candidates.push_back(&entry);
+        }
+        std::sort(candidates.begin(), candidates.end(), [](const Entry* lhs, const Entry* rhs) { return lhs->m_last_used < rhs->m_last_used; });
+
+        for(Entry* entry : candidates)
+        {
+            if(m_resident_size <= m_budget)
+                break;
+
+            m_resident_size -= entry->m_size;
+            entry->m_mesh->make_nonresident();
+            ++m_evictions;
+        }
+    }
+
+    GeometryManager::Statistics GeometryManager::get_statistics() const
+    {
+        std::unique_lock l(m_update_mutex);
+
+        return {m_mesh_faults, m_evictions, get_page_fault_count() - m_initial_page_faults, m_resident_size};
+    }
+
+}
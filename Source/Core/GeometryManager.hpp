@@ -0,0 +1,68 @@
+#ifndef GEOMETRY_MANAGER_HPP
+#define GEOMETRY_MANAGER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "Core/LowerLevelMeshBVH.hpp"
+
+
+namespace Core
+{
+
+    // Keeps the out of core meshes that are resident within a memory budget, evicting the ones that have gone
+    // longest without being traversed. Meshes are never unusable, an evicted mesh that is traversed again pages
+    // itself back in from its file and is made resident at the next update. Meshes that stop being out of core, such
+    // as updated ones, are dropped at the next update.
+    class GeometryManager
+    {
+    public:
+
+        struct Statistics
+        {
+            uint64_t m_mesh_faults;  // Nonresident meshes that were traversed and brought back.
+            uint64_t m_evictions;
+            uint64_t m_page_faults;  // Taken by the whole process since the manager was created.
+            size_t   m_resident_size;
+        };
+
+        GeometryManager(const size_t budget);
+
+        void add_mesh(Acceleration_Structures::LowerLevelMeshBVH* mesh);
+
+        // Safe to call from any thread while rendering, only one caller does the work and the rest return straight
+        // away.
+        void update();
+
+        Statistics get_statistics() const;
+
+        bool empty() const
+        {
+            return m_meshes.empty();
+        }
+
+    private:
+
+        struct Entry
+        {
+            Acceleration_Structures::LowerLevelMeshBVH* m_mesh;
+            uint64_t                                     m_last_used;
+            size_t                                       m_size; // Counted while resident, the mapping can be released.
+        };
+
+        size_t             m_budget;
+        std::vector<Entry> m_meshes;
+
+        mutable std::mutex m_update_mutex;
+        uint64_t           m_update_index;
+        uint64_t           m_mesh_faults;
+        uint64_t           m_evictions;
+        size_t             m_resident_size;
+        size_t             m_initial_page_faults;
+    };
+
+}
+
+#endif
@@ -2,8 +2,10 @@
 #define LOWER_LEVEL_BVH_HPP
 
 #include "AABB.hpp"
+#include "BVH.hpp"
 #include "Core/MaterialManager.hpp"
 #include "Core/RandUtils.hpp"
+#include "Core/Sampler.hpp"
 #include "Render/BSRDF.hpp"
 
 namespace Core
@@ -28,14 +30,49 @@ namespace Core
             LowerLevelBVH() = default;
             virtual ~LowerLevelBVH() = default;
 
-            virtual bool calculate_intersection(Ray&, InterpolatedVertex* result) const = 0;
+            // Updates hit if an intersection closer than hit.m_distance is found.
+            virtual bool calculate_intersection(Ray&, HitRecord& hit) const = 0;
+
+            // Generates the vertex attributes for a hit found by calculate_intersection with the same ray.
+            virtual InterpolatedVertex interpolate_hit(const Ray&, const HitRecord& hit) const = 0;
+
+            // Any hit query, doesn't generate any vertex attributes.
+            virtual bool is_occluded(Ray&, const float max_distance) const = 0;
+
+            // Packet versions of the queries above for kRayPacketSize arrays of rays, return the mask of rays that found
+            // a closer hit or were occluded. Shapes without packet traversal trace the rays one at a time.
+            virtual uint32_t calculate_intersections(Ray* rays, const uint32_t ray_mask, HitRecord* hits) const
+            {
+                uint32_t found = 0;
+                for(uint32_t mask = ray_mask; mask != 0; mask &= mask - 1)
+                {
+                    const uint32_t r = std::countr_zero(mask);
+                    if(calculate_intersection(rays[r], hits[r]))
+                        found |= 1u << r;
+                }
+
+                return found;
+            }
+
+            virtual uint32_t are_occluded(Ray* rays, const uint32_t ray_mask, const float* max_distances) const
+            {
+                uint32_t occluded = 0;
+                for(uint32_t mask = ray_mask; mask != 0; mask &= mask - 1)
+                {
+                    const uint32_t r = std::countr_zero(mask);
+                    if(is_occluded(rays[r], max_distances[r]))
+                        occluded |= 1u << r;
+                }
+
+                return occluded;
+            }
 
             virtual AABB get_bounds() const = 0;
 
             // Light sampling methods.
             virtual void generate_sampling_data() = 0;
 
-            virtual bool sample_geometry(Core::Rand::Hammersley_Generator&, glm::vec3& sample_point, float& pdf) = 0;
+            virtual bool sample_geometry(Core::Rand::Sample_Stream&, glm::vec3& sample_point, float& pdf) = 0;
         };
 
     }
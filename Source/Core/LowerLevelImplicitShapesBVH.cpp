@@ -20,45 +20,67 @@ namespace Core
         }
 
 
-        bool LowerLevelSphereBVH::calculate_intersection(Ray& ray, InterpolatedVertex* result) const
+        bool LowerLevelSphereBVH::intersection_distance(const Ray& ray, float& t) const
         {
             // sphere center is always at (0, 0).
+            // Object space rays aren't normalised when the instance is scaled, so solve the full quadratic.
             const glm::vec3 m = ray.mOrigin;
 
+            const float a = glm::dot(ray.mDirection, ray.mDirection);
             const float b = glm::dot(m, ray.mDirection);
             const float c = glm::dot(m, m) - mRadius * mRadius;
 
             if(c > 0.0f && b > 0.0f)
                 return false;
-            const float discr = b * b - c;
+            const float discr = b * b - a * c;
 
             if(discr < 0.0f)
                 return false;
 
-            float t = -b - sqrt(discr);
-
             // ray is inside sphere
-            if(t < 0.0f)
-                t = 0.0f;
+            t = std::max((-b - std::sqrt(discr)) / a, 0.0f);
+
+            return true;
+        }
+
+        bool LowerLevelSphereBVH::calculate_intersection(Ray& ray, HitRecord& hit) const
+        {
+            float t;
+            if(!intersection_distance(ray, t) || t >= hit.m_distance)
+                return false;
 
-            //PICO_ASSERT(t > 0.0f);
-            result->mPosition = ray.mOrigin + t * glm::vec4(ray.mDirection, 1.0f);
-            result->mPosition.w = 1.0f;
-            result->mVertexColour = glm::vec4(1.0f, 1.0f, 1.0f, 1.0f);
-            result->mNormal = glm::normalize(glm::vec3(result->mPosition));
-            result->mUV = glm::vec2(atan2(result->mNormal.x, result->mNormal.z) / (2.0f * M_PI) + 0.5f, result->mNormal.y * 0.5f + 0.5f);
+            hit.m_distance = t;
+            hit.m_primitive = 0;
+            hit.m_barycentrics = glm::vec2(0.0f, 0.0f);
 
             return true;
         }
 
+        InterpolatedVertex LowerLevelSphereBVH::interpolate_hit(const Ray& ray, const HitRecord& hit) const
+        {
+            InterpolatedVertex result{};
+            result.mPosition = glm::vec4(glm::vec3(ray.mOrigin) + hit.m_distance * ray.mDirection, 1.0f);
+            result.mVertexColour = glm::vec4(1.0f, 1.0f, 1.0f, 1.0f);
+            result.mNormal = glm::normalize(glm::vec3(result.mPosition));
+            result.mUV = glm::vec2(atan2(result.mNormal.x, result.mNormal.z) / (2.0f * M_PI) + 0.5f, result.mNormal.y * 0.5f + 0.5f);
+
+            return result;
+        }
+
+        bool LowerLevelSphereBVH::is_occluded(Ray& ray, const float max_distance) const
+        {
+            float t;
+            return intersection_distance(ray, t) && t < max_distance;
+        }
+
         AABB LowerLevelSphereBVH::get_bounds() const
         {
             return AABB{{-mRadius, -mRadius, -mRadius, 1.0f}, {mRadius, mRadius, mRadius, 1.0f}};
         }
 
-        bool LowerLevelSphereBVH::sample_geometry(Core::Rand::Hammersley_Generator& rand, glm::vec3& sample_point, float& pdf)
+        bool LowerLevelSphereBVH::sample_geometry(Core::Rand::Sample_Stream& rand, glm::vec3& sample_point, float& pdf)
         {
-            const glm::vec3 unit_sphere_point = Core::Rand::uniform_sample_sphere(rand.next());
+            const glm::vec3 unit_sphere_point = Core::Rand::uniform_sample_sphere(rand.next_2D());
             const glm::vec3 sphere_point = mRadius * unit_sphere_point;
 
             sample_point = sphere_point;
@@ -71,30 +93,44 @@ namespace Core
             m_box(glm::vec4(-0.5f, -0.5f, -0.5f, 1.0f), glm::vec4(0.5f, 0.5f, 0.5f, 1.0f))
         {}
 
-        bool LowerLevelCube::calculate_intersection(Ray& ray, InterpolatedVertex* result) const
+        bool LowerLevelCube::calculate_intersection(Ray& ray, HitRecord& hit) const
         {
             const float t = m_box.intersection_distance(ray);
             
-            if(t == INFINITY)
+            if(t == INFINITY || t >= hit.m_distance)
                 return false;
 
-            result->mPosition = ray.mOrigin + glm::vec4((ray.mDirection * t), 1.0f);
-            result->mPosition.w = 1.0f;
-            result->mUV = glm::vec2(0.0f, 0.0f); // Don't support textured implicit cubes.
-            const uint32_t max_index =  Core::maximum_component_index(result->mPosition);
-            glm:: vec3 normal = glm::vec3(0.0f, 0.0f, 0.0f);
-            normal[max_index] = 1.0f * glm::sign(result->mPosition[max_index]);
-            result->mNormal = normal;
-            result->mVertexColour = glm::vec4(1.0f, 1.0f, 1.0f, 1.0f);
+            hit.m_distance = t;
+            hit.m_primitive = 0;
+            hit.m_barycentrics = glm::vec2(0.0f, 0.0f);
 
             return true;
         }
 
-        bool LowerLevelCube::sample_geometry(Core::Rand::Hammersley_Generator& rand, glm::vec3& sample_point, float& pdf)
+        InterpolatedVertex LowerLevelCube::interpolate_hit(const Ray& ray, const HitRecord& hit) const
+        {
+            InterpolatedVertex result{};
+            result.mPosition = glm::vec4(glm::vec3(ray.mOrigin) + ray.mDirection * hit.m_distance, 1.0f);
+            result.mUV = glm::vec2(0.0f, 0.0f); // Don't support textured implicit cubes.
+            const uint32_t max_index =  Core::maximum_component_index(result.mPosition);
+            glm:: vec3 normal = glm::vec3(0.0f, 0.0f, 0.0f);
+            normal[max_index] = 1.0f * glm::sign(result.mPosition[max_index]);
+            result.mNormal = normal;
+            result.mVertexColour = glm::vec4(1.0f, 1.0f, 1.0f, 1.0f);
+
+            return result;
+        }
+
+        bool LowerLevelCube::is_occluded(Ray& ray, const float max_distance) const
+        {
+            return m_box.intersection_distance(ray) < max_distance;
+        }
+
+        bool LowerLevelCube::sample_geometry(Core::Rand::Sample_Stream& rand, glm::vec3& sample_point, float& pdf)
         {
-            const glm::vec2 Xi = rand.next();
-            const glm::vec2 Xj = rand.next();
-            const glm::vec2 Xk = rand.next();
+            const glm::vec2 Xi = rand.next_2D();
+            const glm::vec2 Xj = rand.next_2D();
+            const glm::vec2 Xk = rand.next_2D();
 
             const glm::vec3 corner = glm::sign(glm::vec3(Xi.x, Xi.y, Xj.x) - 0.5f);
 
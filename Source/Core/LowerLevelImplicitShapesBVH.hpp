@@ -16,16 +16,22 @@ namespace Core
             LowerLevelSphereBVH(const float radius);
 
 
-            virtual bool calculate_intersection(Ray&, InterpolatedVertex* result) const final;
+            virtual bool calculate_intersection(Ray&, HitRecord& hit) const final;
+
+            virtual InterpolatedVertex interpolate_hit(const Ray&, const HitRecord& hit) const final;
+
+            virtual bool is_occluded(Ray&, const float max_distance) const final;
 
             virtual AABB get_bounds() const final;
 
             virtual void generate_sampling_data() final {}
 
-            virtual bool sample_geometry(Core::Rand::Hammersley_Generator&, glm::vec3&, float&) final;
+            virtual bool sample_geometry(Core::Rand::Sample_Stream&, glm::vec3&, float&) final;
 
         private:
 
+            bool intersection_distance(const Ray&, float& t) const;
+
             float mRadius;
         };
 
@@ -35,13 +41,17 @@ namespace Core
 
             LowerLevelCube();      
 
-            virtual bool calculate_intersection(Ray&, InterpolatedVertex* result) const final;
+            virtual bool calculate_intersection(Ray&, HitRecord& hit) const final;
+
+            virtual InterpolatedVertex interpolate_hit(const Ray&, const HitRecord& hit) const final;
+
+            virtual bool is_occluded(Ray&, const float max_distance) const final;
 
             virtual AABB get_bounds() const final { return m_box; }
 
             virtual void generate_sampling_data() final {}
 
-            virtual bool sample_geometry(Core::Rand::Hammersley_Generator&, glm::vec3&, float&) final;
+            virtual bool sample_geometry(Core::Rand::Sample_Stream&, glm::vec3&, float&) final;
 
 
         private:
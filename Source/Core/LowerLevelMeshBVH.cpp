@@ -1,6 +1,314 @@
 #include "LowerLevelMeshBVH.hpp"
 #include "Render/SolidAngle.hpp"
 #include "Core/Asserts.hpp"
+#include "Core/ThreadPool.hpp"
+
+#include "glm/packing.hpp"
+
+#include <bit>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <numeric>
+#include <random>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define PICO_MESH_USE_SSE
+#include <immintrin.h>
+#endif
+
+namespace
+{
+    constexpr float kTriangleEpsilon = 0.0000001f;
+
+    // Moller-Trumbore against the W triangles in columns [first, first + W) of the precomputed rows, returns a mask
+    // of the triangles hit closer than max_distance and writes their distances and barycentrics.
+    template<uint32_t W>
+    uint32_t intersect_triangles(const float* rows, const size_t stride, const size_t first, const Core::Ray& ray, const float max_distance,
+                                 float* distances, float* us, float* vs)
+    {
+        const float* v0_x = rows + first;
+        const float* v0_y = v0_x + stride;
+        const float* v0_z = v0_y + stride;
+        const float* e1_x = v0_z + stride;
+        const float* e1_y = e1_x + stride;
+        const float* e1_z = e1_y + stride;
+        const float* e2_x = e1_z + stride;
+        const float* e2_y = e2_x + stride;
+        const float* e2_z = e2_y + stride;
+
+#if defined(__AVX__)
+        if constexpr (W == 8)
+        {
+            const __m256 d_x = _mm256_set1_ps(ray.mDirection.x);
+            const __m256 d_y = _mm256_set1_ps(ray.mDirection.y);
+            const __m256 d_z = _mm256_set1_ps(ray.mDirection.z);
+
+            const __m256 edge1_x = _mm256_loadu_ps(e1_x);
+            const __m256 edge1_y = _mm256_loadu_ps(e1_y);
+            const __m256 edge1_z = _mm256_loadu_ps(e1_z);
+            const __m256 edge2_x = _mm256_loadu_ps(e2_x);
+            const __m256 edge2_y = _mm256_loadu_ps(e2_y);
+            const __m256 edge2_z = _mm256_loadu_ps(e2_z);
+
+            const __m256 h_x = _mm256_sub_ps(_mm256_mul_ps(d_y, edge2_z), _mm256_mul_ps(d_z, edge2_y));
+            const __m256 h_y = _mm256_sub_ps(_mm256_mul_ps(d_z, edge2_x), _mm256_mul_ps(d_x, edge2_z));
+            const __m256 h_z = _mm256_sub_ps(_mm256_mul_ps(d_x, edge2_y), _mm256_mul_ps(d_y, edge2_x));
+            const __m256 a = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(edge1_x, h_x), _mm256_mul_ps(edge1_y, h_y)), _mm256_mul_ps(edge1_z, h_z));
+            const __m256 f = _mm256_div_ps(_mm256_set1_ps(1.0f), a);
+
+            const __m256 s_x = _mm256_sub_ps(_mm256_set1_ps(ray.mOrigin.x), _mm256_loadu_ps(v0_x));
+            const __m256 s_y = _mm256_sub_ps(_mm256_set1_ps(ray.mOrigin.y), _mm256_loadu_ps(v0_y));
+            const __m256 s_z = _mm256_sub_ps(_mm256_set1_ps(ray.mOrigin.z), _mm256_loadu_ps(v0_z));
+            const __m256 u = _mm256_mul_ps(f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(s_x, h_x), _mm256_mul_ps(s_y, h_y)), _mm256_mul_ps(s_z, h_z)));
+
+            const __m256 q_x = _mm256_sub_ps(_mm256_mul_ps(s_y, edge1_z), _mm256_mul_ps(s_z, edge1_y));
+            const __m256 q_y = _mm256_sub_ps(_mm256_mul_ps(s_z, edge1_x), _mm256_mul_ps(s_x, edge1_z));
+            const __m256 q_z = _mm256_sub_ps(_mm256_mul_ps(s_x, edge1_y), _mm256_mul_ps(s_y, edge1_x));
+            const __m256 v = _mm256_mul_ps(f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(d_x, q_x), _mm256_mul_ps(d_y, q_y)), _mm256_mul_ps(d_z, q_z)));
+            const __m256 t = _mm256_mul_ps(f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(edge2_x, q_x), _mm256_mul_ps(edge2_y, q_y)), _mm256_mul_ps(edge2_z, q_z)));
+
+            const __m256 zero = _mm256_setzero_ps();
+            const __m256 epsilon = _mm256_set1_ps(kTriangleEpsilon);
+            const __m256 abs_a = _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a);
+            __m256 hit = _mm256_cmp_ps(abs_a, epsilon, _CMP_GE_OQ);
+            hit = _mm256_and_ps(hit, _mm256_cmp_ps(u, zero, _CMP_GE_OQ));
+            hit = _mm256_and_ps(hit, _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+            hit = _mm256_and_ps(hit, _mm256_cmp_ps(_mm256_add_ps(u, v), _mm256_set1_ps(1.0f), _CMP_LE_OQ));
+            hit = _mm256_and_ps(hit, _mm256_cmp_ps(t, epsilon, _CMP_GT_OQ));
+            hit = _mm256_and_ps(hit, _mm256_cmp_ps(t, _mm256_set1_ps(max_distance), _CMP_LT_OQ));
+
+            _mm256_storeu_ps(distances, t);
+            _mm256_storeu_ps(us, u);
+            _mm256_storeu_ps(vs, v);
+            return _mm256_movemask_ps(hit);
+        }
+        else
+#endif
+        {
+#ifdef PICO_MESH_USE_SSE
+            const __m128 d_x = _mm_set1_ps(ray.mDirection.x);
+            const __m128 d_y = _mm_set1_ps(ray.mDirection.y);
+            const __m128 d_z = _mm_set1_ps(ray.mDirection.z);
+            const __m128 o_x = _mm_set1_ps(ray.mOrigin.x);
+            const __m128 o_y = _mm_set1_ps(ray.mOrigin.y);
+            const __m128 o_z = _mm_set1_ps(ray.mOrigin.z);
+            const __m128 zero = _mm_setzero_ps();
+            const __m128 one = _mm_set1_ps(1.0f);
+            const __m128 epsilon = _mm_set1_ps(kTriangleEpsilon);
+            const __m128 closest = _mm_set1_ps(max_distance);
+
+            uint32_t mask = 0;
+            for(uint32_t lane = 0; lane < W; lane += 4)
+            {
+                const __m128 edge1_x = _mm_loadu_ps(e1_x + lane);
+                const __m128 edge1_y = _mm_loadu_ps(e1_y + lane);
+                const __m128 edge1_z = _mm_loadu_ps(e1_z + lane);
+                const __m128 edge2_x = _mm_loadu_ps(e2_x + lane);
+                const __m128 edge2_y = _mm_loadu_ps(e2_y + lane);
+                const __m128 edge2_z = _mm_loadu_ps(e2_z + lane);
+
+                const __m128 h_x = _mm_sub_ps(_mm_mul_ps(d_y, edge2_z), _mm_mul_ps(d_z, edge2_y));
+                const __m128 h_y = _mm_sub_ps(_mm_mul_ps(d_z, edge2_x), _mm_mul_ps(d_x, edge2_z));
+                const __m128 h_z = _mm_sub_ps(_mm_mul_ps(d_x, edge2_y), _mm_mul_ps(d_y, edge2_x));
+                const __m128 a = _mm_add_ps(_mm_add_ps(_mm_mul_ps(edge1_x, h_x), _mm_mul_ps(edge1_y, h_y)), _mm_mul_ps(edge1_z, h_z));
+                const __m128 f = _mm_div_ps(one, a);
+
+                const __m128 s_x = _mm_sub_ps(o_x, _mm_loadu_ps(v0_x + lane));
+                const __m128 s_y = _mm_sub_ps(o_y, _mm_loadu_ps(v0_y + lane));
+                const __m128 s_z = _mm_sub_ps(o_z, _mm_loadu_ps(v0_z + lane));
+                const __m128 u = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(s_x, h_x), _mm_mul_ps(s_y, h_y)), _mm_mul_ps(s_z, h_z)));
+
+                const __m128 q_x = _mm_sub_ps(_mm_mul_ps(s_y, edge1_z), _mm_mul_ps(s_z, edge1_y));
+                const __m128 q_y = _mm_sub_ps(_mm_mul_ps(s_z, edge1_x), _mm_mul_ps(s_x, edge1_z));
+                const __m128 q_z = _mm_sub_ps(_mm_mul_ps(s_x, edge1_y), _mm_mul_ps(s_y, edge1_x));
+                const __m128 v = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(d_x, q_x), _mm_mul_ps(d_y, q_y)), _mm_mul_ps(d_z, q_z)));
+                const __m128 t = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(edge2_x, q_x), _mm_mul_ps(edge2_y, q_y)), _mm_mul_ps(edge2_z, q_z)));
+
+                const __m128 abs_a = _mm_andnot_ps(_mm_set1_ps(-0.0f), a);
+                __m128 hit = _mm_cmpge_ps(abs_a, epsilon);
+                hit = _mm_and_ps(hit, _mm_cmpge_ps(u, zero));
+                hit = _mm_and_ps(hit, _mm_cmpge_ps(v, zero));
+                hit = _mm_and_ps(hit, _mm_cmple_ps(_mm_add_ps(u, v), one));
+                hit = _mm_and_ps(hit, _mm_cmpgt_ps(t, epsilon));
+                hit = _mm_and_ps(hit, _mm_cmplt_ps(t, closest));
+
+                _mm_storeu_ps(distances + lane, t);
+                _mm_storeu_ps(us + lane, u);
+                _mm_storeu_ps(vs + lane, v);
+                mask |= static_cast<uint32_t>(_mm_movemask_ps(hit)) << lane;
+            }
+
+            return mask;
+#else
+            uint32_t mask = 0;
+            for(uint32_t lane = 0; lane < W; ++lane)
+            {
+                const glm::vec3 edge1(e1_x[lane], e1_y[lane], e1_z[lane]);
+                const glm::vec3 edge2(e2_x[lane], e2_y[lane], e2_z[lane]);
+
+                const glm::vec3 h = glm::cross(ray.mDirection, edge2);
+                const float a = glm::dot(edge1, h);
+                const float f = 1.0f / a;
+
+                const glm::vec3 s = glm::vec3(ray.mOrigin) - glm::vec3(v0_x[lane], v0_y[lane], v0_z[lane]);
+                const glm::vec3 q = glm::cross(s, edge1);
+
+                us[lane] = f * glm::dot(s, h);
+                vs[lane] = f * glm::dot(ray.mDirection, q);
+                distances[lane] = f * glm::dot(edge2, q);
+
+                if(std::abs(a) >= kTriangleEpsilon && us[lane] >= 0.0f && vs[lane] >= 0.0f && us[lane] + vs[lane] <= 1.0f &&
+                   distances[lane] > kTriangleEpsilon && distances[lane] < max_distance)
+                    mask |= 1u << lane;
+            }
+
+            return mask;
+#endif
+        }
+    }
+
+    // Bump whenever the layout of the cache or anything it stores changes.
+    constexpr uint32_t kMeshCacheVersion = 4;
+
+    // Octahedral normal encoding, the unit sphere is folded on to the square [-1, 1]^2.
+    uint32_t encode_normal(const glm::vec3& normal)
+    {
+        const glm::vec3 n = normal / (std::abs(normal.x) + std::abs(normal.y) + std::abs(normal.z));
+        glm::vec2 encoded(n.x, n.y);
+        if(n.z < 0.0f)
+        {
+            encoded = (1.0f - glm::abs(glm::vec2(n.y, n.x))) *
+                      glm::vec2(n.x >= 0.0f ? 1.0f : -1.0f, n.y >= 0.0f ? 1.0f : -1.0f);
+        }
+
+        return glm::packSnorm2x16(encoded);
+    }
+
+    glm::vec3 decode_normal(const uint32_t packed)
+    {
+        const glm::vec2 encoded = glm::unpackSnorm2x16(packed);
+        glm::vec3 n(encoded.x, encoded.y, 1.0f - std::abs(encoded.x) - std::abs(encoded.y));
+        const float fold = std::max(-n.z, 0.0f);
+        n.x += n.x >= 0.0f ? -fold : fold;
+        n.y += n.y >= 0.0f ? -fold : fold;
+
+        return glm::normalize(n);
+    }
+    constexpr uint32_t kMeshCacheMagic = 0x48564250; // "PBVH"
+
+    // Sections start on cache line boundaries so nodes can be used straight from the mapping.
+    constexpr size_t kMeshCacheAlignment = 64;
+
+    struct Mesh_Cache_Header
+    {
+        uint32_t m_magic;
+        uint32_t m_version;
+        uint64_t m_key;
+        uint64_t m_checksum;
+
+        uint64_t m_node_count;
+        uint64_t m_primitive_count;
+        uint64_t m_triangle_data_count;
+        uint64_t m_vertex_count;
+        uint64_t m_index_count;
+        uint32_t m_has_uvs;
+        uint32_t m_has_colours;
+    };
+
+    struct Mesh_Cache_Layout
+    {
+        size_t m_nodes;
+        size_t m_primitives;
+        size_t m_triangles;
+        size_t m_positions;
+        size_t m_uvs;
+        size_t m_normals;
+        size_t m_colours;
+        size_t m_indicies;
+        size_t m_vertex_order;
+        size_t m_size;
+    };
+
+    Mesh_Cache_Layout get_cache_layout(const Mesh_Cache_Header& header, const size_t node_size)
+    {
+        size_t offset = 0;
+        auto add_section = [&offset](const size_t size)
+        {
+            const size_t section = (offset + kMeshCacheAlignment - 1) & ~(kMeshCacheAlignment - 1);
+            offset = section + size;
+            return section;
+        };
+
+        Mesh_Cache_Layout layout{};
+        add_section(sizeof(Mesh_Cache_Header));
+        layout.m_nodes = add_section(header.m_node_count * node_size);
+        layout.m_primitives = add_section(header.m_primitive_count * sizeof(uint32_t));
+        layout.m_triangles = add_section(header.m_triangle_data_count * sizeof(float));
+        layout.m_positions = add_section(header.m_vertex_count * sizeof(glm::vec3));
+        layout.m_uvs = add_section(header.m_has_uvs ? header.m_vertex_count * sizeof(glm::vec2) : 0);
+        layout.m_normals = add_section(header.m_vertex_count * sizeof(glm::vec3));
+        layout.m_colours = add_section(header.m_has_colours ? header.m_vertex_count * sizeof(glm::vec4) : 0);
+        layout.m_indicies = add_section(header.m_index_count * sizeof(uint32_t));
+        layout.m_vertex_order = add_section(header.m_vertex_count * sizeof(uint32_t));
+        layout.m_size = offset;
+
+        return layout;
+    }
+
+    // Murmur3's 64 bit finalizer, every input bit affects every output bit.
+    uint64_t mix_bits(uint64_t hash)
+    {
+        hash ^= hash >> 33;
+        hash *= 0xff51afd7ed558ccdull;
+        hash ^= hash >> 33;
+        hash *= 0xc4ceb9fe1a85ec53ull;
+        hash ^= hash >> 33;
+
+        return hash;
+    }
+
+    // Builds two independent 64 bit hashes of the same data in one pass, the key names the cache file and the
+    // checksum is stored in its header, so a file is only used when both match the source mesh.
+    struct Cache_Hasher
+    {
+        uint64_t m_key = 0x9e3779b97f4a7c15ull;
+        uint64_t m_checksum = 0x27d4eb2f165667c5ull;
+
+        void add_word(const uint64_t word)
+        {
+            constexpr uint64_t kPrime1 = 0x9e3779b185ebca87ull;
+            constexpr uint64_t kPrime2 = 0xc2b2ae3d27d4eb4full;
+
+            m_key = mix_bits(m_key ^ word);
+            m_checksum = std::rotl(m_checksum + word * kPrime2, 31) * kPrime1; // xxHash64's round.
+        }
+
+        void add_bytes(const void* data, const size_t size)
+        {
+            const unsigned char* bytes = static_cast<const unsigned char*>(data);
+            size_t i = 0;
+            for(; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t))
+            {
+                uint64_t word;
+                memcpy(&word, bytes + i, sizeof(uint64_t));
+                add_word(word);
+            }
+
+            uint64_t tail = 0;
+            if(i < size)
+                memcpy(&tail, bytes + i, size - i);
+            add_word(tail);
+            add_word(size);
+        }
+
+        template<typename T>
+        void add_value(const T& value)
+        {
+            add_bytes(&value, sizeof(T));
+        }
+    };
+}
 
 namespace Core
 {
@@ -8,96 +316,642 @@ namespace Core
     namespace Acceleration_Structures
     {
 
-        LowerLevelMeshBVH::LowerLevelMeshBVH(const aiMesh* mesh) :
-            LowerLevelBVH()
+        LowerLevelMeshBVH::LowerLevelMeshBVH(const aiMesh* mesh, ThreadPool* thread_pool, const MeshBVHSettings& settings) :
+            LowerLevelBVH(),
+            m_settings{settings},
+            m_built_sah_cost{0.0f}
         {
             m_name = mesh->mName.C_Str();
 
+            aiAABB aabb = mesh->mAABB;
+            mAABB = AABB({aabb.mMin.x, aabb.mMin.y, aabb.mMin.z, 1.0f}, {aabb.mMax.x, aabb.mMax.y, aabb.mMax.z, 1.0f});
+
             // Copy the index data
-            mIndicies.reserve(mesh->mNumFaces * 3);
+            std::vector<uint32_t> indicies;
+            indicies.reserve(mesh->mNumFaces * 3);
             for(uint32_t i = 0; i < mesh->mNumFaces; ++i)
             {
                 for(uint32_t j = 0; j < mesh->mFaces[i].mNumIndices; ++j)
                 {
-                    mIndicies.push_back(mesh->mFaces[i].mIndices[j]);
+                    indicies.push_back(mesh->mFaces[i].mIndices[j]);
                 }
             }
+            mIndicies = std::move(indicies);
 
             static_assert (sizeof(glm::vec3) == sizeof(aiVector3t<float>), "position size mismatch");
-            mPositions.resize(mesh->mNumVertices);
-            memcpy(mPositions.data(), mesh->mVertices, sizeof(glm::vec3) * mesh->mNumVertices);
+            std::vector<glm::vec3> positions(mesh->mNumVertices);
+            memcpy(positions.data(), mesh->mVertices, sizeof(glm::vec3) * mesh->mNumVertices);
+            mPositions = std::move(positions);
+
+            std::vector<uint32_t> vertex_order(mesh->mNumVertices);
+            std::iota(vertex_order.begin(), vertex_order.end(), 0u);
+            m_vertex_order = std::move(vertex_order);
 
             if(mesh->mTextureCoords[0])
             {
-                mUVs.resize(mesh->mNumVertices);
+                std::vector<glm::vec2> uvs(mesh->mNumVertices);
                 for(uint32_t i = 0; i < mesh->mNumVertices; ++i)
-                    mUVs[i] = glm::vec2(mesh->mTextureCoords[0][i].x, mesh->mTextureCoords[0][i].y);
+                    uvs[i] = glm::vec2(mesh->mTextureCoords[0][i].x, mesh->mTextureCoords[0][i].y);
+                mUVs = std::move(uvs);
             }
 
             static_assert (sizeof(glm::vec3) == sizeof(aiVector3t<float>), "normals size mismatch");
-            mNormals.resize(mesh->mNumVertices);
-            memcpy(mNormals.data(), mesh->mNormals, sizeof(glm::vec3) * mesh->mNumVertices);
+            std::vector<glm::vec3> normals(mesh->mNumVertices);
+            memcpy(normals.data(), mesh->mNormals, sizeof(glm::vec3) * mesh->mNumVertices);
+            mNormals = std::move(normals);
 
             static_assert (sizeof(glm::vec4) == sizeof(aiColor4D), "colour size mismatch");
             if (mesh->mColors[0])
             {
-                mVertexColours.resize(mesh->mNumVertices);
-                memcpy(mVertexColours.data(), mesh->mColors[0], sizeof(glm::vec4) * mesh->mNumVertices);
+                std::vector<glm::vec4> colours(mesh->mNumVertices);
+                memcpy(colours.data(), mesh->mColors[0], sizeof(glm::vec4) * mesh->mNumVertices);
+                mVertexColours = std::move(colours);
             }
 
-            std::vector<LOWER_ACCELERATION_STRUCTURE::BoundedValue> primitive_bounds;
-            primitive_bounds.reserve(mIndicies.size());
-            for(uint32_t i = 0; i < mIndicies.size(); i += 3)
+#ifdef USE_OCTTREE
+            build_BVH(thread_pool, settings);
+            m_settings.m_out_of_core = false;
+#else
+            if(settings.m_cache_directory.empty())
             {
-                glm::vec3 min = glm::vec3(INFINITY, INFINITY, INFINITY);
-                glm::vec3 max = glm::vec3(-INFINITY, -INFINITY, -INFINITY);
-
-                min = Core::component_wise_min(min, mPositions[mIndicies[i]]);
-                min = Core::component_wise_min(min, mPositions[mIndicies[i + 1]]);
-                min = Core::component_wise_min(min, mPositions[mIndicies[i + 2]]);
+                m_settings.m_out_of_core = false;
+                build_BVH(thread_pool, settings);
+                reorder_for_traversal();
+                precompute_triangles(thread_pool);
+            }
+            else
+            {
+                // The cache holds the uncompressed attributes, so it can be shared between both settings.
+                const Cache_Key cache_key = get_cache_key(settings);
+                char cache_name[32];
+                snprintf(cache_name, sizeof(cache_name), "%016llx.bvh", static_cast<unsigned long long>(cache_key.m_key));
+                const std::filesystem::path cache_path = settings.m_cache_directory / cache_name;
 
-                max = Core::component_wise_max(max, mPositions[mIndicies[i]]);
-                max = Core::component_wise_max(max, mPositions[mIndicies[i + 1]]);
-                max = Core::component_wise_max(max, mPositions[mIndicies[i + 2]]);
+                if(load_from_cache(cache_path, cache_key))
+                {
+                    m_built_sah_cost = m_acceleration_structure->get_sah_cost();
+                    PICO_LOG("Loaded BVH for %s from %s\n", m_name.c_str(), cache_path.string().c_str());
+                }
+                else
+                {
+                    build_BVH(thread_pool, settings);
+                    reorder_for_traversal();
+                    precompute_triangles(thread_pool);
+                    write_to_cache(cache_path, cache_key);
 
-                primitive_bounds.push_back({AABB{glm::vec4(min, 1.0f), glm::vec4(max, 1.0f)}, i / 3});
+                    // Swap the built arrays for views of what was just written so they can be paged out.
+                    LOWER_ACCELERATION_STRUCTURE* built_structure = m_acceleration_structure;
+                    if(m_settings.m_out_of_core && load_from_cache(cache_path, cache_key))
+                    {
+                        delete built_structure;
+                    }
+                    else
+                    {
+                        m_acceleration_structure = built_structure;
+                        m_settings.m_out_of_core = false;
+                    }
+                }
             }
+#endif
 
-            aiAABB aabb = mesh->mAABB;
-            mAABB = AABB({aabb.mMin.x, aabb.mMin.y, aabb.mMin.z, 1.0f}, {aabb.mMax.x, aabb.mMax.y, aabb.mMax.z, 1.0f});
+            if(m_settings.m_out_of_core)
+                PICO_LOG("Paging BVH for %s from its cache file\n", m_name.c_str());
+            else if(settings.m_compressed_attributes)
+                compress_attributes();
+        }
+
+        void LowerLevelMeshBVH::build_BVH(ThreadPool* thread_pool, const MeshBVHSettings& settings)
+        {
+            std::vector<BVHFactory<uint32_t>::BuilderNode> primitive_bounds;
+            primitive_bounds.reserve(mIndicies.size());
+            for(uint32_t i = 0; i < mIndicies.size(); i += 3)
+            {
+                primitive_bounds.push_back({get_triangle_bounds(i / 3), i / 3});
+            }
 
 #ifdef USE_OCTTREE
             m_acceleration_structure = OctTreeFactory<uint32_t>(mAABB, primitive_bounds)
-                                           .set_intersector(std::make_unique<Mesh_Intersector>(mPositions.data(), mUVs.data(), mNormals.data(), mVertexColours.data(), mIndicies.data()))
+                                           .set_intersector(std::make_unique<Mesh_Intersector>(*this))
                                            .generate_octTree();
 #else
+            std::unique_ptr<BVHPartitionScheme<uint32_t>> partition_scheme;
+            if(settings.m_build_mode == BVHBuildMode::kSAH && settings.m_spatial_splits)
+                partition_scheme = std::make_unique<Spatial_Split_parition_Scheme<uint32_t>>(
+                            [this](const uint32_t primID, const uint32_t axis, const float min, const float max) { return clip_triangle(primID, axis, min, max); },
+                            settings.m_duplication_budget);
+            else if(settings.m_build_mode == BVHBuildMode::kSAH)
+                partition_scheme = std::make_unique<SAH_parition_Scheme<uint32_t>>();
+            else
+                partition_scheme = std::make_unique<Morton_parition_Scheme<uint32_t>>();
+
             m_acceleration_structure = BVHFactory<uint32_t>(mAABB, primitive_bounds)
-                                           .set_intersector(std::make_unique<Mesh_Intersector>(mPositions.data(), mUVs.data(), mNormals.data(), mVertexColours.data(), mIndicies.data()))
-                                           .set_parition_scheme(std::make_unique<SAH_parition_Scheme<uint32_t>>())
+                                           .set_intersector(std::make_unique<Mesh_Intersector>(*this))
+                                           .set_parition_scheme(std::move(partition_scheme))
+                                           .set_node_layout(get_node_layout())
+                                           .set_leaf_size(kTriangleBlockSize)
+                                           .set_builder(settings.m_build_mode == BVHBuildMode::kPLOC ? BVHBuilder::kPLOC : BVHBuilder::kParallelBinned, thread_pool)
                                            .generate_BVH();
+            m_built_sah_cost = m_acceleration_structure->get_sah_cost();
+#endif
+        }
+
+        void LowerLevelMeshBVH::update_positions(const aiMesh* mesh, ThreadPool* thread_pool)
+        {
+            PICO_ASSERT(mesh->mNumVertices == mPositions.size() && mesh->mNumFaces * 3 == get_index_count());
+
+            // Cached meshes view the mapping until their first update.
+            mPositions.make_owned();
+            mNormals.make_owned();
+
+            // The cache file no longer matches an out of core mesh once it moves, so everything still viewing the
+            // mapping is copied and the mesh stays in memory from here on. GeometryManager drops it at its next update.
+            const bool leave_out_of_core = m_settings.m_out_of_core;
+            if(leave_out_of_core)
+            {
+                mIndicies.make_owned();
+                mUVs.make_owned();
+                mVertexColours.make_owned();
+                m_vertex_order.make_owned();
+                get_leaf_primitives().make_owned();
+            }
+
+            glm::vec3* positions = mPositions.mutable_data();
+            glm::vec3* normals = mNormals.mutable_data();
+            uint32_t* packed_normals = m_packed_normals.mutable_data();
+
+            const AABB empty_bounds(glm::vec4(INFINITY, INFINITY, INFINITY, 1.0f), glm::vec4(-INFINITY, -INFINITY, -INFINITY, 1.0f));
+            std::vector<AABB> chunk_bounds(get_chunk_count(thread_pool), empty_bounds);
+            for_each_chunk(thread_pool, mPositions.size(), [&](const size_t chunk, const size_t begin, const size_t end)
+            {
+                for(size_t v = begin; v < end; ++v)
+                {
+                    const uint32_t source = m_vertex_order[v];
+                    positions[v] = glm::vec3(mesh->mVertices[source].x, mesh->mVertices[source].y, mesh->mVertices[source].z);
+                    if(mesh->mNormals)
+                    {
+                        const glm::vec3 normal(mesh->mNormals[source].x, mesh->mNormals[source].y, mesh->mNormals[source].z);
+                        if(packed_normals)
+                            packed_normals[v] = encode_normal(normal);
+                        else
+                            normals[v] = normal;
+                    }
+
+                    chunk_bounds[chunk].add_point(glm::vec4(positions[v], 1.0f));
+                }
+            });
+
+            mAABB = empty_bounds;
+            for(const AABB& bounds : chunk_bounds)
+                mAABB.union_of(bounds);
+
+#ifndef USE_OCTTREE
+            // The flat layout can't be refit, so it's always rebuilt.
+            const bool refit = m_acceleration_structure->refit([this](const uint32_t& primID) { return get_triangle_bounds(primID); }, thread_pool);
+
+            const float sah_cost = m_acceleration_structure->get_sah_cost();
+            if(!refit || sah_cost > m_built_sah_cost * m_settings.m_rebuild_threshold)
+            {
+                if(refit)
+                    PICO_LOG("Rebuilding BVH for %s, refitting raised its SAH cost from %.2f to %.2f\n", m_name.c_str(), m_built_sah_cost, sah_cost);
+
+                // The build only reads full indices.
+                const bool short_indicies = !m_short_indicies.empty();
+                if(short_indicies)
+                    expand_indicies();
+
+                mIndicies.make_owned();
+                mUVs.make_owned();
+                mVertexColours.make_owned();
+                m_vertex_order.make_owned();
+                delete m_acceleration_structure;
+                build_BVH(thread_pool, m_settings);
+                reorder_for_traversal();
+
+                if(short_indicies)
+                    compress_indicies();
+            }
+
+            precompute_triangles(thread_pool);
 #endif
+
+            if(leave_out_of_core)
+            {
+                // Refitting or rebuilding has replaced the nodes, so nothing views the mapping any more.
+                m_cache_file.reset();
+                m_settings.m_out_of_core = false;
+                PICO_LOG("Moving BVH for %s in to memory, its cache file no longer matches the updated positions\n", m_name.c_str());
+            }
+
+            if(!m_triangle_area.empty())
+            {
+                m_triangle_area.clear();
+                generate_sampling_data();
+            }
+        }
+
+        Array_Storage<uint32_t>& LowerLevelMeshBVH::get_leaf_primitives()
+        {
+            if(m_settings.m_compressed_nodes)
+                return static_cast<Compressed_Mesh_BVH*>(m_acceleration_structure)->get_primitives();
+
+            if(m_settings.m_flat_nodes)
+                return static_cast<Flat_Mesh_BVH*>(m_acceleration_structure)->get_primitives();
+
+            return static_cast<Mesh_BVH*>(m_acceleration_structure)->get_primitives();
+        }
+
+        const Array_Storage<uint32_t>& LowerLevelMeshBVH::get_leaf_primitives() const
+        {
+            if(m_settings.m_compressed_nodes)
+                return static_cast<const Compressed_Mesh_BVH*>(m_acceleration_structure)->get_primitives();
+
+            if(m_settings.m_flat_nodes)
+                return static_cast<const Flat_Mesh_BVH*>(m_acceleration_structure)->get_primitives();
+
+            return static_cast<const Mesh_BVH*>(m_acceleration_structure)->get_primitives();
+        }
+
+        void LowerLevelMeshBVH::reorder_for_traversal()
+        {
+            Array_Storage<uint32_t>& primitives = get_leaf_primitives();
+            uint32_t* leaf_primitives = primitives.mutable_data();
+            const uint32_t triangle_count = mIndicies.size() / 3;
+
+            // Spatial splits can reference a triangle from several leaves, the first reference decides its slot.
+            std::vector<uint32_t> new_triangle(triangle_count, kInvalidNodeIndex);
+            std::vector<uint32_t> triangle_order;
+            triangle_order.reserve(triangle_count);
+            for(size_t i = 0; i < primitives.size(); ++i)
+            {
+                uint32_t& triangle = new_triangle[leaf_primitives[i]];
+                if(triangle == kInvalidNodeIndex)
+                {
+                    triangle = triangle_order.size();
+                    triangle_order.push_back(leaf_primitives[i]);
+                }
+
+                leaf_primitives[i] = triangle;
+            }
+            PICO_ASSERT(triangle_order.size() == triangle_count);
+
+            const std::vector<uint32_t> old_indicies(mIndicies.data(), mIndicies.data() + mIndicies.size());
+            std::vector<uint32_t> new_vertex(mPositions.size(), kInvalidNodeIndex);
+            std::vector<uint32_t> vertex_order;
+            vertex_order.reserve(mPositions.size());
+
+            uint32_t* indicies = mIndicies.mutable_data();
+            for(uint32_t t = 0; t < triangle_count; ++t)
+            {
+                for(uint32_t i = 0; i < 3; ++i)
+                {
+                    const uint32_t old_vertex = old_indicies[(triangle_order[t] * 3) + i];
+                    if(new_vertex[old_vertex] == kInvalidNodeIndex)
+                    {
+                        new_vertex[old_vertex] = vertex_order.size();
+                        vertex_order.push_back(old_vertex);
+                    }
+
+                    indicies[(t * 3) + i] = new_vertex[old_vertex];
+                }
+            }
+
+            // Keep any vertices that no triangle uses at the end.
+            for(uint32_t v = 0; v < new_vertex.size(); ++v)
+            {
+                if(new_vertex[v] == kInvalidNodeIndex)
+                    vertex_order.push_back(v);
+            }
+
+            // Keep track of where each vertex came from so later frames can be copied in.
+            std::vector<uint32_t> source_vertices(vertex_order.size());
+            for(size_t v = 0; v < vertex_order.size(); ++v)
+                source_vertices[v] = m_vertex_order[vertex_order[v]];
+            m_vertex_order = std::move(source_vertices);
+
+            auto reorder_vertices = [&vertex_order](auto& attribute)
+            {
+                if(attribute.empty())
+                    return;
+
+                const std::vector<std::remove_cvref_t<decltype(attribute[0])>> old_attribute(attribute.data(), attribute.data() + attribute.size());
+                auto* new_attribute = attribute.mutable_data();
+                for(size_t v = 0; v < vertex_order.size(); ++v)
+                    new_attribute[v] = old_attribute[vertex_order[v]];
+            };
+            reorder_vertices(mPositions);
+            reorder_vertices(mUVs);
+            reorder_vertices(mNormals);
+            reorder_vertices(mVertexColours);
+            reorder_vertices(m_packed_normals);
+            reorder_vertices(m_packed_uvs);
+            reorder_vertices(m_packed_colours);
+        }
+
+        void LowerLevelMeshBVH::precompute_triangles(ThreadPool* thread_pool)
+        {
+            const Array_Storage<uint32_t>& primitives = get_leaf_primitives();
+            const size_t stride = get_triangle_row_stride(primitives.size());
+
+            std::vector<float> triangle_data(stride * 9, 0.0f);
+            for_each_chunk(thread_pool, primitives.size(), [&](const size_t, const size_t begin, const size_t end)
+            {
+                for(size_t i = begin; i < end; ++i)
+                {
+                    const uint32_t index_start = primitives[i] * 3;
+                    const glm::vec3 vertex0 = mPositions[get_index(index_start)];
+                    const glm::vec3 edge1 = mPositions[get_index(index_start + 1)] - vertex0;
+                    const glm::vec3 edge2 = mPositions[get_index(index_start + 2)] - vertex0;
+
+                    for(uint32_t axis = 0; axis < 3; ++axis)
+                    {
+                        triangle_data[(axis * stride) + i] = vertex0[axis];
+                        triangle_data[((3 + axis) * stride) + i] = edge1[axis];
+                        triangle_data[((6 + axis) * stride) + i] = edge2[axis];
+                    }
+                }
+            });
+
+            m_triangle_data = std::move(triangle_data);
+        }
+
+        void LowerLevelMeshBVH::compress_attributes()
+        {
+            auto pack = [](const auto& attribute, auto&& encode)
+            {
+                std::vector<uint32_t> packed(attribute.size());
+                for(size_t v = 0; v < attribute.size(); ++v)
+                    packed[v] = encode(attribute[v]);
+
+                return Array_Storage<uint32_t>(std::move(packed));
+            };
+
+            m_packed_normals = pack(mNormals, [](const glm::vec3& normal) { return encode_normal(normal); });
+            m_packed_uvs = pack(mUVs, [](const glm::vec2& uv) { return glm::packHalf2x16(uv); });
+            m_packed_colours = pack(mVertexColours, [](const glm::vec4& colour) { return glm::packUnorm4x8(colour); });
+
+            mNormals = Array_Storage<glm::vec3>();
+            mUVs = Array_Storage<glm::vec2>();
+            mVertexColours = Array_Storage<glm::vec4>();
+
+            compress_indicies();
+        }
+
+        void LowerLevelMeshBVH::compress_indicies()
+        {
+            if(mPositions.size() > std::numeric_limits<uint16_t>::max() + 1u)
+                return;
+
+            std::vector<uint16_t> short_indicies(mIndicies.data(), mIndicies.data() + mIndicies.size());
+            m_short_indicies = std::move(short_indicies);
+            mIndicies = Array_Storage<uint32_t>();
+        }
+
+        void LowerLevelMeshBVH::expand_indicies()
+        {
+            std::vector<uint32_t> indicies(m_short_indicies.data(), m_short_indicies.data() + m_short_indicies.size());
+            mIndicies = std::move(indicies);
+            m_short_indicies = Array_Storage<uint16_t>();
+        }
+
+        LowerLevelMeshBVH::Cache_Key LowerLevelMeshBVH::get_cache_key(const MeshBVHSettings& settings) const
+        {
+            // Keyed on the source data before it's reordered.
+            Cache_Hasher hasher;
+            hasher.add_value(kMeshCacheVersion);
+            hasher.add_value(kDefaultWideNodeWidth);
+            hasher.add_value(get_node_layout());
+            hasher.add_value(get_node_size());
+            hasher.add_value(settings.m_build_mode);
+            hasher.add_value(settings.m_spatial_splits);
+            hasher.add_value(settings.m_spatial_splits ? settings.m_duplication_budget : 0.0f);
+
+            hasher.add_bytes(mPositions.data(), mPositions.size() * sizeof(glm::vec3));
+            hasher.add_bytes(mUVs.data(), mUVs.size() * sizeof(glm::vec2));
+            hasher.add_bytes(mNormals.data(), mNormals.size() * sizeof(glm::vec3));
+            hasher.add_bytes(mVertexColours.data(), mVertexColours.size() * sizeof(glm::vec4));
+            hasher.add_bytes(mIndicies.data(), mIndicies.size() * sizeof(uint32_t));
+
+            return {hasher.m_key, hasher.m_checksum};
+        }
+
+        bool LowerLevelMeshBVH::load_from_cache(const std::filesystem::path& path, const Cache_Key& key)
+        {
+            auto cache_file = std::make_unique<Mapped_File>(path);
+            if(!cache_file->is_valid() || cache_file->get_size() < sizeof(Mesh_Cache_Header))
+                return false;
+
+            Mesh_Cache_Header header;
+            memcpy(&header, cache_file->get_data(), sizeof(Mesh_Cache_Header));
+
+            if(header.m_magic != kMeshCacheMagic || header.m_version != kMeshCacheVersion || header.m_key != key.m_key || header.m_checksum != key.m_checksum ||
+               header.m_vertex_count != mPositions.size() || header.m_index_count != mIndicies.size() ||
+               header.m_has_uvs != !mUVs.empty() || header.m_has_colours != !mVertexColours.empty())
+            {
+                PICO_LOG("Ignoring stale BVH cache %s\n", path.string().c_str());
+                return false;
+            }
+
+            const Mesh_Cache_Layout layout = get_cache_layout(header, get_node_size());
+            if(cache_file->get_size() < layout.m_size || header.m_triangle_data_count != get_triangle_row_stride(header.m_primitive_count) * 9)
+            {
+                PICO_LOG("Ignoring truncated BVH cache %s\n", path.string().c_str());
+                return false;
+            }
+
+            const unsigned char* data = cache_file->get_data();
+            auto section = [data](const size_t offset) { return data + offset; };
+
+            mPositions = Array_Storage<glm::vec3>(reinterpret_cast<const glm::vec3*>(section(layout.m_positions)), header.m_vertex_count);
+            mNormals = Array_Storage<glm::vec3>(reinterpret_cast<const glm::vec3*>(section(layout.m_normals)), header.m_vertex_count);
+            mIndicies = Array_Storage<uint32_t>(reinterpret_cast<const uint32_t*>(section(layout.m_indicies)), header.m_index_count);
+            m_vertex_order = Array_Storage<uint32_t>(reinterpret_cast<const uint32_t*>(section(layout.m_vertex_order)), header.m_vertex_count);
+            if(header.m_has_uvs)
+                mUVs = Array_Storage<glm::vec2>(reinterpret_cast<const glm::vec2*>(section(layout.m_uvs)), header.m_vertex_count);
+            if(header.m_has_colours)
+                mVertexColours = Array_Storage<glm::vec4>(reinterpret_cast<const glm::vec4*>(section(layout.m_colours)), header.m_vertex_count);
+            m_triangle_data = Array_Storage<float>(reinterpret_cast<const float*>(section(layout.m_triangles)), header.m_triangle_data_count);
+
+            Array_Storage<uint32_t> primitives(reinterpret_cast<const uint32_t*>(section(layout.m_primitives)), header.m_primitive_count);
+            auto intersector = std::make_unique<Mesh_Intersector>(*this);
+            if(m_settings.m_compressed_nodes)
+                m_acceleration_structure = new Compressed_Mesh_BVH(Array_Storage<Compressed_Mesh_BVH::Node>(reinterpret_cast<const Compressed_Mesh_BVH::Node*>(section(layout.m_nodes)), header.m_node_count),
+                                                                   std::move(primitives), std::move(intersector));
+            else if(m_settings.m_flat_nodes)
+                m_acceleration_structure = new Flat_Mesh_BVH(Array_Storage<Flat_Mesh_BVH::Node>(reinterpret_cast<const Flat_Mesh_BVH::Node*>(section(layout.m_nodes)), header.m_node_count),
+                                                             std::move(primitives), std::move(intersector));
+            else
+                m_acceleration_structure = new Mesh_BVH(Array_Storage<Mesh_BVH::Node>(reinterpret_cast<const Mesh_BVH::Node*>(section(layout.m_nodes)), header.m_node_count),
+                                                        std::move(primitives), std::move(intersector));
+            m_cache_file = std::move(cache_file);
+
+            return true;
+        }
+
+        void LowerLevelMeshBVH::write_to_cache(const std::filesystem::path& path, const Cache_Key& key) const
+        {
+            const void* nodes = nullptr;
+            size_t node_size = 0;
+            size_t node_count = 0;
+            if(m_settings.m_compressed_nodes)
+            {
+                const auto* bvh = static_cast<const Compressed_Mesh_BVH*>(m_acceleration_structure);
+                nodes = bvh->get_nodes().data();
+                node_size = sizeof(Compressed_Mesh_BVH::Node);
+                node_count = bvh->get_nodes().size();
+            }
+            else if(m_settings.m_flat_nodes)
+            {
+                const auto* bvh = static_cast<const Flat_Mesh_BVH*>(m_acceleration_structure);
+                nodes = bvh->get_nodes().data();
+                node_size = sizeof(Flat_Mesh_BVH::Node);
+                node_count = bvh->get_nodes().size();
+            }
+            else
+            {
+                const auto* bvh = static_cast<const Mesh_BVH*>(m_acceleration_structure);
+                nodes = bvh->get_nodes().data();
+                node_size = sizeof(Mesh_BVH::Node);
+                node_count = bvh->get_nodes().size();
+            }
+            const Array_Storage<uint32_t>& primitives = get_leaf_primitives();
+
+            Mesh_Cache_Header header{};
+            header.m_magic = kMeshCacheMagic;
+            header.m_version = kMeshCacheVersion;
+            header.m_key = key.m_key;
+            header.m_checksum = key.m_checksum;
+            header.m_node_count = node_count;
+            header.m_primitive_count = primitives.size();
+            header.m_triangle_data_count = m_triangle_data.size();
+            header.m_vertex_count = mPositions.size();
+            header.m_index_count = mIndicies.size();
+            header.m_has_uvs = !mUVs.empty();
+            header.m_has_colours = !mVertexColours.empty();
+
+            const Mesh_Cache_Layout layout = get_cache_layout(header, node_size);
+
+            std::vector<unsigned char> data(layout.m_size, 0);
+            auto write_section = [&data](const size_t offset, const void* section, const size_t size)
+            {
+                if(size > 0)
+                    memcpy(data.data() + offset, section, size);
+            };
+            write_section(0, &header, sizeof(Mesh_Cache_Header));
+            write_section(layout.m_nodes, nodes, header.m_node_count * node_size);
+            write_section(layout.m_primitives, primitives.data(), header.m_primitive_count * sizeof(uint32_t));
+            write_section(layout.m_triangles, m_triangle_data.data(), header.m_triangle_data_count * sizeof(float));
+            write_section(layout.m_positions, mPositions.data(), mPositions.size() * sizeof(glm::vec3));
+            write_section(layout.m_uvs, mUVs.data(), mUVs.size() * sizeof(glm::vec2));
+            write_section(layout.m_normals, mNormals.data(), mNormals.size() * sizeof(glm::vec3));
+            write_section(layout.m_colours, mVertexColours.data(), mVertexColours.size() * sizeof(glm::vec4));
+            write_section(layout.m_indicies, mIndicies.data(), mIndicies.size() * sizeof(uint32_t));
+            write_section(layout.m_vertex_order, m_vertex_order.data(), m_vertex_order.size() * sizeof(uint32_t));
+
+            std::error_code error;
+            std::filesystem::create_directories(path.parent_path(), error);
+
+            // Write to a temporary and rename it in to place so other processes never map a partial cache.
+            std::filesystem::path temp_path = path;
+            temp_path += "." + std::to_string(std::random_device{}()) + ".tmp";
+            {
+                std::ofstream file(temp_path, std::ios::binary | std::ios::trunc);
+                file.write(reinterpret_cast<const char*>(data.data()), data.size());
+                if(!file)
+                {
+                    PICO_LOG("Failed to write BVH cache %s\n", temp_path.string().c_str());
+                    file.close();
+                    std::filesystem::remove(temp_path, error);
+                    return;
+                }
+            }
+
+            std::filesystem::rename(temp_path, path, error);
+            if(error)
+            {
+                PICO_LOG("Failed to write BVH cache %s\n", path.string().c_str());
+                std::filesystem::remove(temp_path, error);
+            }
+        }
+
+        AABB LowerLevelMeshBVH::get_triangle_bounds(const uint32_t primID) const
+        {
+            const uint32_t index_start = primID * 3;
+            glm::vec3 min = glm::vec3(INFINITY, INFINITY, INFINITY);
+            glm::vec3 max = glm::vec3(-INFINITY, -INFINITY, -INFINITY);
+            for(uint32_t i = 0; i < 3; ++i)
+            {
+                min = Core::component_wise_min(min, mPositions[get_index(index_start + i)]);
+                max = Core::component_wise_max(max, mPositions[get_index(index_start + i)]);
+            }
+
+            return AABB{glm::vec4(min, 1.0f), glm::vec4(max, 1.0f)};
         }
 
-        bool LowerLevelMeshBVH::calculate_intersection(Ray& ray, InterpolatedVertex* result) const
+        AABB LowerLevelMeshBVH::clip_triangle(const uint32_t primID, const uint32_t axis, const float min, const float max) const
         {
-            InterpolatedVertex vertex{};
-            const bool intersects = m_acceleration_structure->get_first_intersection(ray, vertex);
+            AABB bounds(glm::vec4(INFINITY, INFINITY, INFINITY, 1.0f), glm::vec4(-INFINITY, -INFINITY, -INFINITY, 1.0f));
+
+            // Keep the vertices inside the slab plus wherever the edges cross its planes.
+            for(uint32_t i = 0; i < 3; ++i)
+            {
+                const glm::vec3& a = mPositions[mIndicies[(primID * 3) + i]];
+                const glm::vec3& b = mPositions[mIndicies[(primID * 3) + ((i + 1) % 3)]];
+
+                if(a[axis] >= min && a[axis] <= max)
+                    bounds.add_point(glm::vec4(a, 1.0f));
+
+                for(const float plane : {min, max})
+                {
+                    if((a[axis] < plane && b[axis] > plane) || (a[axis] > plane && b[axis] < plane))
+                    {
+                        glm::vec3 p = glm::mix(a, b, (plane - a[axis]) / (b[axis] - a[axis]));
+                        p[axis] = plane;
+                        bounds.add_point(glm::vec4(p, 1.0f));
+                    }
+                }
+            }
 
-            if(intersects)
-                *result = vertex;
+            return bounds;
+        }
 
-            return intersects;
+        bool LowerLevelMeshBVH::calculate_intersection(Ray& ray, HitRecord& hit) const
+        {
+            mark_used();
+            return m_acceleration_structure->get_first_intersection(ray, hit);
+        }
+
+        InterpolatedVertex LowerLevelMeshBVH::interpolate_hit(const Ray&, const HitRecord& hit) const
+        {
+            return interpolate_fragment(hit.m_primitive, hit.m_barycentrics.x, hit.m_barycentrics.y);
+        }
+
+        bool LowerLevelMeshBVH::is_occluded(Ray& ray, const float max_distance) const
+        {
+            mark_used();
+            return m_acceleration_structure->is_occluded(ray, max_distance);
+        }
+
+        uint32_t LowerLevelMeshBVH::calculate_intersections(Ray* rays, const uint32_t ray_mask, HitRecord* hits) const
+        {
+            mark_used();
+            return m_acceleration_structure->get_first_intersections(rays, ray_mask, hits);
+        }
+
+        uint32_t LowerLevelMeshBVH::are_occluded(Ray* rays, const uint32_t ray_mask, const float* max_distances) const
+        {
+            mark_used();
+            return m_acceleration_structure->are_occluded(rays, ray_mask, max_distances);
         }
 
         void LowerLevelMeshBVH::generate_sampling_data()
         {
-            m_triangle_area.reserve(mIndicies.size() / 3);
-            for(uint32_t i_index = 0; i_index < mIndicies.size(); i_index += 3)
+            m_triangle_area.reserve(get_index_count() / 3);
+            for(uint32_t i_index = 0; i_index < get_index_count(); i_index += 3)
             {
                 // calculate triangle area.
-                const glm::vec3 a = mPositions[mIndicies[i_index]];
-                const glm::vec3 b = mPositions[mIndicies[i_index + 1]];
-                const glm::vec3 c = mPositions[mIndicies[i_index + 2]];
+                const glm::vec3 a = mPositions[get_index(i_index)];
+                const glm::vec3 b = mPositions[get_index(i_index + 1)];
+                const glm::vec3 c = mPositions[get_index(i_index + 2)];
 
                 const glm::vec3 ac = a - c;
                 const glm::vec3 bc = b - c;
@@ -116,42 +970,85 @@ namespace Core
             PICO_LOG("Generating sampling data for %s. %zu faces generated\n", m_name.c_str(), m_triangle_area.size());
         }
 
-        bool LowerLevelMeshBVH::sample_geometry(Rand::Hammersley_Generator& rand, glm::vec3& sample_point, float& pdf)
+        bool LowerLevelMeshBVH::sample_geometry(Rand::Sample_Stream& rand, glm::vec3& sample_point, float& pdf)
         {
-            uint32_t triangle_index = m_aliasTable.sample(rand.get_xor_random_generator(), pdf);
+            mark_used();
+            uint32_t triangle_index = m_aliasTable.sample(rand.next_2D(), pdf);
 
-            const glm::vec2 Xi = rand.next();
+            const glm::vec2 Xi = rand.next_2D();
             const glm::vec2 barycentrics = Core::Rand::uniform_sample_triangle(Xi);
 
             const uint32_t index_start = 3 * triangle_index;
-            sample_point = ((1.0f - barycentrics.x - barycentrics.y) * mPositions[mIndicies[index_start]] +
-                (barycentrics.x * mPositions[mIndicies[index_start + 1]])) +
-                (barycentrics.y * mPositions[mIndicies[index_start + 2]]);
+            sample_point = ((1.0f - barycentrics.x - barycentrics.y) * mPositions[get_index(index_start)] +
+                (barycentrics.x * mPositions[get_index(index_start + 1)])) +
+                (barycentrics.y * mPositions[get_index(index_start + 2)]);
 
             return true;
         }
 
-        InterpolatedVertex LowerLevelMeshBVH::Mesh_Intersector::interpolate_fragment(const uint32_t primID, const float u, const float v) const
+        size_t LowerLevelMeshBVH::get_residence_size() const
+        {
+            return m_cache_file ? m_cache_file->get_size() : 0;
+        }
+
+        void LowerLevelMeshBVH::make_resident(void*)
+        {
+            if(m_cache_file)
+                m_cache_file->prefetch();
+
+            m_resident = true;
+        }
+
+        void LowerLevelMeshBVH::make_nonresident()
+        {
+            if(m_cache_file)
+                m_cache_file->evict();
+
+            m_resident = false;
+        }
+
+        InterpolatedVertex LowerLevelMeshBVH::interpolate_fragment(const uint32_t primID, const float u, const float v) const
         {
             const uint32_t baseIndiciesIndex = primID * 3;
+            const uint32_t indicies[3] = {get_index(baseIndiciesIndex), get_index(baseIndiciesIndex + 1), get_index(baseIndiciesIndex + 2)};
+
+            glm::vec3 positions[3];
+            glm::vec2 uvs[3];
+            glm::vec3 normals[3];
+            glm::vec4 colours[3];
+            for(uint32_t i = 0; i < 3; ++i)
+            {
+                const uint32_t index = indicies[i];
+                positions[i] = mPositions[index];
+
+                if(!m_packed_normals.empty())
+                {
+                    normals[i] = decode_normal(m_packed_normals[index]);
+                    uvs[i] = m_packed_uvs.empty() ? glm::vec2(0.0f) : glm::unpackHalf2x16(m_packed_uvs[index]);
+                    colours[i] = m_packed_colours.empty() ? glm::vec4(1, 1, 1, 1) : glm::unpackUnorm4x8(m_packed_colours[index]);
+                }
+                else
+                {
+                    normals[i] = mNormals[index];
+                    uvs[i] = mUVs.empty() ? glm::vec2(0.0f) : mUVs[index];
+                    colours[i] = mVertexColours.empty() ? glm::vec4(1, 1, 1, 1) : mVertexColours[index];
+                }
+            }
 
-            const uint32_t firstIndex = m_indicies[baseIndiciesIndex];
-            const glm::vec3& firstPosition = m_positions[firstIndex];
-            const glm::vec2& firstuv = !m_uvs ? glm::vec2(0.0f) : m_uvs[firstIndex];
-            const glm::vec3& firstNormal = m_normals[firstIndex];
-            const glm::vec4 firstColour = !m_colours ? glm::vec4(1, 1, 1, 1) : m_colours[firstIndex];
+            const glm::vec3& firstPosition = positions[0];
+            const glm::vec2& firstuv = uvs[0];
+            const glm::vec3& firstNormal = normals[0];
+            const glm::vec4& firstColour = colours[0];
 
-            const uint32_t secondIndex = m_indicies[baseIndiciesIndex + 1];
-            const glm::vec3& secondPosition = m_positions[secondIndex];
-            const glm::vec2& seconduv = !m_uvs ? glm::vec2(0.0f) : m_uvs[secondIndex];
-            const glm::vec3& secondNormal = m_normals[secondIndex];
-            const glm::vec4& secondColour = !m_colours ? glm::vec4(1, 1, 1, 1) : m_colours[secondIndex];
+            const glm::vec3& secondPosition = positions[1];
+            const glm::vec2& seconduv = uvs[1];
+            const glm::vec3& secondNormal = normals[1];
+            const glm::vec4& secondColour = colours[1];
 
-            const uint32_t thirdIndex = m_indicies[baseIndiciesIndex + 2];
-            const glm::vec3& thirdPosition = m_positions[thirdIndex];
-            const glm::vec2& thirduv = !m_uvs ? glm::vec2(0.0f) : m_uvs[thirdIndex];
-            const glm::vec3& thirdNormal = m_normals[thirdIndex];
-            const glm::vec4& thirdColour = !m_colours ? glm::vec4(1, 1, 1, 1) : m_colours[thirdIndex];
+            const glm::vec3& thirdPosition = positions[2];
+            const glm::vec2& thirduv = uvs[2];
+            const glm::vec3& thirdNormal = normals[2];
+            const glm::vec4& thirdColour = colours[2];
 
             InterpolatedVertex frag{};
             frag.mPosition = glm::vec4(((1.0f - v - u) * firstPosition) + (u * secondPosition) + (v * thirdPosition), 1.0f);
@@ -162,12 +1059,12 @@ namespace Core
             return frag;
         }
 
-        bool LowerLevelMeshBVH::Mesh_Intersector::intersects(const Ray& ray, uint32_t primID, float& distance, InterpolatedVertex& vertex) const
+        bool LowerLevelMeshBVH::Mesh_Intersector::intersect_triangle(const Ray& ray, const uint32_t primID, float& t, float& u, float& v) const
         {
             const float EPSILON = 0.0000001f;
-            const glm::vec3 vertex0 = m_positions[m_indicies[primID * 3]];
-            const glm::vec3 vertex1 = m_positions[m_indicies[(primID * 3) + 1]];
-            const glm::vec3 vertex2 = m_positions[m_indicies[(primID * 3) + 2]];
+            const glm::vec3 vertex0 = m_mesh.mPositions[m_mesh.get_index(primID * 3)];
+            const glm::vec3 vertex1 = m_mesh.mPositions[m_mesh.get_index((primID * 3) + 1)];
+            const glm::vec3 vertex2 = m_mesh.mPositions[m_mesh.get_index((primID * 3) + 2)];
 
             const glm::vec3 edge1 = vertex1 - vertex0;
             const glm::vec3 edge2 = vertex2 - vertex0;
@@ -179,29 +1076,93 @@ namespace Core
 
             const float f = 1.0 / a;
             const glm::vec3 s = glm::vec3(ray.mOrigin.x, ray.mOrigin.y, ray.mOrigin.z) - vertex0;
-            const float u = f * glm::dot(s, h);
+            u = f * glm::dot(s, h);
 
             if (u < 0.0 || u > 1.0)
                 return false;
 
             glm::vec3 q = glm::cross(s, edge1);
-            const float v = f * glm::dot(ray.mDirection, q);
+            v = f * glm::dot(ray.mDirection, q);
 
             if (v < 0.0 || u + v > 1.0)
                 return false;
 
             // At this stage we can compute t to find out where the intersection point is on the line.
-            const float t = f * glm::dot(edge2, q);
+            t = f * glm::dot(edge2, q);
 
-            if (t > EPSILON) // ray intersection
-            {
-                distance = t;
+            return t > EPSILON; // ray intersection
+        }
 
-                vertex = interpolate_fragment(primID, u, v);
+        bool LowerLevelMeshBVH::Mesh_Intersector::intersects(const Ray& ray, uint32_t primID, HitRecord& hit) const
+        {
+            float t, u, v;
+            if (intersect_triangle(ray, primID, t, u, v) && t < hit.m_distance)
+            {
+                hit.m_distance = t;
+                hit.m_primitive = primID;
+                hit.m_barycentrics = glm::vec2(u, v);
 
                 return true;
             }
 
+            return false;
+        }
+
+        bool LowerLevelMeshBVH::Mesh_Intersector::occludes(const Ray& ray, uint32_t primID, const float max_distance) const
+        {
+            float t, u, v;
+            return intersect_triangle(ray, primID, t, u, v) && t < max_distance;
+        }
+
+        bool LowerLevelMeshBVH::Mesh_Intersector::intersects_leaf(const Ray& ray, const uint32_t* primitives, const uint32_t first, const uint32_t count, HitRecord& hit) const
+        {
+            if(m_mesh.m_triangle_data.empty())
+                return Intersector<uint32_t>::intersects_leaf(ray, primitives, first, count, hit);
+
+            const size_t stride = m_mesh.m_triangle_data.size() / 9;
+            bool found = false;
+            for(uint32_t block = first; block < first + count; block += kTriangleBlockSize)
+            {
+                float distances[kTriangleBlockSize], us[kTriangleBlockSize], vs[kTriangleBlockSize];
+                uint32_t hit_mask = intersect_triangles<kTriangleBlockSize>(m_mesh.m_triangle_data.data(), stride, block, ray, hit.m_distance, distances, us, vs);
+
+                // Columns past the end of the leaf belong to other leaves or the padding.
+                const uint32_t lanes = std::min(kTriangleBlockSize, first + count - block);
+                hit_mask &= (1u << lanes) - 1u;
+
+                while(hit_mask != 0)
+                {
+                    const uint32_t lane = std::countr_zero(hit_mask);
+                    hit_mask &= hit_mask - 1;
+
+                    if(distances[lane] < hit.m_distance)
+                    {
+                        hit.m_distance = distances[lane];
+                        hit.m_primitive = primitives[block + lane];
+                        hit.m_barycentrics = glm::vec2(us[lane], vs[lane]);
+                        found = true;
+                    }
+                }
+            }
+
+            return found;
+        }
+
+        bool LowerLevelMeshBVH::Mesh_Intersector::occludes_leaf(const Ray& ray, const uint32_t* primitives, const uint32_t first, const uint32_t count, const float max_distance) const
+        {
+            if(m_mesh.m_triangle_data.empty())
+                return Intersector<uint32_t>::occludes_leaf(ray, primitives, first, count, max_distance);
+
+            const size_t stride = m_mesh.m_triangle_data.size() / 9;
+            for(uint32_t block = first; block < first + count; block += kTriangleBlockSize)
+            {
+                float distances[kTriangleBlockSize], us[kTriangleBlockSize], vs[kTriangleBlockSize];
+                const uint32_t hit_mask = intersect_triangles<kTriangleBlockSize>(m_mesh.m_triangle_data.data(), stride, block, ray, max_distance, distances, us, vs);
+
+                const uint32_t lanes = std::min(kTriangleBlockSize, first + count - block);
+                if(hit_mask & ((1u << lanes) - 1u))
+                    return true;
+            }
 
             return false;
         }
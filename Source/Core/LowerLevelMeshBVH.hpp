@@ -3,13 +3,17 @@
 
 #include "LowerLevelBVH.hpp"
 #include "Core/BVH.hpp"
+#include "Core/Loadable.hpp"
 #include "Util/AliasTable.hpp"
 
 #include "assimp/mesh.h"
 
+#include <atomic>
+#include <filesystem>
+#include <memory>
 #include <vector>
 
-#define LOWER_ACCELERATION_STRUCTURE BVH<uint32_t, 2>
+#define LOWER_ACCELERATION_STRUCTURE Acceleration_Structure<uint32_t>
 
 namespace Core
 {
@@ -17,13 +21,69 @@ namespace Core
     namespace Acceleration_Structures
     {
 
-        class LowerLevelMeshBVH : public LowerLevelBVH
+        // Lookdev scenes can trade some tree quality for much faster loads with the linear builders.
+        enum class BVHBuildMode
+        {
+            kSAH,
+            kLBVH, // Morton code partitioning.
+            kPLOC  // Agglomerative clustering of Morton sorted triangles.
+        };
+
+        struct MeshBVHSettings
+        {
+            BVHBuildMode m_build_mode = BVHBuildMode::kSAH;
+
+            // Clips long thin triangles in to several references, only used with kSAH.
+            bool  m_spatial_splits = false;
+            float m_duplication_budget = 0.25f; // Extra references allowed as a fraction of the triangle count.
+
+            // Stores the BVH with 8 bit child bounds, for meshes too large to keep full precision nodes in memory.
+            bool  m_compressed_nodes = false;
+
+            // Stores a binary BVH in the flat layout rather than wide nodes, ignored with m_compressed_nodes. The flat
+            // layout can't be refit, so update_positions always rebuilds it.
+            bool  m_flat_nodes = false;
+
+            // Built BVHs are cached here keyed by the mesh contents and these settings, empty disables the cache.
+            std::filesystem::path m_cache_directory;
+
+            // Keep normals, uvs and colours (and indices when every vertex can be addressed with 16 bits) in compact
+            // forms that are only decoded when a hit is interpolated. Ignored for out of core meshes.
+            bool m_compressed_attributes = false;
+
+            // Traverses the BVH and vertices straight from the cache file's mapping rather than from memory, so the
+            // mesh can be evicted and paged back in on demand. Needs m_cache_directory.
+            bool m_out_of_core = false;
+
+            // update_positions rebuilds the BVH once refitting has raised its SAH cost above this multiple of the
+            // cost it was built with.
+            float m_rebuild_threshold = 1.5f;
+        };
+
+        // Out of core meshes are resident while their mapping's pages are wanted in memory, making them nonresident
+        // drops the pages but leaves the mesh usable, it just faults them back in from the file.
+        class LowerLevelMeshBVH : public LowerLevelBVH, public Loadable
         {
         public:
 
-            LowerLevelMeshBVH(const aiMesh*);
+            // The BVH is built on thread_pool when one is provided.
+            LowerLevelMeshBVH(const aiMesh*, ThreadPool* thread_pool = nullptr, const MeshBVHSettings& settings = {});
+
+            // Moves the vertices to those of mesh, which must be a later frame of the mesh this was built from with
+            // the same topology, and refits the BVH on thread_pool. The BVH is rebuilt instead once refitting has
+            // degraded it past MeshBVHSettings::m_rebuild_threshold. Out of core meshes are copied in to memory and
+            // stop being out of core.
+            void update_positions(const aiMesh* mesh, ThreadPool* thread_pool = nullptr);
+
+            virtual bool calculate_intersection(Ray&, HitRecord& hit) const final;
+
+            virtual InterpolatedVertex interpolate_hit(const Ray&, const HitRecord& hit) const final;
+
+            virtual bool is_occluded(Ray&, const float max_distance) const final;
+
+            virtual uint32_t calculate_intersections(Ray* rays, const uint32_t ray_mask, HitRecord* hits) const final;
 
-            virtual bool calculate_intersection(Ray&, InterpolatedVertex* result) const;
+            virtual uint32_t are_occluded(Ray* rays, const uint32_t ray_mask, const float* max_distances) const final;
 
             virtual AABB get_bounds() const final
             {
@@ -32,17 +92,142 @@ namespace Core
 
             virtual void generate_sampling_data() final;
 
-            virtual bool sample_geometry(Core::Rand::Hammersley_Generator& Xi, glm::vec3&, float&) final;
+            virtual bool sample_geometry(Core::Rand::Sample_Stream&, glm::vec3&, float&) final;
+
+            virtual size_t get_residence_size() const final;
+
+            virtual bool is_resident() const final
+            {
+                return m_resident;
+            }
+
+            // The mapping pages itself in so no memory is needed.
+            virtual void make_resident(void*) final;
+
+            virtual void make_nonresident() final;
+
+            bool is_out_of_core() const
+            {
+                return m_settings.m_out_of_core;
+            }
+
+            // Returns whether the mesh has been traversed since the last call.
+            bool take_used()
+            {
+                return m_used.exchange(false, std::memory_order_relaxed);
+            }
 
         private:
 
+            void mark_used() const
+            {
+                // Only written when it changes so traversing threads don't keep taking the cache line from each other.
+                if(m_settings.m_out_of_core && !m_used.load(std::memory_order_relaxed))
+                    m_used.store(true, std::memory_order_relaxed);
+            }
+
+            InterpolatedVertex interpolate_fragment(const uint32_t primID, const float u, const float v) const;
+
+            AABB get_triangle_bounds(const uint32_t primID) const;
+
+            // Bounds of the part of the triangle between min and max along axis.
+            AABB clip_triangle(const uint32_t primID, const uint32_t axis, const float min, const float max) const;
+
+            using Mesh_BVH = WideBVH<uint32_t, kDefaultWideNodeWidth>;
+            using Compressed_Mesh_BVH = CompressedWideBVH<uint32_t, kDefaultWideNodeWidth>;
+            using Flat_Mesh_BVH = FlatBVH<uint32_t>;
+
+            BVHNodeLayout get_node_layout() const
+            {
+                if(m_settings.m_compressed_nodes)
+                    return kDefaultCompressedNodeLayout;
+
+                return m_settings.m_flat_nodes ? BVHNodeLayout::kFlat : kDefaultWideNodeLayout;
+            }
+
+            size_t get_node_size() const
+            {
+                if(m_settings.m_compressed_nodes)
+                    return sizeof(Compressed_Mesh_BVH::Node);
+
+                return m_settings.m_flat_nodes ? sizeof(Flat_Mesh_BVH::Node) : sizeof(Mesh_BVH::Node);
+            }
+
+            void build_BVH(ThreadPool* thread_pool, const MeshBVHSettings& settings);
+
+            // The primitive array of whichever layout was built.
+            Array_Storage<uint32_t>&       get_leaf_primitives();
+            const Array_Storage<uint32_t>& get_leaf_primitives() const;
+
+            // Renumbers triangles in the order the BVH leaves reference them, and vertices in the order those
+            // triangles use them, so traversal walks the vertex data roughly linearly.
+            void reorder_for_traversal();
+
+            // Fills m_triangle_data from the BVH's final primitive array.
+            void precompute_triangles(ThreadPool* thread_pool = nullptr);
+
+            // Moves the float attributes in to the packed arrays below, and back again for the indices.
+            void compress_attributes();
+            void compress_indicies();
+            void expand_indicies();
+
+            uint32_t get_index(const size_t i) const
+            {
+                return m_short_indicies.empty() ? mIndicies[i] : m_short_indicies[i];
+            }
+
+            size_t get_index_count() const
+            {
+                return m_short_indicies.empty() ? mIndicies.size() : m_short_indicies.size();
+            }
+
+            struct Cache_Key
+            {
+                uint64_t m_key;      // Names the cache file.
+                uint64_t m_checksum; // Independent hash of the same data, checked against the file's header.
+            };
+
+            Cache_Key get_cache_key(const MeshBVHSettings& settings) const;
+            bool      load_from_cache(const std::filesystem::path& path, const Cache_Key& key);
+            void      write_to_cache(const std::filesystem::path& path, const Cache_Key& key) const;
+
             std::string m_name;
 
-            std::vector<glm::vec3> mPositions;
-            std::vector<glm::vec2> mUVs;
-            std::vector<glm::vec3> mNormals;
-            std::vector<glm::vec4> mVertexColours;
-            std::vector<uint32_t>  mIndicies;
+            MeshBVHSettings m_settings;
+            float           m_built_sah_cost;
+
+            // Views the cache file when the BVH was loaded from it.
+            std::unique_ptr<Mapped_File> m_cache_file;
+
+            bool                      m_resident = true;
+            mutable std::atomic<bool> m_used{false};
+
+            Array_Storage<glm::vec3> mPositions;
+            Array_Storage<glm::vec2> mUVs;
+            Array_Storage<glm::vec3> mNormals;
+            Array_Storage<glm::vec4> mVertexColours;
+            Array_Storage<uint32_t>  mIndicies;
+
+            // Vertex index in the source aiMesh for each vertex, as reorder_for_traversal moves them.
+            Array_Storage<uint32_t>  m_vertex_order;
+
+            // Used in place of the arrays above with MeshBVHSettings::m_compressed_attributes, which leaves those
+            // empty. Normals are octahedral with 16 bits per component, uvs are half floats and colours 8 bit unorm.
+            Array_Storage<uint32_t>  m_packed_normals;
+            Array_Storage<uint32_t>  m_packed_uvs;
+            Array_Storage<uint32_t>  m_packed_colours;
+            Array_Storage<uint16_t>  m_short_indicies;
+
+            // Rows of v0, edge1 and edge2 x, y and z with one column per entry of the BVH's primitive array, so
+            // leaves can test several triangles at once without gathering through mIndicies. Rows are padded
+            // by kTriangleBlockSize columns so the last block can always be loaded whole.
+            static constexpr uint32_t kTriangleBlockSize = kDefaultWideNodeWidth;
+            Array_Storage<float> m_triangle_data;
+
+            static size_t get_triangle_row_stride(const size_t primitive_count)
+            {
+                return primitive_count + kTriangleBlockSize;
+            }
 
             // Data used for light sampling.
             std::vector<float> m_triangle_area;
@@ -52,24 +237,25 @@ namespace Core
             {
                 public:
 
-                Mesh_Intersector(glm::vec3* positions, glm::vec2* uvs, glm::vec3* normals, glm::vec4* colours, uint32_t* indicies) :
-                        m_positions(positions),
-                        m_uvs(uvs),
-                        m_normals(normals),
-                        m_colours(colours),
-                        m_indicies(indicies) {}
+                // Leaves fall back to testing one triangle at a time until the mesh's triangle data has been filled in.
+                // The mesh is referenced rather than its arrays as they can be updated, compressed or made owned after
+                // the build.
+                Mesh_Intersector(const LowerLevelMeshBVH& mesh) :
+                        m_mesh(mesh) {}
+
+                virtual bool intersects(const Ray&, uint32_t, HitRecord&) const override;
+
+                virtual bool occludes(const Ray&, uint32_t, const float max_distance) const override;
+
+                virtual bool intersects_leaf(const Ray&, const uint32_t* primitives, const uint32_t first, const uint32_t count, HitRecord&) const override;
 
-                virtual bool intersects(const Ray&, uint32_t, float& distance, InterpolatedVertex&) const override;
+                virtual bool occludes_leaf(const Ray&, const uint32_t* primitives, const uint32_t first, const uint32_t count, const float max_distance) const override;
 
             private:
 
-                InterpolatedVertex interpolate_fragment(const uint32_t primID, const float u, const float v) const;
+                bool intersect_triangle(const Ray&, const uint32_t primID, float& t, float& u, float& v) const;
 
-                glm::vec3* m_positions;
-                glm::vec2* m_uvs;
-                glm::vec3* m_normals;
-                glm::vec4* m_colours;
-                uint32_t* m_indicies;
+                const LowerLevelMeshBVH& m_mesh;
             };
 
             LOWER_ACCELERATION_STRUCTURE* m_acceleration_structure;
@@ -0,0 +1,132 @@
+#include "MappedFile.hpp"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace Core
+{
+
+#ifdef _WIN32
+
+    Mapped_File::Mapped_File(const std::filesystem::path& path) :
+        m_data{nullptr},
+        m_size{0},
+        m_file{INVALID_HANDLE_VALUE},
+        m_mapping{nullptr}
+    {
+        m_file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if(m_file == INVALID_HANDLE_VALUE)
+            return;
+
+        LARGE_INTEGER size;
+        if(!GetFileSizeEx(m_file, &size) || size.QuadPart == 0)
+            return;
+
+        m_mapping = CreateFileMappingW(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if(m_mapping == nullptr)
+            return;
+
+        m_data = MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+        if(m_data)
+            m_size = size.QuadPart;
+    }
+
+    Mapped_File::~Mapped_File()
+    {
+        if(m_data)
+            UnmapViewOfFile(m_data);
+        if(m_mapping)
+            CloseHandle(m_mapping);
+        if(m_file != INVALID_HANDLE_VALUE)
+            CloseHandle(m_file);
+    }
+
+    void Mapped_File::prefetch()
+    {
+        if(!m_data)
+            return;
+
+        WIN32_MEMORY_RANGE_ENTRY range{m_data, m_size};
+        PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+    }
+
+    void Mapped_File::evict()
+    {
+        // Unlocking pages that aren't locked removes them from the working set.
+        if(m_data)
+            VirtualUnlock(m_data, m_size);
+    }
+
+    size_t get_page_fault_count()
+    {
+        PROCESS_MEMORY_COUNTERS counters{};
+        if(!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+            return 0;
+
+        return counters.PageFaultCount;
+    }
+
+#else
+
+    Mapped_File::Mapped_File(const std::filesystem::path& path) :
+        m_data{nullptr},
+        m_size{0}
+    {
+        const int file = open(path.c_str(), O_RDONLY);
+        if(file < 0)
+            return;
+
+        struct stat file_stats;
+        if(fstat(file, &file_stats) == 0 && file_stats.st_size > 0)
+        {
+            // The mapping keeps the file alive after it's closed.
+            void* data = mmap(nullptr, file_stats.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+            if(data != MAP_FAILED)
+            {
+                m_data = data;
+                m_size = file_stats.st_size;
+            }
+        }
+
+        close(file);
+    }
+
+    Mapped_File::~Mapped_File()
+    {
+        if(m_data)
+            munmap(m_data, m_size);
+    }
+
+    void Mapped_File::prefetch()
+    {
+        if(m_data)
+            madvise(m_data, m_size, MADV_WILLNEED);
+    }
+
+    void Mapped_File::evict()
+    {
+        if(m_data)
+            madvise(m_data, m_size, MADV_DONTNEED);
+    }
+
+    size_t get_page_fault_count()
+    {
+        struct rusage usage;
+        if(getrusage(RUSAGE_SELF, &usage) != 0)
+            return 0;
+
+        return usage.ru_majflt;
+    }
+
+#endif
+
+}
@@ -0,0 +1,132 @@
+#ifndef PICO_MAPPED_FILE_HPP
+#define PICO_MAPPED_FILE_HPP
+
+#include <cstddef>
+#include <filesystem>
+#include <vector>
+
+
+namespace Core
+{
+
+    // Read only memory mapping of a whole file, the mapping lives as long as the object.
+    class Mapped_File
+    {
+    public:
+
+        Mapped_File(const std::filesystem::path& path);
+        ~Mapped_File();
+
+        Mapped_File(const Mapped_File&) = delete;
+        Mapped_File& operator=(const Mapped_File&) = delete;
+
+        bool is_valid() const
+        {
+            return m_data != nullptr;
+        }
+
+        const unsigned char* get_data() const
+        {
+            return static_cast<const unsigned char*>(m_data);
+        }
+
+        size_t get_size() const
+        {
+            return m_size;
+        }
+
+        // Hints that the whole file is about to be read so the OS can start paging it in.
+        void prefetch();
+
+        // Drops the mapping's pages from memory, they are read back from the file the next time they are touched.
+        // The mapping is read only so this is safe while other threads are reading it.
+        void evict();
+
+    private:
+
+        void*  m_data;
+        size_t m_size;
+
+#ifdef _WIN32
+        void* m_file;
+        void* m_mapping;
+#endif
+    };
+
+    // Page faults taken by the process so far, major faults only where the platform can tell them apart.
+    size_t get_page_fault_count();
+
+    // Array that either owns its elements or views memory owned elsewhere, such as a Mapped_File.
+    template<typename T>
+    class Array_Storage
+    {
+    public:
+
+        Array_Storage() : m_owned{}, m_data{nullptr}, m_size{0} {}
+
+        Array_Storage(std::vector<T>&& owned) :
+            m_owned{std::move(owned)},
+            m_data{m_owned.data()},
+            m_size{m_owned.size()} {}
+
+        // data must outlive the storage.
+        Array_Storage(const T* data, const size_t size) :
+            m_owned{},
+            m_data{data},
+            m_size{size} {}
+
+        // Moving the vector keeps its buffer so m_data stays valid.
+        Array_Storage(Array_Storage&&) = default;
+        Array_Storage& operator=(Array_Storage&&) = default;
+
+        const T& operator[](const size_t i) const
+        {
+            return m_data[i];
+        }
+
+        const T* data() const
+        {
+            return m_data;
+        }
+
+        size_t size() const
+        {
+            return m_size;
+        }
+
+        bool empty() const
+        {
+            return m_size == 0;
+        }
+
+        bool is_owned() const
+        {
+            return m_data == m_owned.data();
+        }
+
+        // Only owned storage can be modified, and only in place.
+        T* mutable_data()
+        {
+            return is_owned() ? m_owned.data() : nullptr;
+        }
+
+        // Copies viewed memory in to owned storage so that it can be modified.
+        void make_owned()
+        {
+            if(is_owned())
+                return;
+
+            m_owned.assign(m_data, m_data + m_size);
+            m_data = m_owned.data();
+        }
+
+    private:
+
+        std::vector<T> m_owned;
+        const T*       m_data;
+        size_t         m_size;
+    };
+
+}
+
+#endif
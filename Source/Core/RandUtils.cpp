@@ -80,13 +80,29 @@ namespace Core
             return result;
         }
 
-        Hammersley_Generator::Hammersley_Generator(const uint32_t seed) :
-            m_random_sample_distribution(seed)
-        {}
+        pcg_random::pcg_random(const uint64_t seed, const uint64_t stream)
+        {
+            reseed(seed, stream);
+        }
 
-        glm::vec2 Hammersley_Generator::next()
+        void pcg_random::reseed(const uint64_t seed, const uint64_t stream)
         {
-            return hammersley(m_random_sample_distribution.next() , kMaxSamples);
+            m_state = 0;
+            m_increment = (stream << 1u) | 1u;
+            next();
+            m_state += seed;
+            next();
+        }
+
+        uint32_t pcg_random::next()
+        {
+            const uint64_t old_state = m_state;
+            m_state = old_state * 6364136223846793005ull + m_increment;
+
+            const uint32_t xorshifted = static_cast<uint32_t>(((old_state >> 18u) ^ old_state) >> 27u);
+            const uint32_t rotation = static_cast<uint32_t>(old_state >> 59u);
+
+            return (xorshifted >> rotation) | (xorshifted << ((32u - rotation) & 31u));
         }
 
     }
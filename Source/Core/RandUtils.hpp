@@ -66,21 +66,33 @@ namespace Core
                 uint32_t m_state[4];
         };
 
-        class Hammersley_Generator
+        // PCG32 (O'Neill 2014), 16 bytes of state so it can be reseeded per pixel or per sample rather than
+        // constructed for them. Each stream is an independent sequence for the same seed.
+        class pcg_random
         {
-        public:
-            Hammersley_Generator(const uint32_t seed);
+            public:
+
+                pcg_random(const uint64_t seed, const uint64_t stream = 0);
+
+                void reseed(const uint64_t seed, const uint64_t stream = 0);
 
-            glm::vec2 next();
+                uint32_t next();
 
-            xorshift_random& get_xor_random_generator() { return m_random_sample_distribution; }
+                // Operator to match the std random number generators.
+                uint32_t operator()()
+                {
+                    return next();
+                }
 
-        private:
+                using result_type = uint32_t;
 
-            constexpr static size_t kMaxSamples = std::numeric_limits<uint32_t>::max();
+                static constexpr result_type min() { return 0; }
+                static constexpr result_type max() { return std::numeric_limits<uint32_t>::max(); }
 
-            xorshift_random m_random_sample_distribution;
+            private:
 
+                uint64_t m_state;
+                uint64_t m_increment;
         };
 
     }
@@ -0,0 +1,164 @@
+#include "Sampler.hpp"
+#include "RandUtils.hpp"
+
+#include <algorithm>
+#include <bit>
+
+namespace
+{
+    // Pixels of a Blue_Noise_Sampler tile are ranked together, 64x64 leaves 20 bits of sample index.
+    constexpr uint32_t kBlueNoiseTileBits = 6;
+    constexpr uint32_t kMaxBlueNoiseSampleBits = 32 - (2 * kBlueNoiseTileBits);
+
+    uint32_t reverse_bits(uint32_t bits)
+    {
+        bits = (bits << 16u) | (bits >> 16u);
+        bits = ((bits & 0x55555555u) << 1u) | ((bits & 0xAAAAAAAAu) >> 1u);
+        bits = ((bits & 0x33333333u) << 2u) | ((bits & 0xCCCCCCCCu) >> 2u);
+        bits = ((bits & 0x0F0F0F0Fu) << 4u) | ((bits & 0xF0F0F0F0u) >> 4u);
+        bits = ((bits & 0x00FF00FFu) << 8u) | ((bits & 0xFF00FF00u) >> 8u);
+
+        return bits;
+    }
+
+    uint32_t hash(uint32_t x)
+    {
+        x ^= x >> 16u;
+        x *= 0x7feb352du;
+        x ^= x >> 15u;
+        x *= 0x846ca68bu;
+        x ^= x >> 16u;
+
+        return x;
+    }
+
+    uint32_t hash_combine(const uint32_t seed, const uint32_t v)
+    {
+        return seed ^ (hash(v) + 0x9e3779b9u + (seed << 6u) + (seed >> 2u));
+    }
+
+    uint32_t pixel_seed(const glm::uvec2& pixel, const uint32_t seed)
+    {
+        return hash_combine(hash_combine(seed, pixel.x), pixel.y);
+    }
+
+    // Each bit only depends on the bits below it.
+    uint32_t laine_karras_permutation(uint32_t x, const uint32_t seed)
+    {
+        x += seed;
+        x ^= x * 0x6c50b47cu;
+        x ^= x * 0xb82f1e52u;
+        x ^= x * 0xc7afe638u;
+        x ^= x * 0x8d22f6e6u;
+
+        return x;
+    }
+
+    // Owen scrambling in base 2, each bit is flipped depending on the bits above it.
+    uint32_t nested_uniform_scramble(const uint32_t x, const uint32_t seed)
+    {
+        return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+    }
+
+    // The first two Sobol dimensions, the second's direction numbers are each the previous one xored with itself
+    // shifted down by one.
+    glm::uvec2 sobol(const uint32_t index)
+    {
+        uint32_t y = 0;
+        uint32_t direction = 1u << 31;
+        for(uint32_t bits = index; bits != 0; bits >>= 1, direction ^= direction >> 1)
+        {
+            if(bits & 1)
+                y ^= direction;
+        }
+
+        return glm::uvec2(reverse_bits(index), y);
+    }
+
+    // Shuffling the index with a nested scramble keeps aligned power of two runs of it together, so they stay nets.
+    glm::vec2 owen_scrambled_sobol(const uint32_t index, const uint32_t seed)
+    {
+        const glm::uvec2 point = sobol(nested_uniform_scramble(index, seed));
+
+        // Only keep the bits a float can hold so the result stays below 1.
+        const uint32_t x = nested_uniform_scramble(point.x, hash_combine(seed, 0)) >> 8u;
+        const uint32_t y = nested_uniform_scramble(point.y, hash_combine(seed, 1)) >> 8u;
+
+        return glm::vec2(x, y) * (1.0f / float(1u << 24u));
+    }
+}
+
+namespace Core
+{
+
+    namespace Rand
+    {
+
+        Random_Sampler::Random_Sampler(const uint32_t seed) :
+            m_seed{seed}
+        {}
+
+        glm::vec2 Random_Sampler::get_sample(const glm::uvec2& pixel, const uint32_t index, const uint32_t dimension) const
+        {
+            pcg_random generator((uint64_t(pixel_seed(pixel, m_seed)) << 32u) | index, dimension);
+
+            const uint32_t x = generator.next() >> 8u;
+            const uint32_t y = generator.next() >> 8u;
+
+            return glm::vec2(x, y) * (1.0f / float(1u << 24u));
+        }
+
+        Sobol_Sampler::Sobol_Sampler(const uint32_t seed) :
+            m_seed{seed}
+        {}
+
+        glm::vec2 Sobol_Sampler::get_sample(const glm::uvec2& pixel, const uint32_t index, const uint32_t dimension) const
+        {
+            return owen_scrambled_sobol(index, hash_combine(pixel_seed(pixel, m_seed), dimension));
+        }
+
+        Blue_Noise_Sampler::Blue_Noise_Sampler(const uint32_t seed, const uint32_t samples_per_pixel) :
+            m_seed{seed},
+            m_sample_bits{std::min<uint32_t>(std::bit_width(std::max(samples_per_pixel, 1u) - 1), kMaxBlueNoiseSampleBits)}
+        {}
+
+        glm::vec2 Blue_Noise_Sampler::get_sample(const glm::uvec2& pixel, const uint32_t index, const uint32_t dimension) const
+        {
+            const uint32_t tile_seed = pixel_seed(pixel >> kBlueNoiseTileBits, m_seed);
+
+            // Rank the pixel along a Morton curve over the tile, with the children of every quadrant visited in an
+            // order picked by the quadrants above them.
+            uint32_t rank = 0;
+            uint32_t prefix = 1;
+            for(uint32_t level = kBlueNoiseTileBits; level-- > 0;)
+            {
+                const uint32_t digit = ((pixel.x >> level) & 1u) | (((pixel.y >> level) & 1u) << 1u);
+                rank = (rank << 2u) | (digit ^ (hash_combine(tile_seed, prefix) & 3u));
+                prefix = (prefix << 2u) | digit;
+            }
+
+            uint32_t sequence_seed = hash_combine(tile_seed, dimension);
+            if(const uint32_t pass = index >> m_sample_bits; pass != 0)
+                sequence_seed = hash_combine(sequence_seed, pass);
+
+            const uint32_t sample_mask = (1u << m_sample_bits) - 1u;
+            return owen_scrambled_sobol((rank << m_sample_bits) | (index & sample_mask), sequence_seed);
+        }
+
+        std::unique_ptr<Sampler> create_sampler(const SamplerType type, const uint32_t seed, const uint32_t samples_per_pixel)
+        {
+            switch(type)
+            {
+                case SamplerType::kRandom:
+                    return std::make_unique<Random_Sampler>(seed);
+                case SamplerType::kBlueNoise:
+                    return std::make_unique<Blue_Noise_Sampler>(seed, samples_per_pixel);
+                case SamplerType::kSobol:
+                default:
+                    return std::make_unique<Sobol_Sampler>(seed);
+            }
+        }
+
+    }
+
+}
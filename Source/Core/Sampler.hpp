@@ -0,0 +1,122 @@
+#ifndef PICO_SAMPLER_HPP
+#define PICO_SAMPLER_HPP
+
+#include <cstdint>
+#include <memory>
+
+#include "glm/vec2.hpp"
+
+namespace Core
+{
+
+    namespace Rand
+    {
+
+        enum class SamplerType
+        {
+            kRandom,
+            kSobol,
+            kBlueNoise
+        };
+
+        // Maps a pixel's sample index and dimension to a point in [0, 1)^2. Each dimension is a 2D sample, 1D
+        // samples use its first component. Samples hold no state so any thread can draw any of them.
+        class Sampler
+        {
+        public:
+
+            virtual ~Sampler() = default;
+
+            virtual glm::vec2 get_sample(const glm::uvec2& pixel, const uint32_t index, const uint32_t dimension) const = 0;
+        };
+
+        // White noise, every sample is hashed independently.
+        class Random_Sampler : public Sampler
+        {
+        public:
+
+            Random_Sampler(const uint32_t seed);
+
+            virtual glm::vec2 get_sample(const glm::uvec2& pixel, const uint32_t index, const uint32_t dimension) const final;
+
+        private:
+
+            uint32_t m_seed;
+        };
+
+        // Owen scrambled Sobol (Burley 2020). Every dimension is a 2D Sobol sequence with its own shuffle and scramble
+        // per pixel, so each one stays stratified however many dimensions are drawn before it.
+        class Sobol_Sampler : public Sampler
+        {
+        public:
+
+            Sobol_Sampler(const uint32_t seed);
+
+            virtual glm::vec2 get_sample(const glm::uvec2& pixel, const uint32_t index, const uint32_t dimension) const final;
+
+        private:
+
+            uint32_t m_seed;
+        };
+
+        // One Owen scrambled Sobol sequence shared by the pixels of a tile, which take runs of it in a scrambled Morton
+        // order (Ahmed and Wonka 2020). Neighbouring pixels get neighbouring runs, so their errors are spread as blue
+        // noise. Samples past samples_per_pixel carry on with a new scramble.
+        class Blue_Noise_Sampler : public Sampler
+        {
+        public:
+
+            Blue_Noise_Sampler(const uint32_t seed, const uint32_t samples_per_pixel);
+
+            virtual glm::vec2 get_sample(const glm::uvec2& pixel, const uint32_t index, const uint32_t dimension) const final;
+
+        private:
+
+            uint32_t m_seed;
+            uint32_t m_sample_bits;
+        };
+
+        std::unique_ptr<Sampler> create_sampler(const SamplerType type, const uint32_t seed, const uint32_t samples_per_pixel);
+
+        // The dimensions of one pixel sample, handed out in order.
+        class Sample_Stream
+        {
+        public:
+
+            Sample_Stream() = default;
+
+            Sample_Stream(const Sampler& sampler, const glm::uvec2& pixel, const uint32_t index) :
+                m_sampler{&sampler},
+                m_pixel{pixel},
+                m_index{index},
+                m_dimension{0} {}
+
+            // Draws continue from dimension, so what a consumer gets doesn't depend on how much was drawn before it.
+            void set_dimension(const uint32_t dimension)
+            {
+                m_dimension = dimension;
+            }
+
+            glm::vec2 next_2D()
+            {
+                return m_sampler->get_sample(m_pixel, m_index, m_dimension++);
+            }
+
+            float next_1D()
+            {
+                return next_2D().x;
+            }
+
+        private:
+
+            const Sampler* m_sampler = nullptr;
+            glm::uvec2     m_pixel{0, 0};
+            uint32_t       m_index = 0;
+            uint32_t       m_dimension = 0;
+        };
+
+    }
+
+}
+
+#endif
@@ -14,6 +14,7 @@
 #include "Util/Tiler.hpp"
 
 #include <algorithm>
+#include <map>
 #include <numeric>
 #include <memory>
 #include <fstream>
@@ -31,6 +32,37 @@
 #include "assimp/scene.h"
 
 
+namespace
+{
+    // Pixels traced together by each Wavefront_Integrator batch.
+    constexpr uint32_t kWavefrontBatchSize = 1 << 16;
+
+    // Adds a sample to the running mean and variance of a pixel, returns true once the pixel has converged.
+    bool accumulate_sample(const Scene::RenderParams& params, const uint32_t flat_location, glm::vec3 pixel_result)
+    {
+        uint32_t prev_sample_count = params.m_SampleCount[flat_location];
+        if (prev_sample_count < 1)
+        {
+            params.m_SampleCount[flat_location] = 1;
+            params.m_variance[flat_location] =  glm::vec4(0, 0, 0, 0);
+        }
+        else
+        {
+            const glm::vec3& previous_pixle = params.m_Pixels[flat_location];
+            const glm::vec3& previous_variance = params.m_variance[flat_location];
+            const glm::vec3 new_pixel_result = previous_pixle + ((pixel_result - previous_pixle) * (1.0f / static_cast<float>(prev_sample_count)));
+
+            params.m_variance[flat_location] = ((previous_variance * prev_sample_count) + ((pixel_result - previous_pixle) * (pixel_result - new_pixel_result))) / (prev_sample_count + 1);
+            params.m_SampleCount[flat_location] = prev_sample_count + 1;
+            pixel_result = new_pixel_result;
+        }
+
+        params.m_Pixels[flat_location] = pixel_result;
+
+        return prev_sample_count > 4 && glm::all(glm::lessThanEqual(params.m_variance[flat_location], glm::vec3(params.m_maxVariance)));
+    }
+}
+
 namespace Scene
 {
     Scene::Scene(ThreadPool& pool, const std::filesystem::path& path) :
@@ -80,7 +112,8 @@ namespace Scene
 
         }
 
-        m_bvh.build();
+        create_geometry_manager();
+        m_bvh.build(&m_threadPool);
     }
 
     Scene::Scene(ThreadPool& pool, const std::filesystem::path& working_dir, const aiScene* scene, const Util::Options& options) :
@@ -91,6 +124,43 @@ namespace Scene
 
         m_file_mapper = std::make_unique<Core::File_System_Mappings>(working_dir);
 
+        if(options.has_option(Util::Option::kBVHBuilder))
+        {
+            m_bvh_build_mode = get_bvh_build_mode(options.m_bvh_builder);
+        }
+
+        if(options.has_option(Util::Option::kBVHCache))
+        {
+            m_bvh_cache_directory = options.m_bvh_cache;
+        }
+
+        if(options.has_option(Util::Option::kCompressBVH))
+        {
+            m_compressed_bvh_threshold = options.m_compressed_bvh_threshold;
+        }
+
+        if(options.has_option(Util::Option::kCompressAttributes))
+        {
+            m_compress_vertex_attributes = options.m_compress_attributes;
+        }
+
+        if(options.has_option(Util::Option::kFlattenInstances))
+        {
+            m_instance_flattening = get_instance_flattening(options.m_flatten_instances);
+        }
+
+        if(options.has_option(Util::Option::kSampler))
+        {
+            m_sampler_type = get_sampler_type(options.m_sampler);
+        }
+
+        if(options.has_option(Util::Option::kGeometryBudget))
+        {
+            m_geometry_budget = static_cast<size_t>(options.m_geometry_budget) << 20;
+            if(m_bvh_cache_directory.empty())
+                m_bvh_cache_directory = working_dir / "BVHCache";
+        }
+
         if(options.has_option(Util::Option::kSkybox))
         {
             const std::string sky_box_path = m_file_mapper->resolve_path(options.m_skybox).string();
@@ -132,79 +202,108 @@ namespace Scene
 
         m_threadPool.wait_for_work_to_finish(material_loading_task_handles);
 
-        std::vector<std::future<void>> handles{};
-        parse_node(scene, scene->mRootNode, aiMatrix4x4{}, handles);
+        std::vector<Mesh_Instance> mesh_instances{};
+        parse_node(scene, scene->mRootNode, aiMatrix4x4{}, mesh_instances);
 
-        m_threadPool.wait_for_work_to_finish(handles);
+        add_mesh_instances(scene, mesh_instances);
 
-        m_bvh.build();
+        create_geometry_manager();
+        m_bvh.build(&m_threadPool);
     }
 
     void Scene::render_scene_to_memory(const Camera& camera, const RenderParams& params, const bool* should_quit)
     {
+        std::random_device random_device{};
+        Core::Rand::xorshift_random random_generator(random_device());
+
+        // Each pixel's samples are drawn by their index, so the sampler is shared and holds no per pixel state.
+        const std::unique_ptr<Core::Rand::Sampler> sampler = Core::Rand::create_sampler(m_sampler_type, random_generator.next(), params.m_maxSamples);
+
+        // The integrator keeps no per path state either, so every tile shares it.
+        Render::Monte_Carlo_Integrator integrator(m_bvh, m_material_manager, m_lights, m_sky_desc, *sampler);
+
         auto trace_rays_for_tile = [&](const glm::uvec2 start, const glm::uvec2& tile_size, const glm::uvec2& resolution, const uint32_t random_seed, const Camera& camera) -> bool
         {
             Core::Rand::xorshift_random random_generator(random_seed);
 
-            std::vector<uint32_t> pixel_indicies(tile_size.x * tile_size.y);
-            for(uint32_t tile_row = 0; tile_row < tile_size.y; ++tile_row)
-            {
-                auto row_start = std::begin(pixel_indicies) + (tile_row * tile_size.x);
-                std::iota(row_start, row_start + tile_size.x, ((start.y + tile_row) * resolution.x) + start.x);
-            }
-            std::shuffle(std::begin(pixel_indicies), std::end(pixel_indicies), random_generator);
+            // Neighbouring pixels are traced together as a packet, so walk the tile in blocks of kRayPacketSize pixels.
+            constexpr glm::uvec2 block_size{4, Core::Acceleration_Structures::kRayPacketSize / 4};
+            const glm::uvec2 block_count = (tile_size + block_size - 1u) / block_size;
+
+            std::vector<uint32_t> block_indicies(block_count.x * block_count.y);
+            std::iota(std::begin(block_indicies), std::end(block_indicies), 0);
+            std::shuffle(std::begin(block_indicies), std::end(block_indicies), random_generator);
 
-            for(const uint32_t flat_location : pixel_indicies)
+            for(const uint32_t block_index : block_indicies)
             {
                 if(*should_quit)
                 {
                     return true;
                 }
 
-                if(params.m_SampleCount[flat_location] >= params.m_maxSamples)
-                {
-                    continue;
-                }
+                const glm::uvec2 block_start = start + glm::uvec2(block_index % block_count.x, block_index / block_count.x) * block_size;
 
-                const glm::uvec2 pixel_location = glm::uvec2(flat_location % resolution.x, flat_location / resolution.x);
+                glm::uvec2 pixel_locations[Core::Acceleration_Structures::kRayPacketSize];
+                uint32_t flat_locations[Core::Acceleration_Structures::kRayPacketSize];
+                uint32_t pixel_mask = 0;
+                for(uint32_t r = 0; r < Core::Acceleration_Structures::kRayPacketSize; ++r)
+                {
+                    pixel_locations[r] = block_start + glm::uvec2(r % block_size.x, r / block_size.x);
+                    if(pixel_locations[r].x >= start.x + tile_size.x || pixel_locations[r].y >= start.y + tile_size.y)
+                        continue;
 
-                Render::Monte_Carlo_Integrator integrator(m_bvh, m_material_manager, m_lights, m_sky_desc, random_generator.next());
+                    flat_locations[r] = (pixel_locations[r].y * resolution.x) + pixel_locations[r].x;
+                    if(params.m_SampleCount[flat_locations[r]] < params.m_maxSamples)
+                        pixel_mask |= 1u << r;
+                }
 
-                for (uint32_t i = 0; i < params.m_maxSamples; ++i)
+                if(pixel_mask == 0)
                 {
-                    uint32_t prev_sample_count = params.m_SampleCount[flat_location];
-                    glm::vec3 pixel_result = integrator.integrate_ray(camera, glm::uvec2(pixel_location.x, pixel_location.y), params.m_maxRayDepth);
+                    continue;
+                }
 
-                    if (prev_sample_count < 1)
+                for (uint32_t i = 0; i < params.m_maxSamples && pixel_mask != 0; ++i)
+                {
+                    uint32_t sample_indices[Core::Acceleration_Structures::kRayPacketSize];
+                    for(uint32_t mask = pixel_mask; mask != 0; mask &= mask - 1)
                     {
-                        params.m_SampleCount[flat_location] = 1;
-                        params.m_variance[flat_location] =  glm::vec4(0, 0, 0, 0);
+                        const uint32_t r = std::countr_zero(mask);
+                        sample_indices[r] = params.m_SampleCount[flat_locations[r]];
                     }
-                    else
-                    {
-                        const glm::vec3& previous_pixle = params.m_Pixels[flat_location];
-                        const glm::vec3& previous_variance = params.m_variance[flat_location];
-                        const glm::vec3 new_pixel_result = previous_pixle + ((pixel_result - previous_pixle) * (1.0f / static_cast<float>(prev_sample_count)));
 
-                        params.m_variance[flat_location] = ((previous_variance * prev_sample_count) + ((pixel_result - previous_pixle) * (pixel_result - new_pixel_result))) / (prev_sample_count + 1);
-                        params.m_SampleCount[flat_location] = prev_sample_count + 1;
-                        pixel_result = new_pixel_result;
-                    }
+                    glm::vec3 pixel_results[Core::Acceleration_Structures::kRayPacketSize];
+                    integrator.integrate_packet(camera, pixel_locations, sample_indices, pixel_mask, params.m_maxRayDepth, pixel_results);
 
-                    params.m_Pixels[flat_location] = pixel_result;
+                    for(uint32_t mask = pixel_mask; mask != 0; mask &= mask - 1)
+                    {
+                        const uint32_t r = std::countr_zero(mask);
 
-                    if (prev_sample_count > 4 && glm::all(glm::lessThanEqual(params.m_variance[flat_location], glm::vec3(params.m_maxVariance))))
-                        break;
+                        // Converged pixels drop out of the packet while the rest of the block keeps sampling.
+                        if(accumulate_sample(params, flat_locations[r], pixel_results[r]))
+                            pixel_mask &= ~(1u << r);
+                    }
                 }
             }
+
+            if(m_geometry_manager)
+                m_geometry_manager->update();
+
             return false;
         };
 
-        std::random_device random_device{};
-        Core::Rand::xorshift_random random_generator(random_device());
-
         Util::Tiler tiler(m_threadPool, random_generator, glm::uvec2(params.m_Width, params.m_Height), glm::uvec2(64, 64));
-        tiler.execute_over_surface(trace_rays_for_tile, camera);
+        if(params.m_wavefront)
+            render_wavefront(camera, params, *sampler, should_quit);
+        else
+            tiler.execute_over_surface(trace_rays_for_tile, camera);
+
+        if(m_geometry_manager)
+        {
+            const Core::GeometryManager::Statistics stats = m_geometry_manager->get_statistics();
+            PICO_LOG("Geometry: %zu MB resident, %llu mesh faults, %llu evictions, %llu page faults\n", stats.m_resident_size >> 20,
+                     static_cast<unsigned long long>(stats.m_mesh_faults), static_cast<unsigned long long>(stats.m_evictions),
+                     static_cast<unsigned long long>(stats.m_page_faults));
+        }
 
         // Apply denoising and tonemapping
         glm::vec3* tone_mapping_input = params.m_Pixels;
@@ -235,6 +334,61 @@ namespace Scene
     }
 
 
+    void Scene::render_wavefront(const Camera& camera, const RenderParams& params, const Core::Rand::Sampler& sampler, const bool* should_quit)
+    {
+        Render::Wavefront_Integrator integrator(m_bvh, m_material_manager, m_lights, m_sky_desc, m_threadPool, sampler, params.m_sort_rays);
+
+        std::vector<uint32_t> active_pixels;
+        for(uint32_t flat_location = 0; flat_location < params.m_Width * params.m_Height; ++flat_location)
+        {
+            if(params.m_SampleCount[flat_location] < params.m_maxSamples)
+                active_pixels.push_back(flat_location);
+        }
+
+        std::vector<glm::uvec2> pixel_locations(std::min<size_t>(active_pixels.size(), kWavefrontBatchSize));
+        std::vector<uint32_t> sample_indices(pixel_locations.size());
+        std::vector<glm::vec3> pixel_results(pixel_locations.size());
+        std::vector<uint8_t> converged(active_pixels.size());
+        while(!active_pixels.empty() && !*should_quit)
+        {
+            // One pass adds a sample to every active pixel.
+            for(size_t batch_start = 0; batch_start < active_pixels.size() && !*should_quit; batch_start += kWavefrontBatchSize)
+            {
+                const uint32_t batch_size = static_cast<uint32_t>(std::min<size_t>(active_pixels.size() - batch_start, kWavefrontBatchSize));
+                for(uint32_t i = 0; i < batch_size; ++i)
+                {
+                    const uint32_t flat_location = active_pixels[batch_start + i];
+                    pixel_locations[i] = glm::uvec2(flat_location % params.m_Width, flat_location / params.m_Width);
+                    sample_indices[i] = params.m_SampleCount[flat_location];
+                }
+
+                integrator.integrate_pixels(camera, pixel_locations.data(), sample_indices.data(), batch_size, params.m_maxRayDepth, pixel_results.data());
+
+                for_each_chunk(&m_threadPool, batch_size, [&](const size_t, const size_t begin, const size_t end)
+                {
+                    for(size_t i = begin; i < end; ++i)
+                    {
+                        const uint32_t flat_location = active_pixels[batch_start + i];
+                        converged[batch_start + i] = accumulate_sample(params, flat_location, pixel_results[i]) ||
+                                                     params.m_SampleCount[flat_location] >= params.m_maxSamples;
+                    }
+                });
+
+                if(m_geometry_manager)
+                    m_geometry_manager->update();
+            }
+
+            size_t remaining = 0;
+            for(size_t i = 0; i < active_pixels.size(); ++i)
+            {
+                if(!converged[i])
+                    active_pixels[remaining++] = active_pixels[i];
+            }
+            active_pixels.resize(remaining);
+            converged.assign(remaining, 0);
+        }
+    }
+
     void Scene::render_scene_to_file(const Camera& camera, RenderParams& params, const char* path)
     {
         bool shouldQuit = false;
@@ -279,7 +433,7 @@ namespace Scene
                     else
                     {
                         normal[flat_location] = -ray.mDirection;
-                        position[flat_location] = ray.mDirection * ray.mLenght;
+                        position[flat_location] = ray.mDirection * camera.getFarPlane();
                         diffuse[flat_location] = m_sky_desc.m_sky_box->sample4(ray.mDirection);
                     }
                 }
@@ -310,7 +464,20 @@ namespace Scene
                                                  aiProcess_GenBoundingBoxes);
 
 
-        auto mesh_bvh = std::make_unique<Core::Acceleration_Structures::LowerLevelMeshBVH>(scene->mMeshes[0]);
+        Core::Acceleration_Structures::MeshBVHSettings bvh_settings{};
+        bvh_settings.m_cache_directory = m_bvh_cache_directory;
+        bvh_settings.m_build_mode = entry.isMember("Builder") ? get_bvh_build_mode(entry["Builder"].asString()) : m_bvh_build_mode;
+        if(entry.isMember("SpatialSplits"))
+            bvh_settings.m_spatial_splits = entry["SpatialSplits"].asBool();
+        if(entry.isMember("DuplicationBudget"))
+            bvh_settings.m_duplication_budget = entry["DuplicationBudget"].asFloat();
+        bvh_settings.m_compressed_nodes = entry.isMember("CompressedNodes") ? entry["CompressedNodes"].asBool() :
+                                                                              scene->mMeshes[0]->mNumFaces >= m_compressed_bvh_threshold;
+        if(entry.isMember("FlatNodes"))
+            bvh_settings.m_flat_nodes = entry["FlatNodes"].asBool();
+        bvh_settings.m_compressed_attributes = entry.isMember("CompressedAttributes") ? entry["CompressedAttributes"].asBool() : m_compress_vertex_attributes;
+        bvh_settings.m_out_of_core = m_geometry_budget > 0;
+        auto mesh_bvh = std::make_unique<Core::Acceleration_Structures::LowerLevelMeshBVH>(scene->mMeshes[0], &m_threadPool, bvh_settings);
 
         std::unique_lock l(m_SceneLoadingMutex);
         mInstanceIDs[name] = m_lowerLevelBVhs.size();
@@ -717,39 +884,218 @@ namespace Scene
 
         m_sky_desc.m_sky_box = mSkybox.get();
         m_sky_desc.m_use_sun = entry.isMember("SunDirection") && entry.isMember("SunColour");
+
+        if(entry.isMember("BVHBuilder"))
+        {
+            m_bvh_build_mode = get_bvh_build_mode(entry["BVHBuilder"].asString());
+        }
+
+        if(entry.isMember("BVHCache"))
+        {
+            m_bvh_cache_directory = mWorkingDir / entry["BVHCache"].asString();
+        }
+
+        if(entry.isMember("CompressedBVHThreshold"))
+        {
+            m_compressed_bvh_threshold = entry["CompressedBVHThreshold"].asUInt();
+        }
+
+        if(entry.isMember("CompressVertexAttributes"))
+        {
+            m_compress_vertex_attributes = entry["CompressVertexAttributes"].asBool();
+        }
+
+        if(entry.isMember("Sampler"))
+        {
+            m_sampler_type = get_sampler_type(entry["Sampler"].asString());
+        }
+
+        // In MB.
+        if(entry.isMember("GeometryBudget"))
+        {
+            m_geometry_budget = static_cast<size_t>(entry["GeometryBudget"].asUInt()) << 20;
+            if(m_bvh_cache_directory.empty())
+                m_bvh_cache_directory = mWorkingDir / "BVHCache";
+        }
+    }
+
+    void Scene::create_geometry_manager()
+    {
+        if(m_geometry_budget == 0)
+            return;
+
+        m_geometry_manager = std::make_unique<Core::GeometryManager>(m_geometry_budget);
+        for(auto& lower_level_bvh : m_lowerLevelBVhs)
+        {
+            auto* mesh = dynamic_cast<Core::Acceleration_Structures::LowerLevelMeshBVH*>(lower_level_bvh.get());
+            if(mesh && mesh->is_out_of_core())
+                m_geometry_manager->add_mesh(mesh);
+        }
+
+        // Bring the scene within budget before rendering starts.
+        m_geometry_manager->update();
+    }
+
+    Core::Rand::SamplerType Scene::get_sampler_type(const std::string& sampler) const
+    {
+        if(sampler == "Random")
+            return Core::Rand::SamplerType::kRandom;
+        else if(sampler == "Sobol")
+            return Core::Rand::SamplerType::kSobol;
+        else if(sampler == "BlueNoise")
+            return Core::Rand::SamplerType::kBlueNoise;
+
+        PICO_LOG("Unrecognised sampler %s, using the scene default\n", sampler.c_str());
+        return m_sampler_type;
+    }
+
+    InstanceFlattening Scene::get_instance_flattening(const std::string& mode) const
+    {
+        if(mode == "Never")
+            return InstanceFlattening::kNever;
+        else if(mode == "Auto")
+            return InstanceFlattening::kAuto;
+        else if(mode == "Always")
+            return InstanceFlattening::kAlways;
+
+        PICO_LOG("Unrecognised instance flattening mode %s, using the scene default\n", mode.c_str());
+        return m_instance_flattening;
+    }
+
+    Core::Acceleration_Structures::BVHBuildMode Scene::get_bvh_build_mode(const std::string& builder) const
+    {
+        if(builder == "SAH")
+            return Core::Acceleration_Structures::BVHBuildMode::kSAH;
+        else if(builder == "LBVH")
+            return Core::Acceleration_Structures::BVHBuildMode::kLBVH;
+        else if(builder == "PLOC")
+            return Core::Acceleration_Structures::BVHBuildMode::kPLOC;
+
+        PICO_LOG("Unrecognised BVH builder %s, using the scene default\n", builder.c_str());
+        return m_bvh_build_mode;
     }
 
     void Scene::parse_node(const aiScene* scene,
                           const aiNode* node,
                           const aiMatrix4x4& parentTransofrmation,
-                          std::vector<std::future<void>>& tasks)
+                          std::vector<Mesh_Instance>& instances)
     {
         aiMatrix4x4 transformation = parentTransofrmation * node->mTransformation;
 
-        auto add_mesh = [this](const aiMesh* mesh, uint32_t material_index, aiMatrix4x4 transformation)
+        for(uint32_t i = 0; i < node->mNumMeshes; ++i)
         {
-            std::unique_ptr<Core::Acceleration_Structures::LowerLevelBVH> meshBVH = std::make_unique<Core::Acceleration_Structures::LowerLevelMeshBVH>(mesh);
+            instances.push_back({node->mMeshes[i], transformation});
+        }
 
-            glm::mat4x4 transformationMatrix{};
-            transformationMatrix[0][0] = transformation.a1; transformationMatrix[0][1] = transformation.b1;  transformationMatrix[0][2] = transformation.c1; transformationMatrix[0][3] = transformation.d1;
-            transformationMatrix[1][0] = transformation.a2; transformationMatrix[1][1] = transformation.b2;  transformationMatrix[1][2] = transformation.c2; transformationMatrix[1][3] = transformation.d2;
-            transformationMatrix[2][0] = transformation.a3; transformationMatrix[2][1] = transformation.b3;  transformationMatrix[2][2] = transformation.c3; transformationMatrix[2][3] = transformation.d3;
-            transformationMatrix[3][0] = transformation.a4; transformationMatrix[3][1] = transformation.b4;  transformationMatrix[3][2] = transformation.c4; transformationMatrix[3][3] = transformation.d4;
+        // Recurse through all child nodes
+        for(uint32_t i = 0; i < node->mNumChildren; ++i)
+        {
+            parse_node(scene,
+                       node->mChildren[i],
+                       transformation,
+                       instances);
+        }
+    }
+
+    void Scene::add_mesh_instances(const aiScene* scene, const std::vector<Mesh_Instance>& instances)
+    {
+        std::vector<uint32_t> reference_counts(scene->mNumMeshes, 0);
+        for(const Mesh_Instance& instance : instances)
+            ++reference_counts[instance.m_mesh_index];
+
+        // Lights keep their own instances so they are sampled as before.
+        auto can_flatten = [this, scene, &reference_counts](const Mesh_Instance& instance)
+        {
+            const aiMesh* mesh = scene->mMeshes[instance.m_mesh_index];
+            return reference_counts[instance.m_mesh_index] == 1 && !m_material_manager.get_material(mesh->mMaterialIndex)->is_light();
+        };
 
-        bool is_light;
+        bool flatten = m_instance_flattening == InstanceFlattening::kAlways;
+        if(m_instance_flattening == InstanceFlattening::kAuto)
         {
-            std::shared_lock l(this->m_SceneLoadingMutex);
-            is_light = this->m_material_manager.get_material(material_index)->is_light();
+            const size_t single_use_count = std::count_if(instances.begin(), instances.end(), can_flatten);
+            flatten = single_use_count * 2 > instances.size();
         }
 
-            std::unique_ptr<Render::BSRDF> brdf;
+        // Flattened instances are grouped by material as each top level instance has a single BSRDF.
+        std::map<uint32_t, std::vector<const Mesh_Instance*>> flattened_groups;
+        std::vector<const Mesh_Instance*> remaining_instances;
+        for(const Mesh_Instance& instance : instances)
+        {
+            if(flatten && can_flatten(instance))
+                flattened_groups[scene->mMeshes[instance.m_mesh_index]->mMaterialIndex].push_back(&instance);
+            else
+                remaining_instances.push_back(&instance);
+        }
+
+        // Nodes often reference the same mesh many times, each one is only built once and shared by its instances.
+        std::vector<Core::Acceleration_Structures::LowerLevelBVH*> mesh_bvhs(scene->mNumMeshes, nullptr);
+        std::vector<Core::Acceleration_Structures::LowerLevelBVH*> flattened_bvhs(flattened_groups.size(), nullptr);
+        std::vector<bool> referenced(scene->mNumMeshes, false);
+        for(const Mesh_Instance* instance : remaining_instances)
+            referenced[instance->m_mesh_index] = true;
+
+        // Each task only writes its own slot of mesh_bvhs or flattened_bvhs.
+        auto build_mesh = [this](const aiMesh* mesh, Core::Acceleration_Structures::LowerLevelBVH** slot)
+        {
+            Core::Acceleration_Structures::MeshBVHSettings bvh_settings{};
+            bvh_settings.m_build_mode = m_bvh_build_mode;
+            bvh_settings.m_cache_directory = m_bvh_cache_directory;
+            bvh_settings.m_compressed_nodes = mesh->mNumFaces >= m_compressed_bvh_threshold;
+            bvh_settings.m_compressed_attributes = m_compress_vertex_attributes;
+            bvh_settings.m_out_of_core = m_geometry_budget > 0;
+            std::unique_ptr<Core::Acceleration_Structures::LowerLevelBVH> meshBVH = std::make_unique<Core::Acceleration_Structures::LowerLevelMeshBVH>(mesh, &m_threadPool, bvh_settings);
+
+            bool is_light;
+            {
+                std::shared_lock l(this->m_SceneLoadingMutex);
+                is_light = this->m_material_manager.get_material(mesh->mMaterialIndex)->is_light();
+            }
+
             if(is_light)
+                meshBVH->generate_sampling_data();
+
+            *slot = meshBVH.get();
+
+            std::unique_lock l(this->m_SceneLoadingMutex);
+            m_lowerLevelBVhs.push_back(std::move(meshBVH));
+        };
+
+        auto build_flattened_mesh = [scene, &build_mesh](const std::vector<const Mesh_Instance*>* group, Core::Acceleration_Structures::LowerLevelBVH** slot)
+        {
+            const std::unique_ptr<aiMesh> mesh = create_flattened_mesh(scene, *group);
+            build_mesh(mesh.get(), slot);
+        };
+
+        std::vector<std::future<void>> handles{};
+        uint32_t mesh_count = 0;
+        for(uint32_t i = 0; i < scene->mNumMeshes; ++i)
+        {
+            if(!referenced[i])
+                continue;
+
+            handles.push_back(m_threadPool.add_task(build_mesh, scene->mMeshes[i], &mesh_bvhs[i]));
+            ++mesh_count;
+        }
+
+        uint32_t group_index = 0;
+        for(const auto& [material_index, group] : flattened_groups)
+            handles.push_back(m_threadPool.add_task(build_flattened_mesh, &group, &flattened_bvhs[group_index++]));
+
+        m_threadPool.wait_for_work_to_finish(handles);
+
+        PICO_LOG("Added %zu mesh instances sharing %u BVHs\n", remaining_instances.size(), mesh_count);
+        if(!flattened_groups.empty())
+            PICO_LOG("Flattened %zu single use mesh instances in to %zu world space meshes\n", instances.size() - remaining_instances.size(), flattened_groups.size());
+
+        auto add_instance = [this](Core::Acceleration_Structures::LowerLevelBVH* meshBVH, const glm::mat4x4& transformationMatrix, const uint32_t material_index)
+        {
+            std::unique_ptr<Render::BSRDF> brdf;
+            if(m_material_manager.get_material(material_index)->is_light())
             {
                 brdf = std::make_unique<Render::Light_BRDF>(this->m_material_manager, material_index);
 
-                meshBVH->generate_sampling_data();
-                std::unique_lock l(this->m_SceneLoadingMutex);
-                m_lights.push_back({ transformationMatrix, glm::inverse(transformationMatrix), meshBVH.get() });
+                m_lights.push_back({ transformationMatrix, glm::inverse(transformationMatrix), meshBVH });
             }
             else
             {
@@ -759,27 +1105,99 @@ namespace Scene
                 brdf = std::make_unique<Render::Dielectric_BRDF>(diffuse_distribution, specular_distribution, this->m_material_manager, material_index);
             }
 
-            std::unique_lock l(this->m_SceneLoadingMutex);
-            m_bvh.add_lower_level_bvh(meshBVH.get(), transformationMatrix, brdf);
-            m_lowerLevelBVhs.push_back(std::move(meshBVH));
+            m_bvh.add_lower_level_bvh(meshBVH, transformationMatrix, brdf);
         };
 
+        for(const Mesh_Instance* instance : remaining_instances)
         {
-            std::shared_lock l(this->m_SceneLoadingMutex);
-            for(uint32_t i = 0; i < node->mNumMeshes; ++i)
-            {
-                tasks.push_back(m_threadPool.add_task(add_mesh, scene->mMeshes[node->mMeshes[i]], scene->mMeshes[node->mMeshes[i]]->mMaterialIndex, transformation));
-            }
+            const aiMatrix4x4& transformation = instance->m_transformation;
+
+            glm::mat4x4 transformationMatrix{};
+            transformationMatrix[0][0] = transformation.a1; transformationMatrix[0][1] = transformation.b1;  transformationMatrix[0][2] = transformation.c1; transformationMatrix[0][3] = transformation.d1;
+            transformationMatrix[1][0] = transformation.a2; transformationMatrix[1][1] = transformation.b2;  transformationMatrix[1][2] = transformation.c2; transformationMatrix[1][3] = transformation.d2;
+            transformationMatrix[2][0] = transformation.a3; transformationMatrix[2][1] = transformation.b3;  transformationMatrix[2][2] = transformation.c3; transformationMatrix[2][3] = transformation.d3;
+            transformationMatrix[3][0] = transformation.a4; transformationMatrix[3][1] = transformation.b4;  transformationMatrix[3][2] = transformation.c4; transformationMatrix[3][3] = transformation.d4;
+
+            add_instance(mesh_bvhs[instance->m_mesh_index], transformationMatrix, scene->mMeshes[instance->m_mesh_index]->mMaterialIndex);
         }
 
-        // Recurse through all child nodes
-        for(uint32_t i = 0; i < node->mNumChildren; ++i)
+        group_index = 0;
+        for(const auto& [material_index, group] : flattened_groups)
+            add_instance(flattened_bvhs[group_index++], glm::mat4x4(1.0f), material_index);
+    }
+
+    std::unique_ptr<aiMesh> Scene::create_flattened_mesh(const aiScene* scene, const std::vector<const Mesh_Instance*>& instances)
+    {
+        uint32_t vertex_count = 0;
+        uint32_t face_count = 0;
+        bool has_uvs = false;
+        bool has_colours = false;
+        for(const Mesh_Instance* instance : instances)
         {
-            parse_node(scene,
-                       node->mChildren[i],
-                       transformation,
-                       tasks);
+            const aiMesh* mesh = scene->mMeshes[instance->m_mesh_index];
+            vertex_count += mesh->mNumVertices;
+            face_count += mesh->mNumFaces;
+            has_uvs |= mesh->mTextureCoords[0] != nullptr;
+            has_colours |= mesh->mColors[0] != nullptr;
         }
+
+        // aiMesh frees the arrays.
+        auto flattened = std::make_unique<aiMesh>();
+        flattened->mName = aiString(std::string(scene->mMeshes[instances.front()->m_mesh_index]->mName.C_Str()) + " (flattened)");
+        flattened->mMaterialIndex = scene->mMeshes[instances.front()->m_mesh_index]->mMaterialIndex;
+        flattened->mNumVertices = vertex_count;
+        flattened->mVertices = new aiVector3D[vertex_count];
+        flattened->mNormals = new aiVector3D[vertex_count];
+        if(has_uvs)
+        {
+            flattened->mTextureCoords[0] = new aiVector3D[vertex_count];
+            flattened->mNumUVComponents[0] = 2;
+        }
+        if(has_colours)
+            flattened->mColors[0] = new aiColor4D[vertex_count];
+        flattened->mNumFaces = face_count;
+        flattened->mFaces = new aiFace[face_count];
+
+        aiVector3D min(INFINITY, INFINITY, INFINITY);
+        aiVector3D max(-INFINITY, -INFINITY, -INFINITY);
+        uint32_t first_vertex = 0;
+        uint32_t first_face = 0;
+        for(const Mesh_Instance* instance : instances)
+        {
+            const aiMesh* mesh = scene->mMeshes[instance->m_mesh_index];
+
+            // Normals are moved by the inverse transpose.
+            const aiMatrix3x3 normal_transformation = aiMatrix3x3(instance->m_transformation).Inverse().Transpose();
+            for(uint32_t v = 0; v < mesh->mNumVertices; ++v)
+            {
+                const aiVector3D position = instance->m_transformation * mesh->mVertices[v];
+                flattened->mVertices[first_vertex + v] = position;
+                min = aiVector3D(std::min(min.x, position.x), std::min(min.y, position.y), std::min(min.z, position.z));
+                max = aiVector3D(std::max(max.x, position.x), std::max(max.y, position.y), std::max(max.z, position.z));
+
+                flattened->mNormals[first_vertex + v] = (normal_transformation * mesh->mNormals[v]).NormalizeSafe();
+                if(has_uvs)
+                    flattened->mTextureCoords[0][first_vertex + v] = mesh->mTextureCoords[0] ? mesh->mTextureCoords[0][v] : aiVector3D(0.0f, 0.0f, 0.0f);
+                if(has_colours)
+                    flattened->mColors[0][first_vertex + v] = mesh->mColors[0] ? mesh->mColors[0][v] : aiColor4D(1.0f, 1.0f, 1.0f, 1.0f);
+            }
+
+            for(uint32_t f = 0; f < mesh->mNumFaces; ++f)
+            {
+                const aiFace& face = mesh->mFaces[f];
+                aiFace& flattened_face = flattened->mFaces[first_face + f];
+                flattened_face.mNumIndices = face.mNumIndices;
+                flattened_face.mIndices = new unsigned int[face.mNumIndices];
+                for(uint32_t i = 0; i < face.mNumIndices; ++i)
+                    flattened_face.mIndices[i] = face.mIndices[i] + first_vertex;
+            }
+
+            first_vertex += mesh->mNumVertices;
+            first_face += mesh->mNumFaces;
+        }
+        flattened->mAABB = aiAABB(min, max);
+
+        return flattened;
     }
 
     void Scene::add_material(const aiMaterial* material)
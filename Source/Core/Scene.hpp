@@ -3,6 +3,7 @@
 
 #include "json/json.h"
 #include "Core/RandUtils.hpp"
+#include "Core/Sampler.hpp"
 #include "assimp/Importer.hpp"
 #include "assimp/scene.h"
 
@@ -10,8 +11,10 @@
 #include "Core/BVH.hpp"
 #include "Core/ThreadPool.hpp"
 #include "Core/LowerLevelBVH.hpp"
+#include "Core/LowerLevelMeshBVH.hpp"
 #include "Core/UpperLevelBVH.hpp"
 #include "Core/MaterialManager.hpp"
+#include "Core/GeometryManager.hpp"
 #include "Core/FileMappings.hpp"
 #include "Util/Options.hpp"
 #include "Camera.hpp"
@@ -36,6 +39,8 @@ namespace Scene
         uint32_t m_Width;
         bool     m_tonemap;
         bool     m_denoise;
+        bool     m_wavefront; // Use the Wavefront_Integrator over the whole image rather than tracing packets per tile.
+        bool     m_sort_rays; // Sort the Wavefront_Integrator's rays before traversal and its hits before shading.
 
         glm::vec3* m_Pixels;
         uint32_t*  m_SampleCount;
@@ -49,6 +54,15 @@ namespace Scene
         Core::Acceleration_Structures::LowerLevelBVH* m_geometry;
     };
 
+    // Whether meshes that are only referenced once are moved in to world space and merged, so the top level
+    // BVH only has to deal with genuinely instanced meshes.
+    enum class InstanceFlattening
+    {
+        kNever,
+        kAuto, // When most instances are of single use meshes.
+        kAlways
+    };
+
     struct Sun
     {
         Core::ImageCube* m_sky_box;
@@ -87,6 +101,9 @@ namespace Scene
             glm::vec3* diffuse;
         };
 
+        // Renders passes of one sample per unconverged pixel with the Wavefront_Integrator.
+        void render_wavefront(const Camera&, const RenderParams&, const Core::Rand::Sampler&, const bool* should_quit);
+
         denoiser_inputs generate_denoiser_inputs(const Camera&, Core::Rand::xorshift_random random_generator, const glm::uvec2&) const;
 
         // Scene loading functions
@@ -96,21 +113,55 @@ namespace Scene
         void add_camera(const std::string& name, const Json::Value& entry);
         void process_globals(const std::string& name, const Json::Value& entry);
 
+        // A node's reference to one of the aiScene's meshes.
+        struct Mesh_Instance
+        {
+            uint32_t    m_mesh_index;
+            aiMatrix4x4 m_transformation;
+        };
+
         void parse_node(const aiScene* scene,
                               const aiNode* node,
                               const aiMatrix4x4& parentTransofrmation,
-                              std::vector<std::future<void>>& tasks);
+                              std::vector<Mesh_Instance>& instances);
+
+        // Builds one BVH per referenced mesh, in parallel, and adds every instance of it to the scene. Single use
+        // meshes that get flattened are instead merged per material in to world space meshes with one instance each.
+        void add_mesh_instances(const aiScene* scene, const std::vector<Mesh_Instance>& instances);
+
+        // Returns a mesh holding the triangles of every instance, moved in to world space.
+        static std::unique_ptr<aiMesh> create_flattened_mesh(const aiScene* scene, const std::vector<const Mesh_Instance*>& instances);
         void add_material(const aiMaterial*);
 
+        // Hands the out of core meshes to m_geometry_manager once they have all been loaded.
+        void create_geometry_manager();
+
+        Core::Acceleration_Structures::BVHBuildMode get_bvh_build_mode(const std::string& builder) const;
+        InstanceFlattening get_instance_flattening(const std::string& mode) const;
+        Core::Rand::SamplerType get_sampler_type(const std::string& sampler) const;
+
         std::filesystem::path mWorkingDir;
         std::shared_mutex m_SceneLoadingMutex;
         std::unordered_map<std::string, Camera>  mCamera;
         std::unordered_map<std::string, uint32_t> mInstanceIDs;
         std::unordered_map<std::string, uint32_t> mMaterials;
         std::vector<std::unique_ptr<Core::Acceleration_Structures::LowerLevelBVH>> m_lowerLevelBVhs;
+        // Used for meshes that don't pick their own builder.
+        Core::Acceleration_Structures::BVHBuildMode m_bvh_build_mode = Core::Acceleration_Structures::BVHBuildMode::kSAH;
+        // Mesh BVHs are cached here between runs when set.
+        std::filesystem::path m_bvh_cache_directory;
+        // Meshes with at least this many triangles use compressed BVH nodes unless they pick for themselves.
+        uint32_t m_compressed_bvh_threshold = ~0u;
+        // Mesh vertex attributes are stored compressed unless they pick for themselves.
+        bool m_compress_vertex_attributes = false;
+        // Meshes are paged from their cache files and kept within this many bytes when set, 0 keeps them in memory.
+        size_t m_geometry_budget = 0;
+        InstanceFlattening m_instance_flattening = InstanceFlattening::kAuto;
+        Core::Rand::SamplerType m_sampler_type = Core::Rand::SamplerType::kSobol;
 
         Core::Acceleration_Structures::UpperLevelBVH m_bvh;
         Core::MaterialManager m_material_manager;
+        std::unique_ptr<Core::GeometryManager> m_geometry_manager;
         std::vector<Light> m_lights;
 
         ThreadPool& m_threadPool;
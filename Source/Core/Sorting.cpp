@@ -0,0 +1,90 @@
+#include "Sorting.hpp"
+#include "Core/ThreadPool.hpp"
+
+#include <array>
+
+#include "glm/common.hpp"
+
+namespace
+{
+    // Spreads the low 21 bits of v out so there are two zero bits between each of them.
+    uint64_t expand_bits(uint64_t v)
+    {
+        v &= 0x1fffff;
+        v = (v | v << 32) & 0x1f00000000ffff;
+        v = (v | v << 16) & 0x1f0000ff0000ff;
+        v = (v | v << 8) & 0x100f00f00f00f00f;
+        v = (v | v << 4) & 0x10c30c30c30c30c3;
+        v = (v | v << 2) & 0x1249249249249249;
+
+        return v;
+    }
+}
+
+namespace Core
+{
+
+    uint64_t morton_code(const glm::vec3& offset, const uint32_t bits_per_axis)
+    {
+        const glm::vec3 quantised = glm::clamp(offset, 0.0f, 1.0f) * float((1u << bits_per_axis) - 1);
+
+        return (expand_bits(uint64_t(quantised.x)) << 2) | (expand_bits(uint64_t(quantised.y)) << 1) | expand_bits(uint64_t(quantised.z));
+    }
+
+    std::vector<uint32_t> radix_sort(std::vector<uint64_t>& codes, const uint32_t key_bits, ThreadPool* pool)
+    {
+        constexpr uint32_t kRadixBits = 8;
+        constexpr uint32_t kRadixSize = 1u << kRadixBits;
+
+        const size_t count = codes.size();
+        const size_t chunk_count = get_chunk_count(pool);
+
+        std::vector<uint32_t> indices(count);
+        std::vector<uint32_t> scratch_indices(count);
+        std::vector<uint64_t> scratch_codes(count);
+        for_each_chunk(pool, count, [&](const size_t, const size_t begin, const size_t end)
+        {
+            for(size_t i = begin; i < end; ++i)
+                indices[i] = i;
+        });
+
+        std::vector<std::array<uint32_t, kRadixSize>> offsets(chunk_count);
+        for(uint32_t shift = 0; shift < key_bits; shift += kRadixBits)
+        {
+            for_each_chunk(pool, count, [&](const size_t chunk, const size_t begin, const size_t end)
+            {
+                offsets[chunk].fill(0);
+                for(size_t i = begin; i < end; ++i)
+                    ++offsets[chunk][(codes[i] >> shift) & (kRadixSize - 1)];
+            });
+
+            // Each chunk scatters after the chunks before it for the same digit, which keeps the sort stable.
+            uint32_t total = 0;
+            for(uint32_t digit = 0; digit < kRadixSize; ++digit)
+            {
+                for(size_t chunk = 0; chunk < chunk_count; ++chunk)
+                {
+                    const uint32_t digit_count = offsets[chunk][digit];
+                    offsets[chunk][digit] = total;
+                    total += digit_count;
+                }
+            }
+
+            for_each_chunk(pool, count, [&](const size_t chunk, const size_t begin, const size_t end)
+            {
+                for(size_t i = begin; i < end; ++i)
+                {
+                    const uint32_t destination = offsets[chunk][(codes[i] >> shift) & (kRadixSize - 1)]++;
+                    scratch_codes[destination] = codes[i];
+                    scratch_indices[destination] = indices[i];
+                }
+            });
+
+            codes.swap(scratch_codes);
+            indices.swap(scratch_indices);
+        }
+
+        return indices;
+    }
+
+}
@@ -0,0 +1,23 @@
+#ifndef PICO_SORTING_HPP
+#define PICO_SORTING_HPP
+
+#include <cstdint>
+#include <vector>
+
+#include "glm/vec3.hpp"
+
+class ThreadPool;
+
+
+namespace Core
+{
+
+    // offset is a position within some bounds, in [0, 1]. At most 21 bits per axis.
+    uint64_t morton_code(const glm::vec3& offset, const uint32_t bits_per_axis);
+
+    // Stable LSD radix sort of codes, 8 bits per pass. Returns the original index of each sorted code.
+    std::vector<uint32_t> radix_sort(std::vector<uint64_t>& codes, const uint32_t key_bits, ThreadPool* pool);
+
+}
+
+#endif
@@ -1,6 +1,10 @@
 #ifndef THREAD_POOL_HPP
 #define THREAD_POOL_HPP
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
 #include <functional>
 #include <future>
 #include <thread>
@@ -22,7 +26,7 @@ public:
             mWorkToDo{false} {}
 
         using Task = std::function<void()>;
-        std::vector<Task> mQueue;
+        std::deque<Task> mQueue;
         std::mutex mLock;
         std::condition_variable mCondVar;
         bool mWorkToDo;
@@ -47,12 +51,19 @@ public:
                         std::unique_lock<std::mutex> lk(queue.mLock);
                         queue.mCondVar.wait(lk, [&](){ return queue.mWorkToDo; });
 
-                        std::vector<Queue::Task> tasks{};
-                        queue.mQueue.swap(tasks);
-                        queue.mWorkToDo = false;
+                        // Take one task at a time so threads waiting on other tasks can run the rest.
+                        if(queue.mQueue.empty())
+                        {
+                            queue.mWorkToDo = false;
+                            continue;
+                        }
+
+                        Queue::Task task = std::move(queue.mQueue.front());
+                        queue.mQueue.pop_front();
+                        queue.mWorkToDo = !queue.mQueue.empty();
                         lk.unlock();
-                        for(auto& task : tasks)
-                            task();
+
+                        task();
                     }
 
                 }
@@ -94,8 +105,7 @@ public:
             (*task)();
             delete task;
         };
-        Queue& queue = mQueues[mLastTaskAddedindex];
-        mLastTaskAddedindex = (mLastTaskAddedindex + 1) % mWorkers.size();
+        Queue& queue = mQueues[mLastTaskAddedindex++ % mWorkers.size()];
 
         std::unique_lock<std::mutex> lock(queue.mLock);
         queue.mQueue.push_back(std::move(work_unit));
@@ -105,19 +115,52 @@ public:
         return future;
     }
 
+    // Runs a single queued task on the calling thread, returns false if there was nothing to run.
+    bool run_pending_task()
+    {
+        for(auto& queue : mQueues)
+        {
+            std::unique_lock<std::mutex> lock(queue.mLock, std::try_to_lock);
+            if(!lock.owns_lock() || queue.mQueue.empty())
+                continue;
+
+            Queue::Task task = std::move(queue.mQueue.front());
+            queue.mQueue.pop_front();
+            queue.mWorkToDo = !queue.mQueue.empty();
+            lock.unlock();
+
+            task();
+
+            return true;
+        }
+
+        return false;
+    }
+
+    // Helps with queued work while waiting, so tasks can safely wait on tasks they added.
+    template<typename T>
+    void wait_for_task(const std::future<T>& handle)
+    {
+        while(handle.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+        {
+            if(!run_pending_task())
+                handle.wait_for(std::chrono::microseconds(100));
+        }
+    }
+
     template<typename T>
     void wait_for_work_to_finish(const std::vector<std::future<T>>& handles)
     {
         for(const auto& handle : handles)
         {
-            handle.wait();
+            wait_for_task(handle);
         }
     }
 
 private:
 
-    bool mExit;
-    uint32_t mLastTaskAddedindex;
+    std::atomic<bool> mExit;
+    std::atomic<uint32_t> mLastTaskAddedindex;
 
     std::vector<std::thread> mWorkers;
 
@@ -125,5 +168,34 @@ private:
 
 };
 
+inline size_t get_chunk_count(ThreadPool* pool)
+{
+    return pool ? pool->get_worker_count() + 1 : 1;
+}
+
+// Splits [0, count) in to one chunk per worker plus one for the calling thread, which processes
+// its chunk before waiting on the rest. Everything runs on the calling thread without a pool.
+template<typename F>
+void for_each_chunk(ThreadPool* pool, const size_t count, F&& process_chunk)
+{
+    const size_t chunk_count = get_chunk_count(pool);
+    const size_t chunk_size = (count + chunk_count - 1) / chunk_count;
+
+    std::vector<std::future<void>> handles;
+    handles.reserve(chunk_count - 1);
+    for(size_t chunk = 0; chunk < chunk_count - 1; ++chunk)
+    {
+        const size_t begin = std::min(chunk * chunk_size, count);
+        const size_t end = std::min(begin + chunk_size, count);
+        handles.push_back(pool->add_task([&process_chunk, chunk, begin, end]() { process_chunk(chunk, begin, end); }));
+    }
+
+    const size_t begin = std::min((chunk_count - 1) * chunk_size, count);
+    process_chunk(chunk_count - 1, begin, count);
+
+    if(pool)
+        pool->wait_for_work_to_finish(handles);
+}
+
 
 #endif
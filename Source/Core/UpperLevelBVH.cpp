@@ -5,33 +5,236 @@
 
 #include <iterator>
 
+namespace
+{
+    // update rebuilds everything once refitting has raised the SAH cost past this multiple of the built cost.
+    constexpr float kRebuildSAHThreshold = 1.5f;
+
+    // Or once added or removed instances make up more than 1 / kRebuildInstanceFraction of the total.
+    constexpr size_t kRebuildInstanceFraction = 8;
+}
+
 namespace Core
 {
     namespace Acceleration_Structures
     {
+        UpperLevelBVH::~UpperLevelBVH()
+        {
+            delete m_acceleration_structure;
+            delete m_added_acceleration_structure;
+        }
+
         bool UpperLevelBVH::get_closest_intersection(Ray& ray, InterpolatedVertex* vertex) const
         {
-            InterpolatedVertex intersected_vertex{};
-            const bool found = m_acceleration_structure->get_first_intersection(ray, intersected_vertex);
-            if(found)
-                *vertex = intersected_vertex;
+            // Every level culls against hit.m_distance, so start from the ray length rather than infinity.
+            HitRecord hit{ray.mLenght, kInvalidNodeIndex, kInvalidNodeIndex, glm::vec2(0.0f, 0.0f)};
+            bool found = m_acceleration_structure && m_acceleration_structure->get_first_intersection(ray, hit);
+            found |= m_added_acceleration_structure && m_added_acceleration_structure->get_first_intersection(ray, hit);
+            if(!found)
+                return false;
+
+            // Only the closest hit has its vertex attributes interpolated.
+            const Entry& entry = *mLowerLevelBVHs[hit.m_instance];
+            const Ray object_space_ray = Core::transform_ray(ray, entry.mInverseTransform);
+
+            *vertex = entry.mBVH->interpolate_hit(object_space_ray, hit);
+            vertex->m_bsrdf = entry.m_material.get();
+
+            // Bring vertex back to world space.
+            to_world_space(entry, *vertex);
+
+            return true;
+        }
+
+        void UpperLevelBVH::to_world_space(const Entry& entry, InterpolatedVertex& vertex)
+        {
+            if(entry.mTransform.m_type == Affine_Transform::Type::kIdentity)
+                return;
+
+            vertex.mPosition = glm::vec4(entry.mTransform.transform_point(glm::vec3(vertex.mPosition)), 1.0f);
+
+            // Normals are moved by the inverse transpose, which only changes their direction when there's a
+            // rotation or non uniform scale.
+            if(entry.mTransform.m_type == Affine_Transform::Type::kGeneral)
+                vertex.mNormal = glm::normalize(entry.mInverseTransform.transform_transposed(vertex.mNormal));
+        }
+
+        bool UpperLevelBVH::is_occluded(Ray& ray, const float max_distance) const
+        {
+            return (m_acceleration_structure && m_acceleration_structure->is_occluded(ray, max_distance)) ||
+                   (m_added_acceleration_structure && m_added_acceleration_structure->is_occluded(ray, max_distance));
+        }
+
+        uint32_t UpperLevelBVH::get_closest_intersections(Ray* rays, const uint32_t ray_mask, InterpolatedVertex* vertices) const
+        {
+            HitRecord hits[kRayPacketSize];
+            for(uint32_t mask = ray_mask; mask != 0; mask &= mask - 1)
+            {
+                const uint32_t r = std::countr_zero(mask);
+                hits[r] = HitRecord{rays[r].mLenght, kInvalidNodeIndex, kInvalidNodeIndex, glm::vec2(0.0f, 0.0f)};
+            }
+
+            uint32_t found = m_acceleration_structure ? m_acceleration_structure->get_first_intersections(rays, ray_mask, hits) : 0;
+            if(m_added_acceleration_structure)
+                found |= m_added_acceleration_structure->get_first_intersections(rays, ray_mask, hits);
+
+            for(uint32_t mask = found; mask != 0; mask &= mask - 1)
+            {
+                const uint32_t r = std::countr_zero(mask);
+                const Entry& entry = *mLowerLevelBVHs[hits[r].m_instance];
+                const Ray object_space_ray = Core::transform_ray(rays[r], entry.mInverseTransform);
+
+                vertices[r] = entry.mBVH->interpolate_hit(object_space_ray, hits[r]);
+                vertices[r].m_bsrdf = entry.m_material.get();
+
+                to_world_space(entry, vertices[r]);
+            }
 
             return found;
         }
 
-        void UpperLevelBVH::add_lower_level_bvh(LowerLevelBVH* bvh, const glm::mat4x4& transform, std::unique_ptr<Render::BSRDF>& bssrdf)
+        uint32_t UpperLevelBVH::are_occluded(Ray* rays, const uint32_t ray_mask, const float* max_distances) const
+        {
+            uint32_t occluded = m_acceleration_structure ? m_acceleration_structure->are_occluded(rays, ray_mask, max_distances) : 0;
+            if(m_added_acceleration_structure && occluded != ray_mask)
+                occluded |= m_added_acceleration_structure->are_occluded(rays, ray_mask & ~occluded, max_distances);
+
+            return occluded;
+        }
+
+        uint32_t UpperLevelBVH::add_lower_level_bvh(LowerLevelBVH* bvh, const glm::mat4x4& transform, std::unique_ptr<Render::BSRDF>& bssrdf)
+        {
+            uint32_t instance_id = static_cast<uint32_t>(mLowerLevelBVHs.size());
+            if(!m_free_instance_ids.empty())
+            {
+                instance_id = m_free_instance_ids.back();
+                m_free_instance_ids.pop_back();
+            }
+            else
+            {
+                mLowerLevelBVHs.push_back(std::make_unique<Entry>());
+            }
+
+            *mLowerLevelBVHs[instance_id] = Entry{Affine_Transform(transform), Affine_Transform(transform).get_inverse(), bvh, std::move(bssrdf), instance_id};
+
+            // Before the first build everything goes in to the main tree.
+            if(m_acceleration_structure)
+                m_added_instance_ids.push_back(instance_id);
+
+            return instance_id;
+        }
+
+        void UpperLevelBVH::remove_lower_level_bvh(const uint32_t instance_id)
+        {
+            PICO_ASSERT(instance_id < mLowerLevelBVHs.size() && mLowerLevelBVHs[instance_id]->mBVH);
+
+            // The trees can still reach the entry until they are rebuilt, so it's kept as a placeholder that
+            // never gets hit.
+            Entry& entry = *mLowerLevelBVHs[instance_id];
+            entry.mBVH = nullptr;
+            entry.m_material.reset();
+            ++m_removed_instance_count;
+        }
+
+        void UpperLevelBVH::set_transform(const uint32_t instance_id, const glm::mat4x4& transform)
+        {
+            PICO_ASSERT(instance_id < mLowerLevelBVHs.size() && mLowerLevelBVHs[instance_id]->mBVH);
+
+            // Moving the entry now would leave it outside the bounds the trees hold for it.
+            m_pending_transforms.emplace_back(instance_id, Affine_Transform(transform));
+        }
+
+        void UpperLevelBVH::apply_pending_transforms()
+        {
+            for(const auto& [instance_id, transform] : m_pending_transforms)
+            {
+                Entry& entry = *mLowerLevelBVHs[instance_id];
+                entry.mTransform = transform;
+                entry.mInverseTransform = transform.get_inverse();
+            }
+
+            m_pending_transforms.clear();
+        }
+
+        void UpperLevelBVH::build(ThreadPool* thread_pool)
         {
-            mLowerLevelBVHs.push_back(Entry{transform, glm::inverse(transform), bvh, std::move(bssrdf)});
+            apply_pending_transforms();
+
+            delete m_acceleration_structure;
+            delete m_added_acceleration_structure;
+            m_added_acceleration_structure = nullptr;
+            m_added_instance_ids.clear();
+
+            // Removed entries are left out, so nothing references them any more and their ids can be reused.
+            std::vector<const Entry*> entries;
+            entries.reserve(mLowerLevelBVHs.size());
+            m_free_instance_ids.clear();
+            for(const auto& entry : mLowerLevelBVHs)
+            {
+                if(entry->mBVH)
+                    entries.push_back(entry.get());
+                else
+                    m_free_instance_ids.push_back(entry->m_instance_id);
+            }
+            m_removed_instance_count = 0;
+
+            m_acceleration_structure = generate_acceleration_structure(entries, thread_pool);
+            m_built_sah_cost = m_acceleration_structure ? m_acceleration_structure->get_sah_cost() : 0.0f;
         }
 
-        void UpperLevelBVH::build()
+        void UpperLevelBVH::update(ThreadPool* thread_pool)
         {
-            std::vector<UPPER_ACCELERATION_STRUCTURE::BoundedValue> values;
-            values.reserve(mLowerLevelBVHs.size());
+            const size_t instance_count = mLowerLevelBVHs.size() - m_free_instance_ids.size() - m_removed_instance_count;
+            if(!m_acceleration_structure ||
+               (m_added_instance_ids.size() + m_removed_instance_count) * kRebuildInstanceFraction > instance_count)
+            {
+                build(thread_pool);
+                return;
+            }
 
-            std::transform(mLowerLevelBVHs.begin(), mLowerLevelBVHs.end(), std::back_inserter(values), [](const auto& entry) -> UPPER_ACCELERATION_STRUCTURE::BoundedValue
+            apply_pending_transforms();
+
+            // Removed instances are refit around nothing so traversal skips them.
+            const Bounds_Function<const Entry*> get_entry_bounds = [](const Entry* const& entry)
             {
-                return { entry.mBVH->get_bounds() * entry.mTransform, &entry };
+                if(!entry->mBVH)
+                    return AABB(glm::vec4(INFINITY, INFINITY, INFINITY, 1.0f), glm::vec4(-INFINITY, -INFINITY, -INFINITY, 1.0f));
+
+                return entry->mBVH->get_bounds() * entry->mTransform;
+            };
+
+            // Structures that can't be refit return false.
+            if(!m_acceleration_structure->refit(get_entry_bounds, thread_pool) ||
+               m_acceleration_structure->get_sah_cost() > m_built_sah_cost * kRebuildSAHThreshold)
+            {
+                build(thread_pool);
+                return;
+            }
+
+            std::vector<const Entry*> added_entries;
+            added_entries.reserve(m_added_instance_ids.size());
+            for(const uint32_t instance_id : m_added_instance_ids)
+            {
+                if(mLowerLevelBVHs[instance_id]->mBVH)
+                    added_entries.push_back(mLowerLevelBVHs[instance_id].get());
+            }
+
+            // Few enough instances are added between rebuilds that rebuilding their tree is cheaper than tracking it.
+            delete m_added_acceleration_structure;
+            m_added_acceleration_structure = generate_acceleration_structure(added_entries, thread_pool);
+        }
+
+        auto UpperLevelBVH::generate_acceleration_structure(const std::vector<const Entry*>& entries, ThreadPool* thread_pool) -> UPPER_ACCELERATION_STRUCTURE*
+        {
+            if(entries.empty())
+                return nullptr;
+
+            std::vector<BVHFactory<const Entry*>::BuilderNode> values;
+            values.reserve(entries.size());
+
+            std::transform(entries.begin(), entries.end(), std::back_inserter(values), [](const Entry* entry) -> BVHFactory<const Entry*>::BuilderNode
+            {
+                return { entry->mBVH->get_bounds() * entry->mTransform, entry };
             });
 
             glm::vec4 min(INFINITY, INFINITY, INFINITY, INFINITY);
@@ -45,39 +248,101 @@ namespace Core
             AABB scene_bounds(min, max);
 
 #ifdef USE_OCTTREE
-            m_acceleration_structure = OctTreeFactory<const Entry*>(scene_bounds, values)
+            return OctTreeFactory<const Entry*>(scene_bounds, values)
                            .set_intersector(std::make_unique<lower_level_intersector>())
                            .generate_octTree();
 #else
-            m_acceleration_structure = BVHFactory<const Entry*>(scene_bounds, values)
+            return BVHFactory<const Entry*>(scene_bounds, values)
                                            .set_intersector(std::make_unique<lower_level_intersector>())
                                            .set_parition_scheme(std::make_unique<SAH_parition_Scheme<const Entry*>>())
+                                           .set_node_layout(kDefaultWideNodeLayout)
+                                           .set_builder(BVHBuilder::kParallelBinned, thread_pool)
                                            .generate_BVH();
 #endif
         }
 
-        bool UpperLevelBVH::lower_level_intersector::intersects(const Ray& ray, const Entry* entry, float& intersect_distance, InterpolatedVertex& vertex) const
+        bool UpperLevelBVH::lower_level_intersector::intersects(const Ray& ray, const Entry* entry, HitRecord& hit) const
         {
             // Move the ray in to the local space of the lower level bvh.
+            // The object space direction isn't renormalised, so t is the same in both spaces even with non uniform
+            // scales. That lets the closest hit found so far cull the lower level traversal without any rescaling.
+            if(!entry->mBVH)
+                return false;
+
             Ray object_space_ray = Core::transform_ray(ray, entry->mInverseTransform);
 
-            InterpolatedVertex found_vertex;
-            if(entry->mBVH->calculate_intersection(object_space_ray, &found_vertex))
+            if(entry->mBVH->calculate_intersection(object_space_ray, hit))
             {
-                found_vertex.m_bsrdf = entry->m_material.get();
-
-                // Bring vertex back to world space.
-                found_vertex.mPosition = entry->mTransform * found_vertex.mPosition;
-                found_vertex.mNormal   = glm::normalize(glm::mat3x3(entry->mTransform) * found_vertex.mNormal);
-
-                intersect_distance = glm::length(found_vertex.mPosition - ray.mOrigin);
-                vertex= found_vertex;
+                hit.m_instance = entry->m_instance_id;
 
                 return true;
             }
 
             return false;
         }
+
+        bool UpperLevelBVH::lower_level_intersector::occludes(const Ray& ray, const Entry* entry, const float max_distance) const
+        {
+            if(!entry->mBVH)
+                return false;
+
+            // The object space direction isn't renormalised, so distances along the ray are the same in both spaces.
+            Ray object_space_ray = Core::transform_ray(ray, entry->mInverseTransform);
+
+            return entry->mBVH->is_occluded(object_space_ray, max_distance);
+        }
+
+        uint32_t UpperLevelBVH::lower_level_intersector::intersects_leaf_packet(const Ray* rays, const uint32_t ray_mask, const Entry* const* entries,
+                                                                                const uint32_t first, const uint32_t count, HitRecord* hits) const
+        {
+            uint32_t found = 0;
+            for(uint32_t i = first; i < first + count; ++i)
+            {
+                const Entry* entry = entries[i];
+                if(!entry->mBVH)
+                    continue;
+
+                Ray object_space_rays[kRayPacketSize];
+                for(uint32_t mask = ray_mask; mask != 0; mask &= mask - 1)
+                {
+                    const uint32_t r = std::countr_zero(mask);
+                    object_space_rays[r] = Core::transform_ray(rays[r], entry->mInverseTransform);
+                }
+
+                const uint32_t entry_found = entry->mBVH->calculate_intersections(object_space_rays, ray_mask, hits);
+                for(uint32_t mask = entry_found; mask != 0; mask &= mask - 1)
+                    hits[std::countr_zero(mask)].m_instance = entry->m_instance_id;
+
+                found |= entry_found;
+            }
+
+            return found;
+        }
+
+        uint32_t UpperLevelBVH::lower_level_intersector::occludes_leaf_packet(const Ray* rays, const uint32_t ray_mask, const Entry* const* entries,
+                                                                              const uint32_t first, const uint32_t count, const float* max_distances) const
+        {
+            uint32_t occluded = 0;
+            for(uint32_t i = first; i < first + count && occluded != ray_mask; ++i)
+            {
+                const Entry* entry = entries[i];
+                if(!entry->mBVH)
+                    continue;
+
+                const uint32_t active_rays = ray_mask & ~occluded;
+
+                Ray object_space_rays[kRayPacketSize];
+                for(uint32_t mask = active_rays; mask != 0; mask &= mask - 1)
+                {
+                    const uint32_t r = std::countr_zero(mask);
+                    object_space_rays[r] = Core::transform_ray(rays[r], entry->mInverseTransform);
+                }
+
+                occluded |= entry->mBVH->are_occluded(object_space_rays, active_rays, max_distances);
+            }
+
+            return occluded;
+        }
     }
 
 }
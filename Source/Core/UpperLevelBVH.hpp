@@ -9,9 +9,10 @@
 #include "glm/mat4x4.hpp"
 
 #include <memory>
+#include <utility>
 #include <vector>
 
-#define UPPER_ACCELERATION_STRUCTURE BVH<const Entry*, 2>
+#define UPPER_ACCELERATION_STRUCTURE Acceleration_Structure<const Entry*>
 
 namespace Core
 {
@@ -25,30 +26,84 @@ namespace Core
 
             struct Entry
             {
-                glm::mat4x4                    mTransform;
-                glm::mat4x4                    mInverseTransform;
+                Affine_Transform               mTransform;
+                Affine_Transform               mInverseTransform;
                 LowerLevelBVH*                 mBVH;
                 std::unique_ptr<Render::BSRDF> m_material;
+                uint32_t                       m_instance_id;
             };
 
             UpperLevelBVH() = default;
+            ~UpperLevelBVH();
+
+            UpperLevelBVH(const UpperLevelBVH&) = delete;
+            UpperLevelBVH& operator=(const UpperLevelBVH&) = delete;
 
             bool get_closest_intersection(Ray&, InterpolatedVertex* vertex) const;
 
-            void add_lower_level_bvh(Acceleration_Structures::LowerLevelBVH* bvh, const glm::mat4x4& transform, std::unique_ptr<Render::BSRDF>& bsrdf);
+            // Shadow ray query, returns on the first intersection closer than max_distance.
+            bool is_occluded(Ray&, const float max_distance) const;
+
+            // Packet queries for up to kRayPacketSize coherent rays such as neighbouring camera rays, ray_mask selects
+            // the active rays. Returns the mask of rays that hit something (with their vertices filled in) or were occluded.
+            uint32_t get_closest_intersections(Ray* rays, const uint32_t ray_mask, InterpolatedVertex* vertices) const;
+
+            uint32_t are_occluded(Ray* rays, const uint32_t ray_mask, const float* max_distances) const;
+
+            // Returns the new instance's id. Instances added after build are traced once update has been called.
+            uint32_t add_lower_level_bvh(Acceleration_Structures::LowerLevelBVH* bvh, const glm::mat4x4& transform, std::unique_ptr<Render::BSRDF>& bsrdf);
+
+            // Removed instances stop being hit straight away, their ids are reused after the next full rebuild.
+            void remove_lower_level_bvh(const uint32_t instance_id);
+
+            // Staged until the next update or build, the instance is traced where it was until then.
+            void set_transform(const uint32_t instance_id, const glm::mat4x4& transform);
+
+            // Rebuilds the BVH over every instance.
+            void build(ThreadPool* thread_pool = nullptr);
 
-            void build();
+            // Brings the BVH up to date with the instances added, removed or moved since it was built, and with any
+            // lower level BVHs whose bounds have changed, such as refitted meshes. The existing tree is refit and
+            // instances added since the last build go in to a second small tree, the whole BVH is rebuilt once
+            // either has degraded it too far.
+            void update(ThreadPool* thread_pool = nullptr);
 
         private:
 
             class lower_level_intersector : public Core::Acceleration_Structures::Intersector<const Entry*>
             {
             public:
-                virtual bool intersects(const Core::Ray& ray, const Entry*, float& intersect_distance, InterpolatedVertex&) const override;
+                virtual bool intersects(const Core::Ray& ray, const Entry*, HitRecord& hit) const override;
+
+                virtual bool occludes(const Core::Ray& ray, const Entry*, const float max_distance) const override;
+
+                // Moves the rays in to each instance's space and traces them through it as a packet.
+                virtual uint32_t intersects_leaf_packet(const Core::Ray* rays, const uint32_t ray_mask, const Entry* const* entries,
+                                                        const uint32_t first, const uint32_t count, HitRecord* hits) const override;
+
+                virtual uint32_t occludes_leaf_packet(const Core::Ray* rays, const uint32_t ray_mask, const Entry* const* entries,
+                                                      const uint32_t first, const uint32_t count, const float* max_distances) const override;
             };
 
-            std::vector<Entry> mLowerLevelBVHs;
-            UPPER_ACCELERATION_STRUCTURE* m_acceleration_structure;
+            static void to_world_space(const Entry& entry, InterpolatedVertex& vertex);
+
+            // Moves the instances given new transforms by set_transform.
+            void apply_pending_transforms();
+
+            static UPPER_ACCELERATION_STRUCTURE* generate_acceleration_structure(const std::vector<const Entry*>& entries, ThreadPool* thread_pool);
+
+            // Indexed by instance id, entries are kept behind pointers as the BVHs reference them.
+            std::vector<std::unique_ptr<Entry>> mLowerLevelBVHs;
+            std::vector<uint32_t>               m_free_instance_ids;
+            // Instances added since the last build, traced through m_added_acceleration_structure.
+            std::vector<uint32_t>               m_added_instance_ids;
+            // Instances removed since the last build, they are still in the trees and not yet free.
+            uint32_t                            m_removed_instance_count = 0;
+            std::vector<std::pair<uint32_t, Affine_Transform>> m_pending_transforms;
+
+            UPPER_ACCELERATION_STRUCTURE* m_acceleration_structure = nullptr;
+            UPPER_ACCELERATION_STRUCTURE* m_added_acceleration_structure = nullptr;
+            float                         m_built_sah_cost = 0.0f;
 
         };
 
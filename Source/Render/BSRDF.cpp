@@ -8,7 +8,7 @@
 namespace Render
 {
 
-    Sample Diffuse_BRDF::sample(Core::Rand::Hammersley_Generator& rand, const Core::Acceleration_Structures::InterpolatedVertex &position, Core::Ray& ray)
+    Sample Diffuse_BRDF::sample(Core::Rand::Sample_Stream& rand, const Core::Acceleration_Structures::InterpolatedVertex &position, const Core::Ray& ray, Core::Path_State&)
     {
         const glm::vec3 V = -ray.mDirection;
 
@@ -22,7 +22,7 @@ namespace Render
 
         Core::EvaluatedMaterial material = m_material_manager.evaluate_material(m_mat_id, position.mUV);
 
-        const glm::vec2 xi = rand.next();
+        const glm::vec2 xi = rand.next_2D();
         const glm::vec3 H = m_distribution->sample(xi, view_tangent, material.roughness);
         PICO_ASSERT_VALID(H);
         const float pdf = m_distribution->pdf(view_tangent, H, material.roughness);
@@ -51,7 +51,7 @@ namespace Render
         return material.diffuse;
     }
 
-    Sample Specular_BRDF::sample(Core::Rand::Hammersley_Generator& rand, const Core::Acceleration_Structures::InterpolatedVertex &position, Core::Ray &ray)
+    Sample Specular_BRDF::sample(Core::Rand::Sample_Stream& rand, const Core::Acceleration_Structures::InterpolatedVertex &position, const Core::Ray& ray, Core::Path_State&)
     {
         const glm::vec3 V = -ray.mDirection;
 
@@ -66,7 +66,7 @@ namespace Render
         Core::EvaluatedMaterial material = m_material_manager.evaluate_material(m_mat_id, position.mUV);
 
         // Sample microfacet direction
-        const glm::vec2 Xi = rand.next();
+        const glm::vec2 Xi = rand.next_2D();
         const glm::vec3 H = m_distribution->sample(Xi, view_tangent, material.roughness);
         PICO_ASSERT_VALID(H);
         const glm::vec3 L = glm::normalize(glm::reflect(-view_tangent, H));
@@ -97,7 +97,7 @@ namespace Render
         return material.specular;
     }
 
-    Sample Dielectric_BRDF::sample(Core::Rand::Hammersley_Generator& rand, const Core::Acceleration_Structures::InterpolatedVertex &position, Core::Ray& ray)
+    Sample Dielectric_BRDF::sample(Core::Rand::Sample_Stream& rand, const Core::Acceleration_Structures::InterpolatedVertex &position, const Core::Ray& ray, Core::Path_State&)
     {
         const glm::vec3 V = -ray.mDirection;
 
@@ -113,11 +113,11 @@ namespace Render
 
         const float specular_proportion = material.get_reflectance();
 
-        glm::vec2 Xi =  rand.next();
+        glm::vec2 Xi =  rand.next_2D();
         Sample samp;
         if(Xi.y >= specular_proportion)
         {
-            const glm::vec2 xi = rand.next();
+            const glm::vec2 xi = rand.next_2D();
             const glm::vec3 H = m_diffuse_distribution->sample(xi, view_tangent, material.roughness);
             PICO_ASSERT_VALID(H);
 
@@ -130,7 +130,7 @@ namespace Render
         }
         else
         {
-            Xi = rand.next();
+            Xi = rand.next_2D();
             const glm::vec3 H = m_specular_distribution->sample(Xi, view_tangent, material.roughness);
             PICO_ASSERT_VALID(H);
             const glm::vec3 L = glm::normalize(glm::reflect(-view_tangent, H));
@@ -170,7 +170,7 @@ namespace Render
         m_distribution(std::make_unique<Render::Cos_Weighted_Hemisphere_Distribution>())
     {}
 
-    Sample Light_BRDF::sample(Core::Rand::Hammersley_Generator& rand, const Core::Acceleration_Structures::InterpolatedVertex &position, Core::Ray& ray)
+    Sample Light_BRDF::sample(Core::Rand::Sample_Stream& rand, const Core::Acceleration_Structures::InterpolatedVertex &position, const Core::Ray& ray, Core::Path_State&)
     {
         const glm::vec3 V = -ray.mDirection;
 
@@ -184,7 +184,7 @@ namespace Render
 
         Core::EvaluatedMaterial material = m_material_manager.evaluate_material(m_mat_id, position.mUV);
 
-        const glm::vec2 xi = rand.next();
+        const glm::vec2 xi = rand.next_2D();
         const glm::vec3 H = m_distribution->sample(xi, view_tangent, material.roughness);
         PICO_ASSERT_VALID(H);
         const float pdf = m_distribution->pdf(view_tangent, H, material.roughness);
@@ -213,7 +213,7 @@ namespace Render
         return material.emissive;
     }
 
-    Sample Specular_Delta_BRDF::sample(Core::Rand::Hammersley_Generator&, const Core::Acceleration_Structures::InterpolatedVertex& position, Core::Ray &ray)
+    Sample Specular_Delta_BRDF::sample(Core::Rand::Sample_Stream&, const Core::Acceleration_Structures::InterpolatedVertex& position, const Core::Ray& ray, Core::Path_State&)
     {
         const glm::vec3 V = -ray.mDirection;
 
@@ -237,7 +237,7 @@ namespace Render
         return glm::vec3(0.0f); // Same as above.
     }
 
-    Sample Transparent_BTDF::sample(Core::Rand::Hammersley_Generator& rand, const Core::Acceleration_Structures::InterpolatedVertex &position, Core::Ray& ray)
+    Sample Transparent_BTDF::sample(Core::Rand::Sample_Stream& rand, const Core::Acceleration_Structures::InterpolatedVertex &position, const Core::Ray& ray, Core::Path_State& path)
     {
         const glm::vec3 V = -ray.mDirection;
 
@@ -255,7 +255,7 @@ namespace Render
         Core::EvaluatedMaterial material = m_material_manager.evaluate_material(m_mat_id, position.mUV);
 
         // Sample microfacet direction
-        const glm::vec2 Xi = rand.next();
+        const glm::vec2 Xi = rand.next_2D();
         glm::vec3 H = m_distribution->sample(Xi, view_tangent, material.roughness);
 
         PICO_ASSERT_VALID(H);
@@ -263,11 +263,11 @@ namespace Render
         float eta = 1.0f / m_index_of_refraction;
         if(enter_object)
         {
-            ray.push_index_of_refraction(m_index_of_refraction);
+            path.push_index_of_refraction(m_index_of_refraction);
         }
         else
         {
-            ray.pop_index_of_refraction();
+            path.pop_index_of_refraction();
         }
 
         glm::vec3 L;
@@ -354,7 +354,7 @@ namespace Render
 #endif
     }
 
-    Sample Fresnel_BTDF::sample(Core::Rand::Hammersley_Generator& rand, const Core::Acceleration_Structures::InterpolatedVertex& position, Core::Ray& ray)
+    Sample Fresnel_BTDF::sample(Core::Rand::Sample_Stream& rand, const Core::Acceleration_Structures::InterpolatedVertex& position, const Core::Ray& ray, Core::Path_State& path)
     {
         const glm::vec3 V = -ray.mDirection;
 
@@ -364,17 +364,17 @@ namespace Render
         const glm::mat3x3 world_to_tangent_transform = Core::TangentSpace::construct_world_to_tangent_transform(V, position.mNormal);
         const glm::vec3 view_tangent = glm::normalize(world_to_tangent_transform * V);
 
-        const glm::vec2 Xi = rand.next();
-        const float fresnel_term = fresnel_factor(Core::TangentSpace::cos_theta(view_tangent), m_transparent_bsrdf->get_index_of_refraction(), ray.get_current_index_of_refraction());
+        const glm::vec2 Xi = rand.next_2D();
+        const float fresnel_term = fresnel_factor(Core::TangentSpace::cos_theta(view_tangent), m_transparent_bsrdf->get_index_of_refraction(), path.get_current_index_of_refraction());
         Sample samp;
         if(Xi.x < fresnel_term)
         {
-            samp =  m_specular_bsrdf->sample(rand, position, ray);
+            samp =  m_specular_bsrdf->sample(rand, position, ray, path);
             samp.P *= fresnel_term;
         }
         else
         {
-            samp = m_transparent_bsrdf->sample(rand, position, ray);
+            samp = m_transparent_bsrdf->sample(rand, position, ray, path);
             samp.P *= 1.0f - fresnel_term;
         }
 
@@ -4,6 +4,7 @@
 #include "Distributions.hpp"
 #include "BasicMaterials.hpp"
 #include "Core/RandUtils.hpp"
+#include "Core/Sampler.hpp"
 
 #include "glm/glm.hpp"
 
@@ -17,6 +18,7 @@ namespace Core
     }
 
     struct Ray;
+    struct Path_State;
 }
 
 namespace Render
@@ -47,7 +49,7 @@ namespace Render
 
         virtual ~BSRDF() = default;
 
-        virtual Sample sample(Core::Rand::Hammersley_Generator& rand, const Core::Acceleration_Structures::InterpolatedVertex& position, Core::Ray& ray) = 0;
+        virtual Sample sample(Core::Rand::Sample_Stream& rand, const Core::Acceleration_Structures::InterpolatedVertex& position, const Core::Ray& ray, Core::Path_State& path) = 0;
 
         virtual float pdf(const glm::vec3& wo, const glm::vec3& H, const float roughness, const float reflectance) = 0;
 
@@ -76,7 +78,7 @@ namespace Render
             BSRDF(mat_manager, id),
             m_distribution(std::move(dist)) {}
 
-        virtual Sample sample(Core::Rand::Hammersley_Generator& rand, const Core::Acceleration_Structures::InterpolatedVertex& position, Core::Ray& ray) final;
+        virtual Sample sample(Core::Rand::Sample_Stream& rand, const Core::Acceleration_Structures::InterpolatedVertex& position, const Core::Ray& ray, Core::Path_State& path) final;
 
         virtual float pdf(const glm::vec3& wo, const glm::vec3& H, const float roughness, const float reflectance) final;
 
@@ -101,7 +103,7 @@ namespace Render
             BSRDF(mat_manager, id),
             m_distribution(std::move(dist)) {}
 
-        virtual Sample sample(Core::Rand::Hammersley_Generator& rand, const Core::Acceleration_Structures::InterpolatedVertex &position, Core::Ray& ray) final;
+        virtual Sample sample(Core::Rand::Sample_Stream& rand, const Core::Acceleration_Structures::InterpolatedVertex &position, const Core::Ray& ray, Core::Path_State& path) final;
 
         virtual float pdf(const glm::vec3& wo, const glm::vec3& H, const float roughness, const float reflectance) final;
 
@@ -126,7 +128,7 @@ namespace Render
             m_diffuse_distribution(std::move(diffuse_dist)),
             m_specular_distribution(std::move(specular_dist)) {}
 
-        virtual Sample sample(Core::Rand::Hammersley_Generator& rand, const Core::Acceleration_Structures::InterpolatedVertex &position, Core::Ray& ray) final;
+        virtual Sample sample(Core::Rand::Sample_Stream& rand, const Core::Acceleration_Structures::InterpolatedVertex &position, const Core::Ray& ray, Core::Path_State& path) final;
 
         virtual float pdf(const glm::vec3& wo, const glm::vec3& H, const float roughness, const float reflectance) final;
 
@@ -149,7 +151,7 @@ namespace Render
 
         Light_BRDF(Core::MaterialManager& mat_manager, Core::MaterialManager::MaterialID id);
 
-        virtual Sample sample(Core::Rand::Hammersley_Generator& rand, const Core::Acceleration_Structures::InterpolatedVertex &position, Core::Ray& ray) final;
+        virtual Sample sample(Core::Rand::Sample_Stream& rand, const Core::Acceleration_Structures::InterpolatedVertex &position, const Core::Ray& ray, Core::Path_State& path) final;
 
         virtual float pdf(const glm::vec3& wo, const glm::vec3& H, const float roughness, const float reflectance) final;
 
@@ -173,7 +175,7 @@ namespace Render
         Specular_Delta_BRDF(Core::MaterialManager& mat_manager, Core::MaterialManager::MaterialID id) :
             BSRDF(mat_manager, id) {}
 
-        virtual Sample sample(Core::Rand::Hammersley_Generator& rand, const Core::Acceleration_Structures::InterpolatedVertex &position, Core::Ray& ray) final;
+        virtual Sample sample(Core::Rand::Sample_Stream& rand, const Core::Acceleration_Structures::InterpolatedVertex &position, const Core::Ray& ray, Core::Path_State& path) final;
 
         virtual float pdf(const glm::vec3& wo, const glm::vec3& H, const float roughness, const float reflectance) final;
 
@@ -201,7 +203,7 @@ namespace Render
         }
 
 
-        virtual Sample sample(Core::Rand::Hammersley_Generator& rand, const Core::Acceleration_Structures::InterpolatedVertex &position, Core::Ray &ray) final;
+        virtual Sample sample(Core::Rand::Sample_Stream& rand, const Core::Acceleration_Structures::InterpolatedVertex &position, const Core::Ray& ray, Core::Path_State& path) final;
 
         virtual float pdf(const glm::vec3& wo, const glm::vec3& H, const float roughness, const float reflectance) final;
 
@@ -241,7 +243,7 @@ namespace Render
         }
 
 
-        virtual Sample sample(Core::Rand::Hammersley_Generator& rand, const Core::Acceleration_Structures::InterpolatedVertex &position, Core::Ray& ray) final;
+        virtual Sample sample(Core::Rand::Sample_Stream& rand, const Core::Acceleration_Structures::InterpolatedVertex &position, const Core::Ray& ray, Core::Path_State& path) final;
 
         virtual float pdf(const glm::vec3& wo, const glm::vec3& H, const float roughness, const float reflectance) final;
 
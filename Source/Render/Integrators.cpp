@@ -5,9 +5,15 @@
 #include "Core/vectorUtils.hpp"
 #include "Core/Image.hpp"
 #include "Core/Asserts.hpp"
+#include "Core/ThreadPool.hpp"
+#include "Core/Sorting.hpp"
 #include "glm/ext.hpp"
 #include "glm/geometric.hpp"
 
+#include <algorithm>
+#include <bit>
+#include <numeric>
+
 namespace 
 {
     float direct_lighting_pdf(const Core::Acceleration_Structures::InterpolatedVertex& frag, const glm::vec3& wi, const glm::vec3& wo, const Core::EvaluatedMaterial& mat)
@@ -20,6 +26,29 @@ namespace
 
         return frag.m_bsrdf->pdf(tangent_wo, H, mat.roughness, mat.get_reflectance());
     }
+
+    // The camera takes the first sample dimension and each bounce gets a fixed block after it, so every decision
+    // draws from the same dimension whatever was drawn earlier on the path.
+    constexpr uint32_t kCameraDimension = 0;
+
+    enum Bounce_Dimension : uint32_t
+    {
+        kBSRDFDimension = 0, // Up to 3, Fresnel_BTDF picks a lobe before sampling it.
+        kLightDimension = 3, // The light, then up to 3 for the point on it.
+        kRussianRouletteDimension = 7,
+        kDimensionsPerBounce = 8
+    };
+
+    uint32_t bounce_dimension(const uint32_t depth, const Bounce_Dimension dimension)
+    {
+        return kCameraDimension + 1 + (depth * kDimensionsPerBounce) + dimension;
+    }
+
+    // Below this many paths a queue is cheaper to trace as is than to sort.
+    constexpr size_t kMinimumSortedQueueSize = 4096;
+
+    // Bits per axis of the ray origin Morton codes, under the 3 octant bits.
+    constexpr uint32_t kRayOriginBits = 10;
 }
 
 namespace Render
@@ -34,103 +63,126 @@ namespace Render
 
 
     Monte_Carlo_Integrator::Monte_Carlo_Integrator(const Core::Acceleration_Structures::UpperLevelBVH& bvh,  Core::MaterialManager& material_manager, const std::vector<Scene::Light>& lights,
-                                                   const Scene::Sun &sun, const uint64_t seed) :
+                                                   const Scene::Sun &sun, const Core::Rand::Sampler& sampler) :
         Integrator(bvh, material_manager, lights),
-        mGenerator{seed},
-        mDistribution(0.0f, 1.0f),
-        m_hammersley_generator(seed),
+        m_sampler{sampler},
         m_sky_desc{sun}
     {
     }
 
-    bool Monte_Carlo_Integrator::sample_direct_lighting(const Core::Acceleration_Structures::InterpolatedVertex& frag, const glm::vec3& wi, glm::vec3& radiance, float& pdf)
+    bool Monte_Carlo_Integrator::receives_direct_lighting(const Core::Acceleration_Structures::InterpolatedVertex& frag) const
     {
         const auto bsrdf_type = frag.m_bsrdf->get_type();
-        if(bsrdf_type != Render::BSRDF_Type::kBTDF && bsrdf_type != Render::BSRDF_Type::kLight)
-        {
+        const bool has_lights = !m_lights.empty() || m_sky_desc.m_use_sun;
 
-            const Core::EvaluatedMaterial mat = m_material_manager.evaluate_material(frag.m_bsrdf->get_material_id(), frag.mUV);
+        return has_lights && bsrdf_type != Render::BSRDF_Type::kBTDF && bsrdf_type != Render::BSRDF_Type::kLight;
+    }
 
-            // account for a special cased sunlight
-            uint32_t light_count = m_lights.size() + (m_sky_desc.m_use_sun ? 1 : 0);
-            const uint32_t light_index = mDistribution(mGenerator) * light_count;
-            if(light_index == light_count)
-                light_count--;
+    uint32_t Monte_Carlo_Integrator::select_light(Core::Rand::Sample_Stream& samples) const
+    {
+        // account for a special cased sunlight
+        const uint32_t light_count = m_lights.size() + (m_sky_desc.m_use_sun ? 1 : 0);
+        const uint32_t light_index = samples.next_1D() * light_count;
 
-            // handle sunlight contribution
-            if(light_index >= (light_count - 1) && m_sky_desc.m_use_sun)
-            {
-                Core::Ray direct_lighting_ray{};
-                direct_lighting_ray.mDirection = -m_sky_desc.m_sun_direction;
-                direct_lighting_ray.mOrigin = frag.mPosition + glm::vec4((0.01f * direct_lighting_ray.mDirection), 0.0f);
-                direct_lighting_ray.mLenght = 10000.0f;
+        return std::min(light_index, light_count - 1);
+    }
 
-                Core::Acceleration_Structures::InterpolatedVertex point_hit;
-                if(!m_bvh.get_closest_intersection(direct_lighting_ray, &point_hit))
-                {
-                    pdf = direct_lighting_pdf(frag, wi, -m_sky_desc.m_sun_direction, mat);
-                    radiance = m_sky_desc.m_sun_colour;
-                    return true;
-                }
+    Core::Ray Monte_Carlo_Integrator::generate_sun_ray(const Core::Acceleration_Structures::InterpolatedVertex& frag) const
+    {
+        Core::Ray direct_lighting_ray{};
+        direct_lighting_ray.mDirection = -m_sky_desc.m_sun_direction;
+        direct_lighting_ray.mOrigin = frag.mPosition + glm::vec4((0.01f * direct_lighting_ray.mDirection), 0.0f);
+        direct_lighting_ray.mLenght = 10000.0f;
 
-                return false;
-            }
+        return direct_lighting_ray;
+    }
 
-            glm::vec3 sample_position;
-            float selected_pdf;
+    void Monte_Carlo_Integrator::shade_sun(const Core::Acceleration_Structures::InterpolatedVertex& frag, const glm::vec3& wi, const Core::EvaluatedMaterial& mat,
+                                           glm::vec3& radiance, float& pdf) const
+    {
+        pdf = direct_lighting_pdf(frag, wi, -m_sky_desc.m_sun_direction, mat);
+        radiance = m_sky_desc.m_sun_colour;
+    }
 
-            const auto& geometrty = m_lights[light_index].m_geometry;
+    bool Monte_Carlo_Integrator::sample_light(const Core::Acceleration_Structures::InterpolatedVertex& frag, const glm::vec3& wi, const Core::EvaluatedMaterial& mat,
+                                              const uint32_t light_index, Core::Rand::Sample_Stream& samples, glm::vec3& radiance, float& pdf)
+    {
+        glm::vec3 sample_position;
+        float selected_pdf;
 
-            const bool found_sample = geometrty->sample_geometry(m_hammersley_generator, sample_position, selected_pdf);
-            if(found_sample)
-            {
-                sample_position = m_lights[light_index].m_transform * glm::vec4(sample_position, 1.0f);
-            }
+        const auto& geometrty = m_lights[light_index].m_geometry;
 
-            if(!found_sample)
-            {
-                return false;
-            }
-            else // Try to find a light.
-            {
-                glm::vec3 to_light = glm::normalize(sample_position - glm::vec3(frag.mPosition));
+        const bool found_sample = geometrty->sample_geometry(samples, sample_position, selected_pdf);
+        if(!found_sample)
+        {
+            return false;
+        }
 
-                if(glm::dot(to_light, frag.mNormal) < 0.0f)
-                    return false;
+        sample_position = m_lights[light_index].m_transform * glm::vec4(sample_position, 1.0f);
 
-                Core::Ray direct_lighting_ray{};
-                direct_lighting_ray.mDirection = to_light;
-                direct_lighting_ray.mOrigin = frag.mPosition + glm::vec4((0.01f * to_light), 0.0f);
-                direct_lighting_ray.mLenght = 10000.0f;
+        // Try to find a light.
+        glm::vec3 to_light = glm::normalize(sample_position - glm::vec3(frag.mPosition));
 
-                Core::Acceleration_Structures::InterpolatedVertex point_hit;
-                if(m_bvh.get_closest_intersection(direct_lighting_ray, &point_hit))
-                {
-                    if(point_hit.m_bsrdf->get_type() == Render::BSRDF_Type::kLight)
-                    {
-                        const Core::EvaluatedMaterial light_material = m_material_manager.evaluate_material(point_hit.m_bsrdf->get_material_id(), point_hit.mUV);
+        if(glm::dot(to_light, frag.mNormal) < 0.0f)
+            return false;
 
-                        pdf =  direct_lighting_pdf(frag, wi, to_light, mat);
-                        radiance = light_material.emissive;
+        Core::Ray direct_lighting_ray{};
+        direct_lighting_ray.mDirection = to_light;
+        direct_lighting_ray.mOrigin = frag.mPosition + glm::vec4((0.01f * to_light), 0.0f);
+        // Nothing past the sampled point can block it, so let the traversal cull against it.
+        direct_lighting_ray.mLenght = glm::length(sample_position - glm::vec3(direct_lighting_ray.mOrigin)) + 0.01f;
 
-                        return true;
-                    }
-                }
+        Core::Acceleration_Structures::InterpolatedVertex point_hit;
+        if(m_bvh.get_closest_intersection(direct_lighting_ray, &point_hit))
+        {
+            if(point_hit.m_bsrdf->get_type() == Render::BSRDF_Type::kLight)
+            {
+                const Core::EvaluatedMaterial light_material = m_material_manager.evaluate_material(point_hit.m_bsrdf->get_material_id(), point_hit.mUV);
 
-                return false;
+                pdf =  direct_lighting_pdf(frag, wi, to_light, mat);
+                radiance = light_material.emissive;
+
+                return true;
             }
+        }
+
+        return false;
+    }
 
+    bool Monte_Carlo_Integrator::sample_direct_lighting(const Core::Acceleration_Structures::InterpolatedVertex& frag, const glm::vec3& wi, Core::Rand::Sample_Stream& samples,
+                                                        glm::vec3& radiance, float& pdf)
+    {
+        if(!receives_direct_lighting(frag))
+        {
+            return false;
         }
-        else
+
+        const Core::EvaluatedMaterial mat = m_material_manager.evaluate_material(frag.m_bsrdf->get_material_id(), frag.mUV);
+
+        const uint32_t light_index = select_light(samples);
+
+        // handle sunlight contribution
+        if(light_index == m_lights.size())
         {
+            Core::Ray direct_lighting_ray = generate_sun_ray(frag);
+            if(!m_bvh.is_occluded(direct_lighting_ray, direct_lighting_ray.mLenght))
+            {
+                shade_sun(frag, wi, mat, radiance, pdf);
+                return true;
+            }
+
             return false;
         }
+
+        return sample_light(frag, wi, mat, light_index, samples, radiance, pdf);
     }
 
-    glm::vec3 Monte_Carlo_Integrator::integrate_ray(const Scene::Camera& camera, const glm::uvec2& pixel, const uint32_t maxDepth)
+    glm::vec3 Monte_Carlo_Integrator::integrate_ray(const Scene::Camera& camera, const glm::uvec2& pixel, const uint32_t sample_index, const uint32_t maxDepth)
     {
-        m_max_depth = maxDepth;
-        Core::Ray ray = camera.generate_ray(m_hammersley_generator.next(), pixel);
+        Core::Rand::Sample_Stream samples(m_sampler, pixel, sample_index);
+        samples.set_dimension(kCameraDimension);
+        Core::Ray ray = camera.generate_ray(samples.next_2D(), pixel);
+        Core::Path_State path{};
 
         Core::Acceleration_Structures::InterpolatedVertex vertex;
         if(m_bvh.get_closest_intersection(ray, &vertex))
@@ -138,9 +190,9 @@ namespace Render
             //return glm::vec4(vertex.mNormal * 0.5f + 0.5f, 1.0f);
             //return glm::vec4(m_material_manager.evaluate_material(vertex.m_bsrdf->get_material_id(), vertex.mUV).diffuse, 1.0f);
 
-            trace_ray(vertex, ray, 0);
+            trace_ray(vertex, ray, path, samples, 0, maxDepth);
 
-            glm::vec3 result = ray.m_payload;
+            glm::vec3 result = path.m_payload;
 
             if(glm::any(glm::isinf(result)) || glm::any(glm::isnan(result)))
                 result = glm::vec3(1.0f, 0.4, 0.7);
@@ -151,30 +203,136 @@ namespace Render
         {
             return m_sky_desc.m_sky_box->sample4(ray.mDirection);
         }
-}
+    }
 
+    void Monte_Carlo_Integrator::integrate_packet(const Scene::Camera& camera, const glm::uvec2* pixels, const uint32_t* sample_indices, const uint32_t pixel_mask,
+                                                  const uint32_t maxDepth, glm::vec3* results)
+    {
+        Core::Ray rays[Core::Acceleration_Structures::kRayPacketSize];
+        Core::Path_State paths[Core::Acceleration_Structures::kRayPacketSize];
+        Core::Rand::Sample_Stream samples[Core::Acceleration_Structures::kRayPacketSize];
+        for(uint32_t mask = pixel_mask; mask != 0; mask &= mask - 1)
+        {
+            const uint32_t r = std::countr_zero(mask);
+            samples[r] = Core::Rand::Sample_Stream(m_sampler, pixels[r], sample_indices[r]);
+            samples[r].set_dimension(kCameraDimension);
+            rays[r] = camera.generate_ray(samples[r].next_2D(), pixels[r]);
+        }
 
-    void Monte_Carlo_Integrator::trace_ray(const Core::Acceleration_Structures::InterpolatedVertex& frag, Core::Ray& ray, const uint32_t depth)
+        Core::Acceleration_Structures::InterpolatedVertex vertices[Core::Acceleration_Structures::kRayPacketSize];
+        const uint32_t hit_mask = m_bvh.get_closest_intersections(rays, pixel_mask, vertices);
+
+        for(uint32_t mask = pixel_mask & ~hit_mask; mask != 0; mask &= mask - 1)
+        {
+            const uint32_t r = std::countr_zero(mask);
+            results[r] = m_sky_desc.m_sky_box->sample4(rays[r].mDirection);
+        }
+
+        // Shade the first vertex of every path, gathering the sun shadow rays so they can be traced together.
+        Sample bsrdf_samples[Core::Acceleration_Structures::kRayPacketSize];
+        Core::EvaluatedMaterial materials[Core::Acceleration_Structures::kRayPacketSize];
+        Core::Ray shadow_rays[Core::Acceleration_Structures::kRayPacketSize];
+        float shadow_distances[Core::Acceleration_Structures::kRayPacketSize];
+        uint32_t sun_mask = 0;
+
+        const uint32_t shaded_mask = maxDepth > 0 ? hit_mask : 0;
+        for(uint32_t mask = shaded_mask; mask != 0; mask &= mask - 1)
+        {
+            const uint32_t r = std::countr_zero(mask);
+            const auto& frag = vertices[r];
+            const Core::Ray& ray = rays[r];
+            Core::Path_State& path = paths[r];
+
+            samples[r].set_dimension(bounce_dimension(0, kBSRDFDimension));
+            bsrdf_samples[r] = frag.m_bsrdf->sample(samples[r], frag, ray, path);
+            if(frag.m_bsrdf->get_type() == BSRDF_Type::kLight)
+            {
+                path.m_payload += path.m_throughput * bsrdf_samples[r].energy;
+            }
+
+            if(!receives_direct_lighting(frag))
+                continue;
+
+            materials[r] = m_material_manager.evaluate_material(frag.m_bsrdf->get_material_id(), frag.mUV);
+
+            samples[r].set_dimension(bounce_dimension(0, kLightDimension));
+            const uint32_t light_index = select_light(samples[r]);
+            if(light_index == m_lights.size())
+            {
+                shadow_rays[r] = generate_sun_ray(frag);
+                shadow_distances[r] = shadow_rays[r].mLenght;
+                sun_mask |= 1u << r;
+            }
+            else
+            {
+                glm::vec3 direct_radiance;
+                float direct_pdf;
+                if(sample_light(frag, -ray.mDirection, materials[r], light_index, samples[r], direct_radiance, direct_pdf))
+                {
+                    path.m_payload += path.m_throughput * direct_pdf * direct_radiance * bsrdf_samples[r].energy;
+                }
+            }
+        }
+
+        const uint32_t occluded_mask = m_bvh.are_occluded(shadow_rays, sun_mask, shadow_distances);
+        for(uint32_t mask = sun_mask & ~occluded_mask; mask != 0; mask &= mask - 1)
+        {
+            const uint32_t r = std::countr_zero(mask);
+            Core::Path_State& path = paths[r];
+
+            glm::vec3 direct_radiance;
+            float direct_pdf;
+            shade_sun(vertices[r], -rays[r].mDirection, materials[r], direct_radiance, direct_pdf);
+            path.m_payload += path.m_throughput * direct_pdf * direct_radiance * bsrdf_samples[r].energy;
+        }
+
+        // The bounced rays are incoherent, so each path carries on by itself.
+        for(uint32_t mask = hit_mask; mask != 0; mask &= mask - 1)
+        {
+            const uint32_t r = std::countr_zero(mask);
+            if(shaded_mask & (1u << r))
+                continue_path(vertices[r], bsrdf_samples[r], rays[r], paths[r], samples[r], 0, maxDepth);
+
+            glm::vec3 result = paths[r].m_payload;
+
+            if(glm::any(glm::isinf(result)) || glm::any(glm::isnan(result)))
+                result = glm::vec3(1.0f, 0.4, 0.7);
+
+            results[r] = result;
+        }
+    }
+
+
+    void Monte_Carlo_Integrator::trace_ray(const Core::Acceleration_Structures::InterpolatedVertex& frag, Core::Ray& ray, Core::Path_State& path, Core::Rand::Sample_Stream& samples,
+                                           const uint32_t depth, const uint32_t max_depth)
     {
-        if(depth == m_max_depth)
+        if(depth == max_depth)
         {
             return;
         }
 
-        Sample sample = frag.m_bsrdf->sample(m_hammersley_generator, frag, ray);
+        samples.set_dimension(bounce_dimension(depth, kBSRDFDimension));
+        Sample sample = frag.m_bsrdf->sample(samples, frag, ray, path);
         if(frag.m_bsrdf->get_type() == BSRDF_Type::kLight)
         {
-            ray.m_payload += ray.m_throughput * sample.energy;
+            path.m_payload += path.m_throughput * sample.energy;
         }
 
         // Add direct lighting contribution(s)
         glm::vec3 direct_radiance;
         float direct_pdf;
-        if(sample_direct_lighting(frag, -ray.mDirection, direct_radiance, direct_pdf))
+        samples.set_dimension(bounce_dimension(depth, kLightDimension));
+        if(sample_direct_lighting(frag, -ray.mDirection, samples, direct_radiance, direct_pdf))
         {
-            ray.m_payload += ray.m_throughput * direct_pdf * direct_radiance * sample.energy;
+            path.m_payload += path.m_throughput * direct_pdf * direct_radiance * sample.energy;
         }
 
+        continue_path(frag, sample, ray, path, samples, depth, max_depth);
+    }
+
+    void Monte_Carlo_Integrator::continue_path(const Core::Acceleration_Structures::InterpolatedVertex& frag, const Sample& sample, Core::Ray& ray, Core::Path_State& path,
+                                               Core::Rand::Sample_Stream& samples, const uint32_t depth, const uint32_t max_depth)
+    {
         // Sample does not contribute, so early out.
         if(sample.P == 0.0f)
         {
@@ -183,28 +341,339 @@ namespace Render
 
         // kill off random rays here for russian roulette sampling.
         {
-            const float inverse_kill_rate = std::max(std::max(ray.m_throughput.x, ray.m_throughput.y), ray.m_throughput.z);
-            if(mDistribution(mGenerator) > inverse_kill_rate)
+            const float inverse_kill_rate = std::max(std::max(path.m_throughput.x, path.m_throughput.y), path.m_throughput.z);
+            samples.set_dimension(bounce_dimension(depth, kRussianRouletteDimension));
+            if(samples.next_1D() > inverse_kill_rate)
             {
                 return;
             }
 
-            ray.m_throughput *= 1.0f / inverse_kill_rate;
+            path.m_throughput *= 1.0f / inverse_kill_rate;
         }
 
         PICO_ASSERT_VALID(sample.L);
         PICO_ASSERT_NORMALISED(sample.L);
-        ray.m_throughput *= sample.P * sample.energy;
+        path.m_throughput *= sample.P * sample.energy;
 
-        ray.mOrigin = frag.mPosition + glm::vec4(0.01f * (ray.inside_geometry() ? -frag.mNormal : frag.mNormal), 0.0f);
+        ray.mOrigin = frag.mPosition + glm::vec4(0.01f * (path.inside_geometry() ? -frag.mNormal : frag.mNormal), 0.0f);
         ray.mDirection = sample.L;
+        ray.mLenght = INFINITY;
 
         Core::Acceleration_Structures::InterpolatedVertex intersection;
         if(m_bvh.get_closest_intersection(ray, &intersection))
         {
-            trace_ray(intersection, ray, depth + 1);
+            trace_ray(intersection, ray, path, samples, depth + 1, max_depth);
         }
         else
-            ray.m_payload += ray.m_throughput * glm::vec3(m_sky_desc.m_sky_box->sample4(sample.L));
+            path.m_payload += path.m_throughput * glm::vec3(m_sky_desc.m_sky_box->sample4(sample.L));
+    }
+
+
+    Wavefront_Integrator::Wavefront_Integrator(const Core::Acceleration_Structures::UpperLevelBVH& bvh,  Core::MaterialManager& material_manager, const std::vector<Scene::Light>& lights,
+                                               const Scene::Sun& sun, ThreadPool& thread_pool, const Core::Rand::Sampler& sampler, const bool sort_rays) :
+        Integrator(bvh, material_manager, lights),
+        m_thread_pool{thread_pool},
+        m_sampler{sampler},
+        m_sky_desc{sun},
+        m_max_depth{0},
+        m_sort_rays{sort_rays},
+        m_chunks(get_chunk_count(&thread_pool))
+    {
+    }
+
+    glm::vec3 Wavefront_Integrator::integrate_ray(const Scene::Camera& camera, const glm::uvec2& pixel, const uint32_t sample_index, const uint32_t maxDepth)
+    {
+        glm::vec3 result;
+        integrate_pixels(camera, &pixel, &sample_index, 1, maxDepth, &result);
+
+        return result;
+    }
+
+    void Wavefront_Integrator::integrate_pixels(const Scene::Camera& camera, const glm::uvec2* pixels, const uint32_t* sample_indices, const uint32_t count, const uint32_t maxDepth,
+                                                glm::vec3* results)
+    {
+        m_max_depth = maxDepth;
+
+        m_rays.resize(count);
+        m_paths.resize(count);
+        m_vertices.resize(count);
+        m_sample_streams.resize(count);
+        m_shadow_rays.resize(count);
+        m_shadow_weights.resize(count);
+        m_shadow_occlusion_only.resize(count);
+
+        m_active_queue.resize(count);
+        std::iota(m_active_queue.begin(), m_active_queue.end(), 0u);
+
+        process_queue(m_active_queue, [&](Chunk_State&, const uint32_t path_index)
+        {
+            Core::Rand::Sample_Stream& samples = m_sample_streams[path_index];
+            samples = Core::Rand::Sample_Stream(m_sampler, pixels[path_index], sample_indices[path_index]);
+            samples.set_dimension(kCameraDimension);
+
+            m_rays[path_index] = camera.generate_ray(samples.next_2D(), pixels[path_index]);
+            m_paths[path_index] = Core::Path_State{};
+        });
+
+        for(uint32_t depth = 0; !m_active_queue.empty(); ++depth)
+        {
+            // Camera rays are already coherent in pixel order.
+            if(m_sort_rays && depth > 0)
+                sort_active_rays();
+
+            extend(depth);
+
+            if(m_sort_rays)
+                sort_hits();
+
+            shade(depth);
+            shadow();
+        }
+
+        for_each_chunk(&m_thread_pool, count, [&](const size_t, const size_t begin, const size_t end)
+        {
+            for(size_t path_index = begin; path_index < end; ++path_index)
+            {
+                glm::vec3 result = m_paths[path_index].m_payload;
+
+                if(glm::any(glm::isinf(result)) || glm::any(glm::isnan(result)))
+                    result = glm::vec3(1.0f, 0.4, 0.7);
+
+                results[path_index] = result;
+            }
+        });
+    }
+
+    template<typename F>
+    void Wavefront_Integrator::process_queue(const std::vector<uint32_t>& queue, F&& process)
+    {
+        for_each_chunk(&m_thread_pool, queue.size(), [&](const size_t chunk, const size_t begin, const size_t end)
+        {
+            for(size_t i = begin; i < end; ++i)
+                process(m_chunks[chunk], queue[i]);
+        });
+    }
+
+    void Wavefront_Integrator::gather_queue(const Queue queue, std::vector<uint32_t>& output)
+    {
+        output.clear();
+        for(Chunk_State& chunk : m_chunks)
+        {
+            output.insert(output.end(), chunk.m_queues[queue].begin(), chunk.m_queues[queue].end());
+            chunk.m_queues[queue].clear();
+        }
+    }
+
+    template<typename F>
+    void Wavefront_Integrator::sort_queue(std::vector<uint32_t>& queue, F&& key)
+    {
+        if(queue.size() < kMinimumSortedQueueSize)
+            return;
+
+        // Only sort as many bits as the largest key uses.
+        std::vector<uint64_t> chunk_max_keys(m_chunks.size(), 0);
+        m_sort_keys.resize(queue.size());
+        for_each_chunk(&m_thread_pool, queue.size(), [&](const size_t chunk, const size_t begin, const size_t end)
+        {
+            for(size_t i = begin; i < end; ++i)
+            {
+                m_sort_keys[i] = key(queue[i]);
+                chunk_max_keys[chunk] = std::max(chunk_max_keys[chunk], m_sort_keys[i]);
+            }
+        });
+
+        const uint64_t max_key = *std::max_element(chunk_max_keys.begin(), chunk_max_keys.end());
+        const std::vector<uint32_t> order = Core::radix_sort(m_sort_keys, std::bit_width(max_key), &m_thread_pool);
+
+        m_sorted_queue.resize(queue.size());
+        for_each_chunk(&m_thread_pool, queue.size(), [&](const size_t, const size_t begin, const size_t end)
+        {
+            for(size_t i = begin; i < end; ++i)
+                m_sorted_queue[i] = queue[order[i]];
+        });
+
+        queue.swap(m_sorted_queue);
+    }
+
+    void Wavefront_Integrator::sort_active_rays()
+    {
+        if(m_active_queue.size() < kMinimumSortedQueueSize)
+            return;
+
+        const Core::AABB empty_bounds(glm::vec4(INFINITY), glm::vec4(-INFINITY));
+        std::vector<Core::AABB> chunk_bounds(m_chunks.size(), empty_bounds);
+        for_each_chunk(&m_thread_pool, m_active_queue.size(), [&](const size_t chunk, const size_t begin, const size_t end)
+        {
+            for(size_t i = begin; i < end; ++i)
+                chunk_bounds[chunk].add_point(m_rays[m_active_queue[i]].mOrigin);
+        });
+
+        Core::AABB origin_bounds = empty_bounds;
+        for(const Core::AABB& bounds : chunk_bounds)
+            origin_bounds.union_of(bounds);
+
+        sort_queue(m_active_queue, [&](const uint32_t path_index)
+        {
+            const Core::Ray& ray = m_rays[path_index];
+            const uint64_t octant = (ray.mDirection.x < 0.0f ? 1u : 0u) | (ray.mDirection.y < 0.0f ? 2u : 0u) | (ray.mDirection.z < 0.0f ? 4u : 0u);
+
+            return (octant << (kRayOriginBits * 3)) | Core::morton_code(origin_bounds.get_offset(ray.mOrigin), kRayOriginBits);
+        });
+    }
+
+    void Wavefront_Integrator::sort_hits()
+    {
+        sort_queue(m_hit_queue, [this](const uint32_t path_index)
+        {
+            return uint64_t(m_vertices[path_index].m_bsrdf->get_material_id());
+        });
+    }
+
+    void Wavefront_Integrator::extend(const uint32_t depth)
+    {
+        process_queue(m_active_queue, [this, depth](Chunk_State& chunk, const uint32_t path_index)
+        {
+            Core::Ray& ray = m_rays[path_index];
+            if(!m_bvh.get_closest_intersection(ray, &m_vertices[path_index]))
+            {
+                Core::Path_State& path = m_paths[path_index];
+                path.m_payload += path.m_throughput * glm::vec3(m_sky_desc.m_sky_box->sample4(ray.mDirection));
+                return;
+            }
+
+            // Hits past the maximum depth add nothing.
+            if(depth < m_max_depth)
+                chunk.m_queues[kPathQueue].push_back(path_index);
+        });
+
+        gather_queue(kPathQueue, m_hit_queue);
+    }
+
+    void Wavefront_Integrator::shade(const uint32_t depth)
+    {
+        process_queue(m_hit_queue, [this, depth](Chunk_State& chunk, const uint32_t path_index)
+        {
+            const auto& frag = m_vertices[path_index];
+            Core::Ray& ray = m_rays[path_index];
+            Core::Path_State& path = m_paths[path_index];
+            Core::Rand::Sample_Stream& samples = m_sample_streams[path_index];
+
+            samples.set_dimension(bounce_dimension(depth, kBSRDFDimension));
+            const Sample sample = frag.m_bsrdf->sample(samples, frag, ray, path);
+            if(frag.m_bsrdf->get_type() == BSRDF_Type::kLight)
+            {
+                path.m_payload += path.m_throughput * sample.energy;
+            }
+
+            samples.set_dimension(bounce_dimension(depth, kLightDimension));
+            if(generate_shadow_ray(frag, -ray.mDirection, path.m_throughput * sample.energy, path_index))
+                chunk.m_queues[kShadowQueue].push_back(path_index);
+
+            // Sample does not contribute, so early out.
+            if(sample.P == 0.0f)
+            {
+                return;
+            }
+
+            // kill off random rays here for russian roulette sampling.
+            const float inverse_kill_rate = std::max(std::max(path.m_throughput.x, path.m_throughput.y), path.m_throughput.z);
+            samples.set_dimension(bounce_dimension(depth, kRussianRouletteDimension));
+            if(samples.next_1D() > inverse_kill_rate)
+            {
+                return;
+            }
+
+            path.m_throughput *= 1.0f / inverse_kill_rate;
+
+            PICO_ASSERT_VALID(sample.L);
+            PICO_ASSERT_NORMALISED(sample.L);
+            path.m_throughput *= sample.P * sample.energy;
+
+            ray.mOrigin = frag.mPosition + glm::vec4(0.01f * (path.inside_geometry() ? -frag.mNormal : frag.mNormal), 0.0f);
+            ray.mDirection = sample.L;
+            ray.mLenght = INFINITY;
+
+            chunk.m_queues[kPathQueue].push_back(path_index);
+        });
+
+        gather_queue(kPathQueue, m_active_queue);
+        gather_queue(kShadowQueue, m_shadow_queue);
+    }
+
+    bool Wavefront_Integrator::generate_shadow_ray(const Core::Acceleration_Structures::InterpolatedVertex& frag, const glm::vec3& wi, const glm::vec3& weight,
+                                                   const uint32_t path_index)
+    {
+        const auto bsrdf_type = frag.m_bsrdf->get_type();
+        const bool has_lights = !m_lights.empty() || m_sky_desc.m_use_sun;
+        if(!has_lights || bsrdf_type == Render::BSRDF_Type::kBTDF || bsrdf_type == Render::BSRDF_Type::kLight)
+        {
+            return false;
+        }
+
+        const Core::EvaluatedMaterial mat = m_material_manager.evaluate_material(frag.m_bsrdf->get_material_id(), frag.mUV);
+
+        // account for a special cased sunlight
+        const uint32_t light_count = m_lights.size() + (m_sky_desc.m_use_sun ? 1 : 0);
+        Core::Rand::Sample_Stream& samples = m_sample_streams[path_index];
+        const uint32_t light_index = std::min(static_cast<uint32_t>(samples.next_1D() * light_count), light_count - 1);
+
+        Core::Ray& shadow_ray = m_shadow_rays[path_index];
+        if(light_index == m_lights.size())
+        {
+            shadow_ray.mDirection = -m_sky_desc.m_sun_direction;
+            shadow_ray.mOrigin = frag.mPosition + glm::vec4((0.01f * shadow_ray.mDirection), 0.0f);
+            shadow_ray.mLenght = 10000.0f;
+
+            m_shadow_weights[path_index] = weight * direct_lighting_pdf(frag, wi, -m_sky_desc.m_sun_direction, mat) * m_sky_desc.m_sun_colour;
+            m_shadow_occlusion_only[path_index] = true;
+
+            return true;
+        }
+
+        glm::vec3 sample_position;
+        float selected_pdf;
+        if(!m_lights[light_index].m_geometry->sample_geometry(samples, sample_position, selected_pdf))
+        {
+            return false;
+        }
+
+        sample_position = m_lights[light_index].m_transform * glm::vec4(sample_position, 1.0f);
+
+        const glm::vec3 to_light = glm::normalize(sample_position - glm::vec3(frag.mPosition));
+        if(glm::dot(to_light, frag.mNormal) < 0.0f)
+            return false;
+
+        shadow_ray.mDirection = to_light;
+        shadow_ray.mOrigin = frag.mPosition + glm::vec4((0.01f * to_light), 0.0f);
+        // Nothing past the sampled point can block it, so let the traversal cull against it.
+        shadow_ray.mLenght = glm::length(sample_position - glm::vec3(shadow_ray.mOrigin)) + 0.01f;
+
+        // The radiance is only known once the ray has found which light it hits.
+        m_shadow_weights[path_index] = weight * direct_lighting_pdf(frag, wi, to_light, mat);
+        m_shadow_occlusion_only[path_index] = false;
+
+        return true;
+    }
+
+    void Wavefront_Integrator::shadow()
+    {
+        process_queue(m_shadow_queue, [this](Chunk_State&, const uint32_t path_index)
+        {
+            Core::Ray& shadow_ray = m_shadow_rays[path_index];
+            if(m_shadow_occlusion_only[path_index])
+            {
+                if(!m_bvh.is_occluded(shadow_ray, shadow_ray.mLenght))
+                    m_paths[path_index].m_payload += m_shadow_weights[path_index];
+
+                return;
+            }
+
+            Core::Acceleration_Structures::InterpolatedVertex point_hit;
+            if(m_bvh.get_closest_intersection(shadow_ray, &point_hit) && point_hit.m_bsrdf->get_type() == Render::BSRDF_Type::kLight)
+            {
+                const Core::EvaluatedMaterial light_material = m_material_manager.evaluate_material(point_hit.m_bsrdf->get_material_id(), point_hit.mUV);
+                m_paths[path_index].m_payload += m_shadow_weights[path_index] * light_material.emissive;
+            }
+        });
     }
 }
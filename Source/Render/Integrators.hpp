@@ -4,6 +4,7 @@
 #include "Core/UpperLevelBVH.hpp"
 #include "Core/MaterialManager.hpp"
 #include "Core/Scene.hpp"
+#include "Core/Sampler.hpp"
 
 namespace Core
 {
@@ -20,7 +21,8 @@ namespace Render
         Integrator(const Core::Acceleration_Structures::UpperLevelBVH&, Core::MaterialManager&, const std::vector<Scene::Light>& light_bounds);
 
 
-        virtual glm::vec3 integrate_ray(const Scene::Camera& camera, const glm::uvec2& pixel, const uint32_t maxDepth) = 0;
+        // sample_index picks which of the pixel's samples is drawn from the sampler.
+        virtual glm::vec3 integrate_ray(const Scene::Camera& camera, const glm::uvec2& pixel, const uint32_t sample_index, const uint32_t maxDepth) = 0;
 
     protected:
 
@@ -34,27 +36,135 @@ namespace Render
     {
     public:
 
-        Monte_Carlo_Integrator(const Core::Acceleration_Structures::UpperLevelBVH&,  Core::MaterialManager&, const std::vector<Scene::Light> &light_bounds, const Scene::Sun& sun, const uint64_t seed);
+        Monte_Carlo_Integrator(const Core::Acceleration_Structures::UpperLevelBVH&,  Core::MaterialManager&, const std::vector<Scene::Light> &light_bounds, const Scene::Sun& sun,
+                               const Core::Rand::Sampler& sampler);
 
-        virtual glm::vec3 integrate_ray(const Scene::Camera& camera, const glm::uvec2& pixel, const uint32_t maxDepth) final;
+        virtual glm::vec3 integrate_ray(const Scene::Camera& camera, const glm::uvec2& pixel, const uint32_t sample_index, const uint32_t maxDepth) final;
+
+        // Integrates up to kRayPacketSize pixels at once, pixel_mask selects the active ones. The camera rays and their
+        // sun shadow rays are traced as packets, after the first bounce each path continues on its own.
+        void integrate_packet(const Scene::Camera& camera, const glm::uvec2* pixels, const uint32_t* sample_indices, const uint32_t pixel_mask, const uint32_t maxDepth,
+                              glm::vec3* results);
 
     private:
 
-        bool sample_direct_lighting(const Core::Acceleration_Structures::InterpolatedVertex& frag, const glm::vec3& wi, glm::vec3& radiance, float& pdf);
+        bool sample_direct_lighting(const Core::Acceleration_Structures::InterpolatedVertex& frag, const glm::vec3& wi, Core::Rand::Sample_Stream& samples, glm::vec3& radiance, float& pdf);
 
-        void trace_ray(const Core::Acceleration_Structures::InterpolatedVertex& frag, Core::Ray& ray, const uint32_t depth);
+        bool receives_direct_lighting(const Core::Acceleration_Structures::InterpolatedVertex& frag) const;
 
-        bool weighted_random_ray_type(const Core::EvaluatedMaterial& mat);
+        // Returns m_lights.size() when the sun is picked.
+        uint32_t select_light(Core::Rand::Sample_Stream& samples) const;
+
+        Core::Ray generate_sun_ray(const Core::Acceleration_Structures::InterpolatedVertex& frag) const;
 
-        std::mt19937_64 mGenerator;
-        std::uniform_real_distribution<float> mDistribution;
+        void shade_sun(const Core::Acceleration_Structures::InterpolatedVertex& frag, const glm::vec3& wi, const Core::EvaluatedMaterial& mat, glm::vec3& radiance, float& pdf) const;
 
-        Core::Rand::Hammersley_Generator m_hammersley_generator;
+        bool sample_light(const Core::Acceleration_Structures::InterpolatedVertex& frag, const glm::vec3& wi, const Core::EvaluatedMaterial& mat, const uint32_t light_index,
+                          Core::Rand::Sample_Stream& samples, glm::vec3& radiance, float& pdf);
 
-        uint32_t m_max_depth;
+        void trace_ray(const Core::Acceleration_Structures::InterpolatedVertex& frag, Core::Ray& ray, Core::Path_State& path, Core::Rand::Sample_Stream& samples, const uint32_t depth,
+                       const uint32_t max_depth);
+
+        // Russian roulette and the bounce along an already drawn sample.
+        void continue_path(const Core::Acceleration_Structures::InterpolatedVertex& frag, const Sample& sample, Core::Ray& ray, Core::Path_State& path,
+                           Core::Rand::Sample_Stream& samples, const uint32_t depth, const uint32_t max_depth);
+
+        bool weighted_random_ray_type(const Core::EvaluatedMaterial& mat);
+
+        const Core::Rand::Sampler& m_sampler;
 
         Scene::Sun m_sky_desc;
     };
+
+
+    // Traces a batch of paths one bounce at a time rather than one path at a time. Each bounce runs in stages
+    // (extend, shade, shadow) that are parallel loops over compacted queues of the paths that need them, with the
+    // path state kept in one array per field so a stage only touches what it uses.
+    class Wavefront_Integrator : public Integrator
+    {
+    public:
+
+        Wavefront_Integrator(const Core::Acceleration_Structures::UpperLevelBVH&,  Core::MaterialManager&, const std::vector<Scene::Light> &light_bounds, const Scene::Sun& sun,
+                             ThreadPool& thread_pool, const Core::Rand::Sampler& sampler, const bool sort_rays = false);
+
+        virtual glm::vec3 integrate_ray(const Scene::Camera& camera, const glm::uvec2& pixel, const uint32_t sample_index, const uint32_t maxDepth) final;
+
+        // Integrates sample sample_indices[i] of pixels[i] for each of the count pixels, writing them to results.
+        void integrate_pixels(const Scene::Camera& camera, const glm::uvec2* pixels, const uint32_t* sample_indices, const uint32_t count, const uint32_t maxDepth,
+                              glm::vec3* results);
+
+    private:
+
+        // Output queues for each chunk of a stage.
+        struct Chunk_State
+        {
+            std::vector<uint32_t> m_queues[2];
+        };
+
+        enum Queue : uint32_t
+        {
+            kPathQueue,
+            kShadowQueue
+        };
+
+        // Runs process(chunk, path_index) for every path in queue across the thread pool.
+        template<typename F>
+        void process_queue(const std::vector<uint32_t>& queue, F&& process);
+
+        // Moves what the chunks pushed to their queue in to output, in chunk order.
+        void gather_queue(const Queue queue, std::vector<uint32_t>& output);
+
+        // Stable sorts queue by key(path_index), so paths with equal keys keep their relative order.
+        template<typename F>
+        void sort_queue(std::vector<uint32_t>& queue, F&& key);
+
+        // Groups the active rays by direction octant and then by the Morton code of their origin within the bounds
+        // of every active origin, so rays that are traced together visit the same BVH nodes.
+        void sort_active_rays();
+
+        // Groups the hits by material so shading reuses the same BSRDF and textures.
+        void sort_hits();
+
+        // Finds the closest hit of every active path and queues the ones that need shading, paths that miss pick up
+        // the sky.
+        void extend(const uint32_t depth);
+
+        // Samples the BSRDF at every hit, queues a shadow ray when direct lighting is sampled and queues the bounce
+        // of the paths that survive russian roulette as the next active paths.
+        void shade(const uint32_t depth);
+
+        // Traces the shadow rays and adds the light they carry.
+        void shadow();
+
+        bool generate_shadow_ray(const Core::Acceleration_Structures::InterpolatedVertex& frag, const glm::vec3& wi, const glm::vec3& weight, const uint32_t path_index);
+
+        ThreadPool& m_thread_pool;
+        const Core::Rand::Sampler& m_sampler;
+        Scene::Sun  m_sky_desc;
+        uint32_t    m_max_depth;
+        bool        m_sort_rays;
+
+        std::vector<Chunk_State> m_chunks;
+
+        // Path state.
+        std::vector<Core::Ray>                                        m_rays;
+        std::vector<Core::Path_State>                                 m_paths;
+        std::vector<Core::Acceleration_Structures::InterpolatedVertex> m_vertices;
+        std::vector<Core::Rand::Sample_Stream>                        m_sample_streams;
+
+        // Shadow ray state, indexed by path as each path traces at most one per bounce.
+        std::vector<Core::Ray> m_shadow_rays;
+        std::vector<glm::vec3> m_shadow_weights;
+        std::vector<uint8_t>   m_shadow_occlusion_only; // Sun rays only need to be unoccluded, others must hit a light.
+
+        std::vector<uint32_t> m_active_queue;
+        std::vector<uint32_t> m_hit_queue;
+        std::vector<uint32_t> m_shadow_queue;
+
+        // Sorting scratch, kept between bounces to avoid reallocating.
+        std::vector<uint64_t> m_sort_keys;
+        std::vector<uint32_t> m_sorted_queue;
+    };
 }
 
 #endif
@@ -1,4 +1,5 @@
 #include "AliasTable.hpp"
+#include <algorithm>
 #include <numeric>
 
 namespace Util
@@ -86,11 +87,11 @@ namespace Util
         }
     }
 
-    uint32_t AliasTable::sample(Core::Rand::xorshift_random& rng, float& pdf) const
+    uint32_t AliasTable::sample(const glm::vec2& xi, float& pdf) const
     {
-        const uint32_t bucket_index = rng.next() % m_buckets.size();
+        const uint32_t bucket_index = std::min(static_cast<uint32_t>(xi.x * m_buckets.size()), static_cast<uint32_t>(m_buckets.size() - 1));
 
-        const float coin_flip = float(rng.next()) / float(rng.max());
+        const float coin_flip = xi.y;
         if(coin_flip <= m_buckets[bucket_index].m_weight)
         {
             pdf = m_buckets[bucket_index].m_weight / m_buckets.size();
@@ -1,9 +1,10 @@
 #ifndef PICO_ALIAS_TABLE_HPP
 #define PICO_ALIAS_TABLE_HPP
 
+#include <cstdint>
 #include <vector>
 
-#include "Core/RandUtils.hpp"
+#include "glm/vec2.hpp"
 
 namespace Util
 {
@@ -13,7 +14,8 @@ namespace Util
         AliasTable(const std::vector<float>& weights);
         AliasTable() = default;
 
-        uint32_t sample(Core::Rand::xorshift_random& rng, float& pdf) const;
+        // xi.x in [0, 1) picks the bucket and xi.y flips its coin.
+        uint32_t sample(const glm::vec2& xi, float& pdf) const;
 
         void build_table(const std::vector<float>& weights);
 
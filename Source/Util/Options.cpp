@@ -16,6 +16,15 @@ namespace Util
         m_sun_colour(1.0f, 1.0f, 1.0f),
         m_denoise(false),
         m_tonemap(false),
+        m_bvh_builder("SAH"),
+        m_bvh_cache(),
+        m_compressed_bvh_threshold(~0u),
+        m_compress_attributes(false),
+        m_geometry_budget(0),
+        m_flatten_instances("Auto"),
+        m_wavefront(false),
+        m_sort_rays(false),
+        m_sampler("Sobol"),
         m_option_bitset{0}
     {
         for(uint32_t i = 1; i < argCount; ++i)
@@ -101,6 +110,55 @@ namespace Util
                 m_option_bitset |= Option::kToneMap;
                 m_tonemap = true;
             }
+            else if(strcmp(cmd[i], "-BVHBuilder") == 0)
+            {
+                m_option_bitset |= Option::kBVHBuilder;
+                m_bvh_builder = std::string(cmd[++i]);
+            }
+            else if(strcmp(cmd[i], "-BVHCache") == 0)
+            {
+                m_option_bitset |= Option::kBVHCache;
+                m_bvh_cache = std::string(cmd[++i]);
+            }
+            else if(strcmp(cmd[i], "-CompressBVH") == 0)
+            {
+                const uint32_t triangle_count = std::atoi(cmd[++i]);
+
+                m_option_bitset |= Option::kCompressBVH;
+                m_compressed_bvh_threshold = triangle_count;
+            }
+            else if(strcmp(cmd[i], "-CompressAttributes") == 0)
+            {
+                m_option_bitset |= Option::kCompressAttributes;
+                m_compress_attributes = true;
+            }
+            else if(strcmp(cmd[i], "-GeometryBudget") == 0)
+            {
+                const uint32_t budget = std::atoi(cmd[++i]);
+
+                m_option_bitset |= Option::kGeometryBudget;
+                m_geometry_budget = budget;
+            }
+            else if(strcmp(cmd[i], "-FlattenInstances") == 0)
+            {
+                m_option_bitset |= Option::kFlattenInstances;
+                m_flatten_instances = std::string(cmd[++i]);
+            }
+            else if(strcmp(cmd[i], "-Wavefront") == 0)
+            {
+                m_option_bitset |= Option::kWavefront;
+                m_wavefront = true;
+            }
+            else if(strcmp(cmd[i], "-SortRays") == 0)
+            {
+                m_option_bitset |= Option::kSortRays;
+                m_sort_rays = true;
+            }
+            else if(strcmp(cmd[i], "-Sampler") == 0)
+            {
+                m_option_bitset |= Option::kSampler;
+                m_sampler = std::string(cmd[++i]);
+            }
             else
             {
                 printf("Unrecognised command %s \n", cmd[i]);
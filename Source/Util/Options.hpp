@@ -25,6 +25,15 @@ namespace Util
         kSunColour = 1 << 9,
         kDenoise = 1 << 10,
         kToneMap = 1 << 11,
+        kBVHBuilder = 1 << 12,
+        kBVHCache = 1 << 13,
+        kCompressBVH = 1 << 14,
+        kCompressAttributes = 1 << 15,
+        kGeometryBudget = 1 << 16,
+        kFlattenInstances = 1 << 17,
+        kWavefront = 1 << 18,
+        kSortRays = 1 << 19,
+        kSampler = 1 << 20,
 
         kCount = 10
     };
@@ -53,6 +62,15 @@ namespace Util
     glm::vec3   m_sun_colour;
     bool        m_denoise;
     bool        m_tonemap;
+    std::string m_bvh_builder;
+    std::string m_bvh_cache;
+    uint32_t    m_compressed_bvh_threshold;
+    bool        m_compress_attributes;
+    uint32_t    m_geometry_budget; // In MB.
+    std::string m_flatten_instances;
+    bool        m_wavefront;
+    bool        m_sort_rays;
+    std::string m_sampler;
 
     private:
     uint32_t m_option_bitset;
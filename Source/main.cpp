@@ -78,6 +78,8 @@ int main(int argc, const char **argv)
         params.m_maxVariance = 0.0f;
         params.m_denoise = options.m_denoise;
         params.m_tonemap = options.m_tonemap;
+        params.m_wavefront = options.m_wavefront;
+        params.m_sort_rays = options.m_sort_rays;
 
         const glm::vec3 camera_pos = options.m_camera_position;
         const glm::vec3 camera_dir = options.m_camera_direction;